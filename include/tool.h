@@ -27,13 +27,20 @@
 #include "tool/color.h"
 #include "tool/text.h"
 #include "tool/memory.h"
+#include "tool/atomic.h"
+#include "tool/queue.h"
 #include "tool/variadic.h"
 #include "tool/random.h"
 #include "tool/linking.h"
 #include "tool/exception.h"
 #include "tool/threading.h"
+#include "tool/task.h"
+#include "tool/topology.h"
+#include "tool/parallel.h"
 #include "tool/temporal.h"
 #include "tool/io.h"
+#include "tool/async.h"
+#include "tool/writer.h"
 #include "tool/utility.h"
 
 // Mathematics and linear algebra
@@ -0,0 +1,146 @@
+#ifndef _TOOL_ASYNC_H
+#define _TOOL_ASYNC_H
+
+#include "basics.h"
+#include "memory.h"
+#include "atomic.h"
+#include "threading.h"
+#include "io.h"
+
+
+
+//~ Definitions
+
+#define TOOL_IO_ENGINE_DEPTH 4096            // Default limit of requests in flight
+#define TOOL_IO_ENGINE_FALLBACK_THREADS 8    // Threads blocking on transfers when io_uring is unavailable
+#define TOOL_IO_ENGINE_BUFFER_ALIGNMENT 4096 // Registered buffers are whole pages, as pages are pinned whole
+
+
+
+namespace Tool
+{
+    //- Types
+    // Asynchronous file transfers. On Linux, requests go through an io_uring, submitted in batches and completed
+    // by a thread of the engine. Elsewhere, or where io_uring is unavailable, a pool of threads makes blocking calls.
+    
+    //~ Request
+    
+    struct IORequest;
+    struct IOEngine;
+    
+    // Runs on the engine's completion thread or on a fallback thread, so should be short and not block on other requests
+    typedef void (*IORequestFunction)(IORequest* request, void* data);
+    
+    enum IORequestType
+    {
+        IORequestTypeRead,
+        IORequestTypeWrite
+    };
+    
+    struct IORequest
+    {
+        IORequestType type;
+        File file;
+        void* buffer;
+        u64 size;
+        u64 offset;
+        
+        // Called on completion, after which the request belongs to the callback. Without one, the request
+        // is marked done instead, for IORequestWait.
+        IORequestFunction callback;
+        void* data;
+        
+        i64 result;       // Bytes transferred, or the negated error code on failure
+        u64 transferred;  // Bytes transferred so far, as short transfers are continued
+        u32 done;
+        IOEngine* engine;
+        IORequest* next; // In the queue of requests the completion thread submits
+    };
+    
+    //~ Engine
+    
+    enum IOEngineFlags
+    {
+        IOEngineFlagsFallback = 1 << 0 // Uses the thread fallback even where io_uring is available
+    };
+    
+    struct IOEngine
+    {
+        b8 uring; // Whether the io_uring backend is in use
+        u32 depth;
+        
+        // Submission and completion rings, shared with the kernel
+        i32 ringDescriptor;
+        void* submissionRing;
+        u64 submissionRingSize;
+        void* completionRing;
+        u64 completionRingSize;
+        void* submissionEntries;
+        u64 submissionEntriesSize;
+        
+        u32* submissionTail;
+        u32* submissionArray;
+        u32 submissionMask;
+        u32 submissionCount;
+        u32* completionHead;
+        u32* completionTail;
+        void* completions;
+        u32 completionMask;
+        
+        SpinMutex submitLock;
+        Thread completionThread;
+        
+        // Continuations and callback submissions of the completion thread, which it sends to the kernel once
+        // it has drained the completion ring, so that it never waits on a full ring itself
+        IORequest* deferredFirst;
+        IORequest* deferredLast;
+        
+        ThreadPool* fallback;
+        
+        // Registered buffers, allocated on an arena
+        u8* buffers;
+        u64 bufferSize;
+        u32 bufferCount;
+        
+        // Requests submitted but not yet completed, which full engines and IOEngineWait sleep on
+        alignas(TOOL_CACHE_LINE_SIZE) u32 inFlight;
+        u32 inFlightWaiters;
+    };
+    
+    
+    
+    //- Functions
+    
+    //~ Engine
+    
+    // Sets up an engine allowing 'depth' requests in flight, which is rounded up to a power of 2.
+    // Files used with the engine should be opened with OpenFlagsAsynchronous.
+    void IOEngineCreate(IOEngine* engine, u32 depth = TOOL_IO_ENGINE_DEPTH, i32 flags = 0);
+    void IOEngineDestroy(IOEngine* engine); // Waits for the requests in flight first
+    
+    // Allocates 'count' page-aligned buffers of 'size' bytes on the arena, and registers them with the kernel
+    // so that transfers within one of them skip mapping it every time. Replaces previously registered buffers.
+    void IOEngineRegisterBuffers(IOEngine* engine, Arena* arena, u32 count, u64 size);
+    void* IOEngineBuffer(IOEngine* engine, u32 index);
+    
+    //~ Requests
+    
+    // Starts the requests, in a single system call where possible. Blocks while the engine is full,
+    // except on its completion thread, where callbacks may submit follow-up requests without limit.
+    void IOEngineSubmit(IOEngine* engine, IORequest* const* requests, u32 count);
+    void IOEngineSubmit(IOEngine* engine, IORequest* request);
+    
+    // Fills and submits a request
+    void IOEngineRead(IOEngine* engine, IORequest* request, File file, void* destination, u64 size, u64 offset,
+                      IORequestFunction callback = nullptr, void* data = nullptr);
+    void IOEngineWrite(IOEngine* engine, IORequest* request, File file, const void* source, u64 size, u64 offset,
+                       IORequestFunction callback = nullptr, void* data = nullptr);
+    
+    // Blocks until the request, which has no callback, is done. Returns its result.
+    i64 IORequestWait(IORequest* request);
+    
+    // Blocks until every request submitted so far is done, including callbacks.
+    void IOEngineWait(IOEngine* engine);
+}
+
+#endif //_TOOL_ASYNC_H
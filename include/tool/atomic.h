@@ -0,0 +1,131 @@
+#ifndef _TOOL_ATOMIC_H
+#define _TOOL_ATOMIC_H
+
+#include "basics.h"
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define TOOL_ATOMIC_MSVC 1
+#endif
+
+
+
+//~ Definitions
+
+#define TOOL_CACHE_LINE_SIZE 64
+
+
+
+namespace Tool
+{
+    //- Type definitions
+
+    //~ Spin lock
+
+    // Minimal lock for very short critical sections. Zero-initialized means unlocked.
+    typedef u32 SpinLock;
+
+
+
+    //- Atomic operations
+    // Operate on naturally aligned 32- and 64-bit integers (and pointers).
+    // Loads acquire, stores release, read-modify-write operations are sequentially consistent.
+
+    //~ Compiler builtin implementation
+
+#ifndef TOOL_ATOMIC_MSVC
+
+    template<typename T> inline T AtomicLoad(const T* target) { return __atomic_load_n(target, __ATOMIC_ACQUIRE); }
+    template<typename T> inline T AtomicLoadRelaxed(const T* target) { return __atomic_load_n(target, __ATOMIC_RELAXED); }
+
+    template<typename T> inline void AtomicStore(T* target, T value) { __atomic_store_n(target, value, __ATOMIC_RELEASE); }
+    template<typename T> inline void AtomicStoreRelaxed(T* target, T value) { __atomic_store_n(target, value, __ATOMIC_RELAXED); }
+
+    // Returns the previous value
+    template<typename T> inline T AtomicAdd(T* target, T value) { return __atomic_fetch_add(target, value, __ATOMIC_SEQ_CST); }
+    template<typename T> inline T AtomicExchange(T* target, T value) { return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST); }
+
+    // Value of true indicates the exchange happened. Otherwise, 'expected' is updated with the current value.
+    template<typename T> inline b8 AtomicCompareExchange(T* target, T* expected, T desired)
+    {
+        return __atomic_compare_exchange_n(target, expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    }
+
+    inline void AtomicFence() { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+
+    // Hints the processor that the calling thread is busy-waiting
+    inline void SpinPause()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        __asm__ __volatile__("yield");
+#endif
+    }
+
+#endif
+
+    //~ MSVC intrinsic implementation
+
+#ifdef TOOL_ATOMIC_MSVC
+
+    // Plain aligned loads and stores are acquire/release on x64, so only the compiler has to be restrained.
+    template<typename T> inline T AtomicLoad(const T* target) { T value = *(volatile const T*)target; _ReadWriteBarrier(); return value; }
+    template<typename T> inline T AtomicLoadRelaxed(const T* target) { return *(volatile const T*)target; }
+
+    template<typename T> inline void AtomicStore(T* target, T value) { _ReadWriteBarrier(); *(volatile T*)target = value; }
+    template<typename T> inline void AtomicStoreRelaxed(T* target, T value) { *(volatile T*)target = value; }
+
+    template<typename T> inline T AtomicAdd(T* target, T value)
+    {
+        if constexpr (sizeof(T) == 4) return (T)_InterlockedExchangeAdd((volatile long*)target, (long)value);
+        else return (T)_InterlockedExchangeAdd64((volatile long long*)target, (long long)value);
+    }
+
+    template<typename T> inline T AtomicExchange(T* target, T value)
+    {
+        if constexpr (sizeof(T) == 4) return (T)_InterlockedExchange((volatile long*)target, (long)value);
+        else return (T)_InterlockedExchange64((volatile long long*)target, (long long)value);
+    }
+
+    template<typename T> inline b8 AtomicCompareExchange(T* target, T* expected, T desired)
+    {
+        T previous;
+        if constexpr (sizeof(T) == 4) previous = (T)_InterlockedCompareExchange((volatile long*)target, (long)desired, (long)*expected);
+        else previous = (T)_InterlockedCompareExchange64((volatile long long*)target, (long long)desired, (long long)*expected);
+
+        b8 exchanged = previous == *expected;
+        *expected = previous;
+        return exchanged;
+    }
+
+    inline void AtomicFence() { _mm_mfence(); }
+
+    inline void SpinPause() { _mm_pause(); }
+
+#endif
+
+    //~ Spin lock
+
+    inline b8 SpinLockTryAcquire(SpinLock* lock)
+    {
+        return AtomicLoadRelaxed(lock) == 0 && AtomicExchange(lock, 1u) == 0;
+    }
+
+    inline void SpinLockAcquire(SpinLock* lock)
+    {
+        while (!SpinLockTryAcquire(lock))
+        {
+            SpinPause();
+        }
+    }
+
+    inline void SpinLockRelease(SpinLock* lock)
+    {
+        AtomicStore(lock, 0u);
+    }
+}
+
+
+
+#endif //_TOOL_ATOMIC_H
@@ -6,12 +6,21 @@
 
 
 
+//~ Definitions
+
+#define TOOL_FILE_DEFAULT_ALIGNMENT 4096 // Assumed for unbuffered transfers where the system does not tell
+#define TOOL_FILE_BUFFER_ALIGNMENT 4096  // Start of buffers from FileBufferAlloc, a page, satisfying common sector sizes
+
+
+
 namespace Tool
 {
     //- Types 
     
     //~ File
     
+    // Handle of an opened file, with zero meaning none.
+    // On Linux, holds the file descriptor plus one, and the alignment of unbuffered files in the upper half.
     typedef u64 File;
     
     enum OpenMode
@@ -29,16 +38,18 @@ namespace Tool
     
     enum OpenFlags
     {
-        // Unbuffered reads have more strict requirements
-        // Reads must be aligned to sector boundaries
+        // Bypasses the system cache, keeping large scans from evicting other cached data
+        // Buffers, sizes and offsets of transfers must be multiples of FileAlignment
+        // On Linux, filesystems without direct access (such as tmpfs) open the file buffered instead
         OpenFlagsUnbuffered   = 1 << 0,
         
-        // Allow overlapping asynchronous access to the opened file
+        // Allow overlapping asynchronous access to the opened file, as needed by IOEngine on Windows
         // By default, when this flag is not set, access operations are serialized
-        //OpenFlagsAsynchronous = 1 << 1,
+        // Files always allow it on Linux
+        OpenFlagsAsynchronous = 1 << 1,
         
         // Allows subsequent calls that also set this flag to read from the same, already
-        // opened file
+        // opened file. Files are always shared on Linux
         OpenFlagsShareRead    = 1 << 2,
         
         // Allows subsequent calls that also set this flag to write to the same, already
@@ -46,6 +57,39 @@ namespace Tool
         OpenFlagsShareWrite   = 1 << 3
     };
     
+    //~ File mapping
+    
+    enum FileMapMode
+    {
+        FileMapModeRead,        // Writing to the mapping faults
+        FileMapModeCopyOnWrite, // Written pages become private copies, never reaching the file
+        FileMapModeWrite        // Written pages reach the file, and are seen by every other mapping of it
+    };
+    
+    enum FileMapHint
+    {
+        FileMapHintNormal,
+        FileMapHintSequential, // Reads ahead aggressively, and drops pages soon after they are read
+        FileMapHintRandom,     // Reads only the pages touched
+        FileMapHintWillNeed,   // Starts reading the range in ahead of time
+        FileMapHintDontNeed    // Releases the pages of the range, which are read again if touched. Drops copy-on-write changes
+    };
+    
+    // View of a range of a file in memory, read directly from the page cache
+    struct FileMapping
+    {
+        void* data; // Start of the requested range
+        u64 size;
+        
+        // Whole view, starting at the offset rounded down to the system's mapping granularity
+        void* view;
+        u64 viewSize;
+        
+        // On Windows, the file mapping object, and a duplicate of the file to flush write mappings
+        u64 handle;
+        File file;
+    };
+    
     
     
     //- Usage and helper functions
@@ -59,10 +103,50 @@ namespace Tool
     void FileClose(File file);
     
     u64 FileSize(File file);
-    void FileRead(File file, void* destination, u32 size, u32* outSize = nullptr);
-    void FileWrite(File file, const void* source, u32 size, u32* outSize = nullptr);
     
-    b8 FileDump(const c8* filename, void** outDump, u32* outSize, MemoryAllocator allocator);
+    // Blocks until the data written so far is durable, along with the metadata needed to read it back (like the size).
+    void FileSync(File file);
+    
+    // Transfers at the file position and moves it forward. Reads stop early at the end of the file,
+    // so 'outSize' can be smaller than the requested size.
+    void FileRead(File file, void* destination, u64 size, u64* outSize = nullptr);
+    void FileWrite(File file, const void* source, u64 size, u64* outSize = nullptr);
+    
+    // Transfers at the given offset, without using the file position, so that threads can share a file.
+    // On Windows, the file position still ends up after the transfer.
+    void FileReadAt(File file, void* destination, u64 size, u64 offset, u64* outSize = nullptr);
+    void FileWriteAt(File file, const void* source, u64 size, u64 offset, u64* outSize = nullptr);
+    
+    //~ Unbuffered IO
+    
+    // Alignment unbuffered transfers of the file need, in bytes. On Linux, 1 for buffered files. On Windows,
+    // the sector size of the volume either way.
+    u32 FileAlignment(File file);
+    
+    // Whether a transfer meets the alignment of the file. Misaligned unbuffered transfers raise an exception saying so.
+    b8 FileAligned(File file, const void* buffer, u64 size, u64 offset);
+    
+    // Commits 'size' more bytes of a reserved region, rounded up to pages, and returns their page-aligned start.
+    // Release them all with RegionRevert or RegionDealloc.
+    void* FileBufferAlloc(MemoryRegion* region, u64 size);
+    
+    // Reads the whole file onto the allocator, followed by a null terminator. See FileMap to avoid the copy.
+    b8 FileDump(const c8* filename, void** outDump, u64* outSize, MemoryAllocator allocator);
+    
+    //~ File mapping
+    
+    // Maps 'size' bytes of the file from 'offset', or up to its end for zero. Write mappings need write access
+    // to the file, other modes only read access. The file can be closed while mapped.
+    // Value of false indicates the range is outside the file, or the file cannot be mapped with the mode.
+    b8 FileMap(FileMapping* outMapping, File file, FileMapMode mode = FileMapModeRead, u64 offset = 0, u64 size = 0);
+    void FileUnmap(FileMapping* mapping);
+    
+    // Applies to a range within the mapping, or all of it for zero size. Only WillNeed has an effect on Windows.
+    void FileMapAdvise(FileMapping* mapping, FileMapHint hint, u64 offset = 0, u64 size = 0);
+    
+    // Writes the changed pages of a FileMapModeWrite range back to the file, returning once they are written,
+    // or only starting the writes when not waiting.
+    void FileMapFlush(FileMapping* mapping, u64 offset = 0, u64 size = 0, b8 wait = true);
     
 }
 
@@ -2,33 +2,104 @@
 #define _TOOL_MEMORY_H
 
 #include "basics.h"
+#include "atomic.h"
 
 
 
 //~ Definitions
 
+// Alignment of heap and MemoryAllocator allocations unless requested otherwise
+#define TOOL_DEFAULT_ALIGNMENT 16
+
+// Widest aligned vector access used by the intrinsics
+#define TOOL_SIMD_ALIGNMENT 32
+
 #define TOOL_ARENA_COMMIT_SIZE 1024
 #define TOOL_ARENA_MAX_INCREMENT_SIZE 64 * 1024 * 1024
 
+// Popping trims arenas committing more than the minimum once their size drops below a quarter of the committed range,
+// down to twice their size. The gap between the trim and growth thresholds keeps arenas from thrashing.
+#define TOOL_ARENA_TRIM_MINIMUM (1024 * 1024)
+
+// Thread-local scratch arenas, lazily initialized per thread
+#define TOOL_SCRATCH_COUNT 2
+#define TOOL_SCRATCH_RESERVE_SIZE (4ull * 1024 * 1024 * 1024)
+
+// Number of slots moved between a pool cache and its pool at a time
+#define TOOL_POOL_CACHE_SIZE 64
+
+// Classic heap: small allocations are served from size-classed spans within one reserved range
+#define TOOL_HEAP_RESERVE_SIZE (64ull * 1024 * 1024 * 1024)
+#define TOOL_HEAP_SPAN_SIZE (64 * 1024)
+#define TOOL_HEAP_MAX_SMALL_SIZE (32 * 1024)
+#define TOOL_HEAP_CLASS_COUNT 40
+#define TOOL_HEAP_TRANSFER_SIZE (16 * 1024) // Bytes moved between thread caches and the shared lists at a time
+#define TOOL_HEAP_LARGE_GRANULARITY 4096 // Large blocks are mapped in multiples of this size
+
+// Allocation statistics are only collected when TOOL_MEMORY_STATS is defined, see the CMake option of the same name.
+// Allocation sizes are counted in power of 2 buckets.
+#define TOOL_MEMORY_STATS_BUCKET_COUNT 48
+
 
 
 namespace Tool
 {
     //- Struct definitions
     
+    //~ Memory statistics
+    
+    // Usage of a single allocator. Sizes are in bytes. Only the heap counts live sizes by usable block size.
+    struct MemoryStats
+    {
+        const c8* name;
+        
+        u64 liveSize;
+        u64 peakSize; // Highest live size so far
+        u64 committedSize;
+        u64 reservedSize;
+        
+        u64 allocationCount;
+        u64 deallocationCount; // Arena frames and circular buffers are popped without counting deallocations
+        u64 commitCount;
+        u64 decommitCount;
+        
+        u64 sizeHistogram[TOOL_MEMORY_STATS_BUCKET_COUNT]; // Allocations with a size in [2^i, 2^(i+1)), zero sizes in the first
+        
+        MemoryStats* next; // Registry link
+    };
+    
     //~ Memory region
     
+    enum RegionFlags
+    {
+        // Requests transparent huge pages for the region (MADV_HUGEPAGE). Ignored on Windows.
+        RegionFlagsHugePages         = 1 << 0,
+        
+        // Maps the region with explicit huge pages from the system pool (MAP_HUGETLB). Ignored on Windows.
+        // Sizes are rounded to the huge page size. Combine with prefaulting to surface pool exhaustion as an exception.
+        RegionFlagsHugePagesExplicit = 1 << 1,
+        
+        // Populates pages as they are committed, moving page fault cost out of later accesses.
+        RegionFlagsPrefault          = 1 << 2,
+        
+        // Reverted pages are freed lazily (MADV_FREE), only reclaimed under memory pressure. Ignored on Windows.
+        // Cheaper to revert and re-commit, but resident memory drops later.
+        RegionFlagsLazyFree          = 1 << 3
+    };
+    
     struct MemoryRegion
     {
         void* start = nullptr;
         u64 reserved;
         u64 committed;
+        
+        i32 flags = 0; // Set before reserving, see RegionFlags
     };
     
     //~ Memory loop
     
     // Handle to anonymous memory, without inherent address space.
-    // Represents a file mapping on Windows, backed by the page file.
+    // Represents a file mapping on Windows, backed by the page file, and a memfd file descriptor on Linux.
     typedef void* AnonymousMemory;
     
     struct MemoryLoop
@@ -41,6 +112,22 @@ namespace Tool
     
     //~ Arena
     
+    enum ArenaFlags
+    {
+        // Allows simultaneous ArenaAlloc calls from multiple threads, using an atomic bump of the head.
+        // Pushing and popping frames, and two-step allocations, still have to be synchronized externally.
+        ArenaFlagsConcurrent = 1 << 0,
+        
+        // Forwarded to the underlying region, see RegionFlags.
+        ArenaFlagsHugePages         = 1 << 1,
+        ArenaFlagsHugePagesExplicit = 1 << 2,
+        ArenaFlagsPrefault          = 1 << 3,
+        ArenaFlagsLazyFree          = 1 << 4,
+        
+        // Disables trimming of the committed range when popping frames.
+        ArenaFlagsNoTrim            = 1 << 5
+    };
+    
     struct ArenaFrame
     {
         void* start = nullptr;
@@ -55,6 +142,13 @@ namespace Tool
         
         void* startCurrent = nullptr;
         u64 sizeCurrent;
+        
+        i32 flags;
+        SpinLock commitLock; // Only used by concurrent arenas, when growing the committed range
+        
+#ifdef TOOL_MEMORY_STATS
+        MemoryStats* stats = nullptr;
+#endif
     };
     
     //~ Circular buffer
@@ -64,11 +158,48 @@ namespace Tool
         MemoryLoop loop;
         u64 start;
         u64 size;
+        
+#ifdef TOOL_MEMORY_STATS
+        MemoryStats* stats = nullptr;
+#endif
+    };
+    
+    //~ Pool
+    
+    enum PoolFlags
+    {
+        // Allows simultaneous allocations and deallocations from multiple threads, guarded by a spin lock.
+        // Combine with a PoolCache per thread to avoid the lock in the common case.
+        PoolFlagsConcurrent = 1 << 0
+    };
+    
+    struct Pool
+    {
+        MemoryRegion region;
+        
+        u64 slotSize;
+        u64 slotCount; // Number of slots carved out of the region so far
+        void* freeList; // Linked through the first bytes of each free slot
+        
+        i32 flags;
+        SpinLock lock;
+        
+#ifdef TOOL_MEMORY_STATS
+        MemoryStats* stats = nullptr;
+#endif
+    };
+    
+    // Thread-owned cache of free slots, exchanged with the pool in batches.
+    struct PoolCache
+    {
+        Pool* pool;
+        void* freeList;
+        u32 count;
     };
     
     //~ Allocator
     
-    typedef void* (*AllocateFunction)(u64 size, void* data);
+    typedef void* (*AllocateFunction)(u64 size, u64 alignment, void* data);
     typedef void (*DeallocateFunction)(void* target, void* data);
     
     struct MemoryAllocator
@@ -84,26 +215,32 @@ namespace Tool
     
     //~ Heap functionality
     
+    // Thread-safe general purpose allocation. Contents are not zero-initialized, and are aligned to at least 16 bytes.
+    // Sizes up to TOOL_HEAP_MAX_SMALL_SIZE are served from per-thread caches without system calls, larger sizes are mapped directly.
     void* ClassicAlloc(u64 size); 
     void* ClassicAlloc(u64 count, u64 size);
-    template<typename T> inline T* ClassicAlloc() { return (T*)ClassicAlloc(sizeof(T)); }
+    
+    // Alignment has to be a power of 2. Reallocating only keeps TOOL_DEFAULT_ALIGNMENT guaranteed.
+    void* ClassicAllocAligned(u64 size, u64 alignment);
+    template<typename T> inline T* ClassicAlloc() { return (T*)ClassicAllocAligned(sizeof(T), alignof(T)); }
     
     void ClassicDealloc(void* start);
     
+    // Resizes an allocation, moving it if needed. Large blocks are remapped on Linux rather than copied.
     void ClassicRealloc(void** target, u64 currentSize, u64 newSize);
     void ClassicRealloc(void** target, u64 currentCount, u64 newCount, u64 size);
     
     //~ Memory region
     
-    // Initializes/reserves uninitialized region.
+    // Initializes/reserves uninitialized region, according to its flags.
     void RegionReserve(MemoryRegion* region, u64 size);
     void RegionReserve(MemoryRegion* region, u64 count, u64 size);
     
-    // Commits reserved memory pages. Cannot commit beyond reserved range.
+    // Commits reserved memory pages. Cannot commit beyond reserved range. Populates the pages with RegionFlagsPrefault.
     void RegionCommit(MemoryRegion* region, u64 newSize);    
     void RegionCommit(MemoryRegion* region, u64 newCount, u64 size);    
     
-    // De-commits committed memory pages, reverting them to "reserved".
+    // De-commits committed memory pages, reverting them to "reserved" and returning them to the system.
     void RegionRevert(MemoryRegion* region, u64 newSize); 
     void RegionRevert(MemoryRegion* region, u64 newCount, u64 size);
     
@@ -127,31 +264,58 @@ namespace Tool
     //~ Arena
     
     // Initializes and reserves memory arena. The allocated arena size may never exceed 'reservedSize'.
-    void ArenaInit(Arena* arena, u64 reservedSize);
+    void ArenaInit(Arena* arena, u64 reservedSize, i32 flags = 0);
+    
+    // Commits at least 'size' bytes of the arena up front, populating them with ArenaFlagsPrefault.
+    void ArenaCommit(Arena* arena, u64 size);
     
-    // Allocates space within the current arena frame.
+    // Allocates space within the current arena frame. Thread-safe for arenas initialized with ArenaFlagsConcurrent.
     void* ArenaAlloc(Arena* arena, u64 size);
     void* ArenaAlloc(Arena* arena, u64 count, u64 size);
-    template<typename T> inline T* ArenaAlloc(Arena* arena) { return (T*)ArenaAlloc(arena, sizeof(T)); }
+    
+    // Allocates space aligned to a power of 2 no larger than the page size, padding the current frame as needed.
+    void* ArenaAllocAligned(Arena* arena, u64 size, u64 alignment);
+    template<typename T> inline T* ArenaAlloc(Arena* arena) { return (T*)ArenaAllocAligned(arena, sizeof(T), alignof(T)); }
+    
+    // Resizes an allocation. The most recent allocation of the current frame grows or shrinks in place,
+    // while others are copied to a new allocation when growing. Concurrent arenas resize in place only if no allocation followed.
+    void ArenaRealloc(Arena* arena, void** target, u64 currentSize, u64 newSize);
+    void ArenaRealloc(Arena* arena, void** target, u64 currentCount, u64 newCount, u64 size);
     
     // Allocates space in two steps, retrieving the location first, then committing the space.
     // No safety features synchronize mulitple simultaneous allocations, which has to be external.
+    // Not available for concurrent arenas.
     void* ArenaAllocBegin(Arena* arena, u64 reservedSize);
     void* ArenaAllocEnd(Arena* arena, u64 actualSize); // Actual size should always be <= reserved size
     
     // Places new object onto the current arena frame
     // WARNING: objects created this way will NOT automatically destruct when popping the arena frame!
-    template<typename T, class... Args> inline T* ArenaPlace(Arena* arena, Args&&... args) { return new ((T*)Tool::ArenaAlloc(arena, sizeof(T))) T((Args&&...)args...); }
+    template<typename T, class... Args> inline T* ArenaPlace(Arena* arena, Args&&... args) { return new ((T*)Tool::ArenaAllocAligned(arena, sizeof(T), alignof(T))) T(((Args&&)args)...); }
     
     // Pushes a new arena frame.
     void ArenaPush(Arena* arena);
     
     // Pops the current arena frame. Throws an exception if currently in frame 0.
+    // Trims the committed range if the arena has shrunk sufficiently, see TOOL_ARENA_TRIM_MINIMUM.
     void ArenaPop(Arena* arena);
     
+    // Reverts all committed memory beyond the current arena size.
+    void ArenaTrim(Arena* arena);
+    
     // De-initializes and frees memory arena.
     void ArenaDeInit(Arena* arena);
     
+    //~ Scratch arena
+    
+    // Pushes a frame onto one of the calling thread's scratch arenas, for temporary allocations.
+    // The returned arena is never one of the 'conflicts', which should include every arena the caller allocates results onto.
+    // Release with ArenaScratchEnd, in reverse order of acquisition.
+    Arena* ArenaScratchBegin(Arena* const* conflicts = nullptr, i32 conflictCount = 0);
+    Arena* ArenaScratchBegin(MemoryAllocator conflict); // Conflicts with the allocator's arena, if it has one
+    
+    // Pops the frame pushed by ArenaScratchBegin.
+    void ArenaScratchEnd(Arena* scratch);
+    
     //~ Circular buffer
     
     // Initialize and allocate a new circular buffer. The actual size and overflow region might be larger than requested.
@@ -160,7 +324,10 @@ namespace Tool
     // Allocate space within the circular buffer. Nullptr indicates insufficient space.
     void* CircularAlloc(Circular* circular, u64 size);
     void* CircularAlloc(Circular* circular, u64 count, u64 size);
-    template<typename T> inline T* CircularAlloc(Circular* circular) { return (T*)CircularAlloc(circular, sizeof(T)); }
+    
+    // Allocates space aligned to a power of 2 no larger than the page size. Nullptr indicates insufficient space.
+    void* CircularAllocAligned(Circular* circular, u64 size, u64 alignment);
+    template<typename T> inline T* CircularAlloc(Circular* circular) { return (T*)CircularAllocAligned(circular, sizeof(T), alignof(T)); }
     
     // Allocates space in two steps, similarly to the same Arena feature.
     void* CircularAllocBegin(Circular* circular, u64 reservedSize);
@@ -168,7 +335,7 @@ namespace Tool
     
     // Places new object onto the circular buffer.
     // WARNING: objects created this way will NOT automatically destruct when popping the arena frame!
-    template<typename T, class... Args> inline T* CircularPlace(Circular* circular, Args&&... args) { return new ((T*)Tool::CircularAlloc(circular, sizeof(T))) T((Args&&...)args...); }
+    template<typename T, class... Args> inline T* CircularPlace(Circular* circular, Args&&... args) { return new ((T*)Tool::CircularAllocAligned(circular, sizeof(T), alignof(T))) T(((Args&&)args)...); }
     
     // Get a reference to the current writing location (bookmark).
     // Can be used to then get a data pointer, or deallocate everything prior to the bookmark.
@@ -179,21 +346,68 @@ namespace Tool
     // Deinitialize the circular buffer.
     void CircularDeInit(Circular* circular);
     
+    //~ Pool
+    
+    // Initializes a pool of fixed-size slots, rounded up to 16 bytes. The pool may never hold more than 'reservedCount' slots.
+    // Slots are aligned to the largest power of 2 (up to the page size) dividing the slot size.
+    void PoolInit(Pool* pool, u64 slotSize, u64 reservedCount, i32 flags = 0);
+    
+    // Allocates or deallocates a single slot in constant time.
+    void* PoolAlloc(Pool* pool);
+    template<typename T> inline T* PoolAlloc(Pool* pool) { return (T*)PoolAlloc(pool); }
+    void PoolDealloc(Pool* pool, void* slot);
+    
+    // Places new object into a pool slot.
+    // WARNING: objects created this way will NOT automatically destruct when deallocating the slot!
+    template<typename T, class... Args> inline T* PoolPlace(Pool* pool, Args&&... args) { return new ((T*)Tool::PoolAlloc(pool)) T(((Args&&)args)...); }
+    
+    // De-initializes the pool, freeing every slot at once.
+    void PoolDeInit(Pool* pool);
+    
+    //~ Pool cache
+    
+    // Caches are owned by a single thread. Slots may be deallocated through any cache of the same pool.
+    void PoolCacheInit(PoolCache* cache, Pool* pool);
+    void* PoolCacheAlloc(PoolCache* cache);
+    void PoolCacheDealloc(PoolCache* cache, void* slot);
+    
+    // Returns every cached slot to the pool. Should be called before the owning thread exits.
+    void PoolCacheFlush(PoolCache* cache);
+    
     //~ Allocators
     
     // Produces an allocator
     MemoryAllocator Allocator();                   // Heap
     MemoryAllocator Allocator(Arena* arena);       // Arena
     MemoryAllocator Allocator(Circular* circular); // Circular buffer
+    MemoryAllocator Allocator(Pool* pool);         // Pool, allocations may not exceed the slot size
     
-    // Allocates space using the given allocator method
+    // Allocates space using the given allocator method, aligned to TOOL_DEFAULT_ALIGNMENT
     void* AllocatorAlloc(MemoryAllocator allocator, u64 size);
     void* AllocatorAlloc(MemoryAllocator allocator, u64 count, u64 size);
-    template<typename T> inline T* AllocatorAlloc(MemoryAllocator allocator) { return (T*)AllocatorAlloc(allocator, sizeof(T)); }
+    
+    // Allocates space aligned to a power of 2, such as TOOL_SIMD_ALIGNMENT or TOOL_CACHE_LINE_SIZE
+    void* AllocatorAllocAligned(MemoryAllocator allocator, u64 size, u64 alignment);
+    template<typename T> inline T* AllocatorAlloc(MemoryAllocator allocator) { return (T*)AllocatorAllocAligned(allocator, sizeof(T), alignof(T) > TOOL_DEFAULT_ALIGNMENT ? alignof(T) : TOOL_DEFAULT_ALIGNMENT); }
     
     // Deallocates previously allocated data. This might (intentionally) not do anything for certain allocators. 
     void AllocatorDealloc(MemoryAllocator allocator, void* target);
     
+    //~ Memory statistics
+    // Every initialized Arena, Circular and Pool registers its statistics, listed after the heap.
+    // Without TOOL_MEMORY_STATS, nothing is recorded and snapshots are empty.
+    
+    // Names an initialized allocator in snapshots. The name has to outlive the allocator.
+    void MemoryStatsName(Arena* arena, const c8* name);
+    void MemoryStatsName(Circular* circular, const c8* name);
+    void MemoryStatsName(Pool* pool, const c8* name);
+    
+    // Copies the statistics of up to 'capacity' allocators, returning the number of registered allocators.
+    u64 MemoryStatsSnapshot(MemoryStats* buffer, u64 capacity);
+    
+    // Formats a snapshot as null-terminated text, one line per allocator followed by its non-empty histogram buckets.
+    const c8* MemoryStatsReport(Arena* arena);
+    
 }
 
 
@@ -0,0 +1,505 @@
+#ifndef _TOOL_PARALLEL_H
+#define _TOOL_PARALLEL_H
+
+#include "basics.h"
+#include "atomic.h"
+#include "memory.h"
+#include "threading.h"
+#include "utility.h"
+
+
+
+//~ Definitions
+
+#define TOOL_PARALLEL_SERIAL_THRESHOLD 16384 // Elements below which algorithms run on the calling thread only
+#define TOOL_PARALLEL_SORT_RUN 32            // Elements insertion sorted before merging
+
+
+
+namespace Tool
+{
+    //- Types
+    // Data-parallel algorithms over raw arrays, dispatched onto a ThreadArray. Each thread of the array handles
+    // one contiguous block, so the order of elements is kept wherever it matters: combiners need to be associative
+    // but not commutative, and partition and sort are stable. Elements are copied bytewise, so must be trivially copyable.
+    
+    //~ Partial results
+    
+    // One per thread, each on its own cache line
+    template<typename T> struct alignas(TOOL_CACHE_LINE_SIZE) ParallelPartial
+    {
+        T value;
+    };
+    
+    struct ParallelPartitionCounts
+    {
+        i64 selected;
+        i64 rejected;
+    };
+    
+    
+    
+    //- Helpers
+    
+    //~ Blocks
+    
+    // Blocks are the same size except for the last ones, which can be short or empty
+    inline i64 ParallelBlockSize(i64 count, i32 blockCount)
+    {
+        return (count + blockCount - 1) / blockCount;
+    }
+    
+    inline void ParallelBlock(i64 count, i32 blockCount, i32 index, i64* begin, i64* end)
+    {
+        i64 size = ParallelBlockSize(count, blockCount);
+        *begin = size * index < count ? size * index : count;
+        *end = *begin + size < count ? *begin + size : count;
+    }
+    
+    // Single block when the work is too small to be worth dispatching
+    inline i32 ParallelBlockCount(ThreadArray* array, i64 count)
+    {
+        return count < TOOL_PARALLEL_SERIAL_THRESHOLD ? 1 : array->count;
+    }
+    
+    template<typename T> ParallelPartial<T>* ParallelPartialsAlloc(i32 count)
+    {
+        return (ParallelPartial<T>*)ClassicAllocAligned(count * sizeof(ParallelPartial<T>), alignof(ParallelPartial<T>));
+    }
+    
+    // Runs the dispatch on the calling thread alone for a single block
+    inline void ParallelRun(ThreadArray* array, i32 blockCount, ThreadArrayFunction function, void* data)
+    {
+        if (blockCount == 1)
+        {
+            function(data, 0);
+        }
+        else
+        {
+            ThreadArrayRun(array, function, data);
+        }
+    }
+    
+    //~ Merging
+    
+    // Number of elements taken from 'a' within the first 'k' elements of the stable merge of 'a' and 'b'
+    template<typename T, typename Less> i64 ParallelMergeSplit(const T* a, i64 aCount, const T* b, i64 bCount, i64 k, Less& less)
+    {
+        i64 low = k > bCount ? k - bCount : 0;
+        i64 high = k < aCount ? k : aCount;
+        
+        while (low < high)
+        {
+            i64 i = (low + high) / 2;
+            i64 j = k - i;
+            
+            // Too few taken from 'a' when its next element would come before the last taken from 'b'
+            if (!less(b[j - 1], a[i]))
+            {
+                low = i + 1;
+            }
+            else
+            {
+                high = i;
+            }
+        }
+        
+        return low;
+    }
+    
+    // Elements of 'a' come first among equal ones
+    template<typename T, typename Less> void ParallelMerge(const T* a, i64 aCount, const T* b, i64 bCount, T* destination, Less& less)
+    {
+        i64 i = 0;
+        i64 j = 0;
+        
+        while (i < aCount && j < bCount)
+        {
+            *destination++ = less(b[j], a[i]) ? b[j++] : a[i++];
+        }
+        
+        Copy(destination, a + i, (aCount - i) * sizeof(T));
+        Copy(destination + (aCount - i), b + j, (bCount - j) * sizeof(T));
+    }
+    
+    // Stable merge sort on the calling thread, using a buffer of the same size
+    template<typename T, typename Less> void ParallelSortSerial(T* values, T* buffer, i64 count, Less& less)
+    {
+        for (i64 run = 0; run < count; run += TOOL_PARALLEL_SORT_RUN)
+        {
+            i64 end = run + TOOL_PARALLEL_SORT_RUN < count ? run + TOOL_PARALLEL_SORT_RUN : count;
+            
+            for (i64 i = run + 1; i < end; i++)
+            {
+                T value = values[i];
+                
+                i64 j = i;
+                while (j > run && less(value, values[j - 1]))
+                {
+                    values[j] = values[j - 1];
+                    j--;
+                }
+                
+                values[j] = value;
+            }
+        }
+        
+        T* source = values;
+        T* destination = buffer;
+        
+        for (i64 width = TOOL_PARALLEL_SORT_RUN; width < count; width *= 2)
+        {
+            for (i64 begin = 0; begin < count; begin += 2 * width)
+            {
+                i64 middle = begin + width < count ? begin + width : count;
+                i64 end = begin + 2 * width < count ? begin + 2 * width : count;
+                
+                ParallelMerge(source + begin, middle - begin, source + middle, end - middle, destination + begin, less);
+            }
+            
+            T* swap = source;
+            source = destination;
+            destination = swap;
+        }
+        
+        if (source != values)
+        {
+            Copy(values, source, count * sizeof(T));
+        }
+    }
+    
+    
+    
+    //- Algorithms
+    
+    //~ Reduce
+    
+    // Combines every value into the identity, with combine(T accumulated, T value) returning T.
+    template<typename T, typename Combine> T ParallelReduce(ThreadArray* array, const T* values, i64 count, T identity, Combine combine)
+    {
+        struct State
+        {
+            const T* values;
+            i64 count;
+            i32 blockCount;
+            T identity;
+            Combine* combine;
+            ParallelPartial<T>* partials;
+            
+            static void Run(void* data, i32 index)
+            {
+                State* state = (State*)data;
+                
+                i64 begin, end;
+                ParallelBlock(state->count, state->blockCount, index, &begin, &end);
+                
+                T result = state->identity;
+                for (i64 i = begin; i < end; i++)
+                {
+                    result = (*state->combine)(result, state->values[i]);
+                }
+                
+                state->partials[index].value = result;
+            }
+        };
+        
+        State state = { values, count, ParallelBlockCount(array, count), identity, &combine, nullptr };
+        
+        state.partials = ParallelPartialsAlloc<T>(state.blockCount);
+        TOOL_DEFER(ClassicDealloc(state.partials));
+        
+        ParallelRun(array, state.blockCount, State::Run, &state);
+        
+        T result = identity;
+        for (i32 i = 0; i < state.blockCount; i++)
+        {
+            result = combine(result, state.partials[i].value);
+        }
+        
+        return result;
+    }
+    
+    //~ Scan
+    
+    // Prefix combination of the values into the results, which may be the same array. Inclusive scans include
+    // the value at the same index, exclusive scans start from the identity.
+    template<typename T, typename Combine> void ParallelScan(ThreadArray* array, const T* values, T* results, i64 count,
+                                                             T identity, Combine combine, b8 inclusive)
+    {
+        struct State
+        {
+            const T* values;
+            T* results;
+            i64 count;
+            i32 blockCount;
+            b8 inclusive;
+            b8 offsetting; // Second pass, once every block knows the combination of the blocks before it
+            T identity;
+            Combine* combine;
+            ParallelPartial<T>* partials;
+            
+            static void Run(void* data, i32 index)
+            {
+                State* state = (State*)data;
+                
+                i64 begin, end;
+                ParallelBlock(state->count, state->blockCount, index, &begin, &end);
+                
+                if (!state->offsetting)
+                {
+                    T result = state->identity;
+                    for (i64 i = begin; i < end; i++)
+                    {
+                        result = (*state->combine)(result, state->values[i]);
+                    }
+                    
+                    state->partials[index].value = result;
+                    return;
+                }
+                
+                T running = state->partials[index].value;
+                for (i64 i = begin; i < end; i++)
+                {
+                    T value = state->values[i];
+                    
+                    if (state->inclusive)
+                    {
+                        running = (*state->combine)(running, value);
+                        state->results[i] = running;
+                    }
+                    else
+                    {
+                        state->results[i] = running;
+                        running = (*state->combine)(running, value);
+                    }
+                }
+            }
+        };
+        
+        State state = { values, results, count, ParallelBlockCount(array, count), inclusive, false, identity, &combine, nullptr };
+        
+        state.partials = ParallelPartialsAlloc<T>(state.blockCount);
+        TOOL_DEFER(ClassicDealloc(state.partials));
+        
+        // A single block starts from the identity, otherwise from the combination of every block before
+        state.partials[0].value = identity;
+        
+        if (state.blockCount > 1)
+        {
+            ThreadArrayRun(array, State::Run, &state);
+            
+            T running = identity;
+            for (i32 i = 0; i < state.blockCount; i++)
+            {
+                T total = state.partials[i].value;
+                state.partials[i].value = running;
+                running = combine(running, total);
+            }
+        }
+        
+        state.offsetting = true;
+        ParallelRun(array, state.blockCount, State::Run, &state);
+    }
+    
+    template<typename T, typename Combine> void ParallelScanInclusive(ThreadArray* array, const T* values, T* results, i64 count,
+                                                                      T identity, Combine combine)
+    {
+        ParallelScan(array, values, results, count, identity, combine, true);
+    }
+    
+    template<typename T, typename Combine> void ParallelScanExclusive(ThreadArray* array, const T* values, T* results, i64 count,
+                                                                      T identity, Combine combine)
+    {
+        ParallelScan(array, values, results, count, identity, combine, false);
+    }
+    
+    //~ Partition
+    
+    // Moves the values for which predicate(T value) holds in front of the others, keeping their order within both groups.
+    // Returns the number of values for which it holds.
+    template<typename T, typename Predicate> i64 ParallelPartition(ThreadArray* array, T* values, i64 count, Predicate predicate)
+    {
+        struct State
+        {
+            T* values;
+            T* buffer;
+            i64 count;
+            i32 blockCount;
+            i32 pass; // Counting, scattering into the buffer, then copying back
+            Predicate* predicate;
+            ParallelPartial<ParallelPartitionCounts>* partials;
+            
+            static void Run(void* data, i32 index)
+            {
+                State* state = (State*)data;
+                
+                i64 begin, end;
+                ParallelBlock(state->count, state->blockCount, index, &begin, &end);
+                
+                ParallelPartitionCounts* counts = &state->partials[index].value;
+                
+                switch (state->pass)
+                {
+                    case 0:
+                    {
+                        i64 selected = 0;
+                        for (i64 i = begin; i < end; i++)
+                        {
+                            selected += (*state->predicate)(state->values[i]) ? 1 : 0;
+                        }
+                        
+                        *counts = { selected, (end - begin) - selected };
+                    } break;
+                    
+                    case 1:
+                    {
+                        i64 selected = counts->selected;
+                        i64 rejected = counts->rejected;
+                        
+                        for (i64 i = begin; i < end; i++)
+                        {
+                            const T& value = state->values[i];
+                            state->buffer[(*state->predicate)(value) ? selected++ : rejected++] = value;
+                        }
+                    } break;
+                    
+                    default:
+                    {
+                        Copy(state->values + begin, state->buffer + begin, (end - begin) * sizeof(T));
+                    } break;
+                }
+            }
+        };
+        
+        static_assert(__is_trivially_copyable(T), "Parallel algorithms copy elements bytewise.");
+        
+        State state = { values, nullptr, count, ParallelBlockCount(array, count), 0, &predicate, nullptr };
+        
+        state.buffer = (T*)ClassicAllocAligned(count * sizeof(T), alignof(T));
+        TOOL_DEFER(ClassicDealloc(state.buffer));
+        
+        state.partials = ParallelPartialsAlloc<ParallelPartitionCounts>(state.blockCount);
+        TOOL_DEFER(ClassicDealloc(state.partials));
+        
+        ParallelRun(array, state.blockCount, State::Run, &state);
+        
+        // Turns the counts into positions in the buffer, selected values first
+        i64 selectedTotal = 0;
+        for (i32 i = 0; i < state.blockCount; i++)
+        {
+            selectedTotal += state.partials[i].value.selected;
+        }
+        
+        i64 selected = 0;
+        i64 rejected = selectedTotal;
+        for (i32 i = 0; i < state.blockCount; i++)
+        {
+            ParallelPartitionCounts counts = state.partials[i].value;
+            state.partials[i].value = { selected, rejected };
+            
+            selected += counts.selected;
+            rejected += counts.rejected;
+        }
+        
+        state.pass = 1;
+        ParallelRun(array, state.blockCount, State::Run, &state);
+        
+        state.pass = 2;
+        ParallelRun(array, state.blockCount, State::Run, &state);
+        
+        return selectedTotal;
+    }
+    
+    //~ Sort
+    
+    // Stable merge sort, with less(T a, T b) telling whether 'a' goes before 'b'. Every thread sorts its own block,
+    // then all threads merge pairs of sorted runs together, each producing an equal share of the output.
+    template<typename T, typename Less> void ParallelSort(ThreadArray* array, T* values, i64 count, Less less)
+    {
+        struct State
+        {
+            T* values;
+            T* buffer;
+            i64 count;
+            i32 blockCount;
+            i64 width; // Sorted run length, zero while sorting blocks
+            const T* source;
+            T* destination;
+            Less* less;
+            
+            static void Run(void* data, i32 index)
+            {
+                State* state = (State*)data;
+                
+                if (state->width == 0)
+                {
+                    i64 begin, end;
+                    ParallelBlock(state->count, state->blockCount, index, &begin, &end);
+                    
+                    ParallelSortSerial(state->values + begin, state->buffer + begin, end - begin, *state->less);
+                    return;
+                }
+                
+                // The share of the output may span several pairs of runs
+                i64 width = state->width;
+                i64 k = state->count * index / state->blockCount;
+                i64 kEnd = state->count * (index + 1) / state->blockCount;
+                
+                while (k < kEnd)
+                {
+                    i64 pairBegin = k / (2 * width) * (2 * width);
+                    i64 middle = pairBegin + width < state->count ? pairBegin + width : state->count;
+                    i64 pairEnd = pairBegin + 2 * width < state->count ? pairBegin + 2 * width : state->count;
+                    i64 pieceEnd = kEnd < pairEnd ? kEnd : pairEnd;
+                    
+                    const T* a = state->source + pairBegin;
+                    const T* b = state->source + middle;
+                    i64 aCount = middle - pairBegin;
+                    i64 bCount = pairEnd - middle;
+                    
+                    i64 aBegin = ParallelMergeSplit(a, aCount, b, bCount, k - pairBegin, *state->less);
+                    i64 aEnd = ParallelMergeSplit(a, aCount, b, bCount, pieceEnd - pairBegin, *state->less);
+                    i64 bBegin = (k - pairBegin) - aBegin;
+                    i64 bEnd = (pieceEnd - pairBegin) - aEnd;
+                    
+                    ParallelMerge(a + aBegin, aEnd - aBegin, b + bBegin, bEnd - bBegin, state->destination + k, *state->less);
+                    k = pieceEnd;
+                }
+            }
+        };
+        
+        static_assert(__is_trivially_copyable(T), "Parallel algorithms copy elements bytewise.");
+        
+        State state = { values, nullptr, count, ParallelBlockCount(array, count), 0, nullptr, nullptr, &less };
+        
+        state.buffer = (T*)ClassicAllocAligned(count * sizeof(T), alignof(T));
+        TOOL_DEFER(ClassicDealloc(state.buffer));
+        
+        ParallelRun(array, state.blockCount, State::Run, &state);
+        
+        state.source = values;
+        state.destination = state.buffer;
+        
+        for (state.width = ParallelBlockSize(count, state.blockCount); state.width < count; state.width *= 2)
+        {
+            ThreadArrayRun(array, State::Run, &state);
+            
+            T* swap = (T*)state.source;
+            state.source = state.destination;
+            state.destination = swap;
+        }
+        
+        if (state.source != values)
+        {
+            Copy(values, state.source, count * sizeof(T));
+        }
+    }
+    
+    // Ascending order, using operator<
+    template<typename T> void ParallelSort(ThreadArray* array, T* values, i64 count)
+    {
+        ParallelSort(array, values, count, [](const T& a, const T& b) { return a < b; });
+    }
+}
+
+#endif //_TOOL_PARALLEL_H
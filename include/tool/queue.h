@@ -0,0 +1,108 @@
+#ifndef _TOOL_QUEUE_H
+#define _TOOL_QUEUE_H
+
+#include "basics.h"
+#include "atomic.h"
+
+
+
+//~ Definitions
+
+#define TOOL_QUEUE_SPIN_COUNT 128 // Attempts of blocking operations before sleeping
+
+
+
+namespace Tool
+{
+    //- Types
+    // Bounded queues of fixed-size elements, copied in and out. Capacities are rounded up to a power of 2.
+    // Try operations never block, batch operations move as many elements as possible without blocking,
+    // and blocking operations spin then sleep until they succeed. All of them wake blocked threads as needed.
+    
+    //~ Queue signal
+    
+    // Blocked threads sleep on the event, which is bumped whenever one of them might be able to continue
+    struct QueueSignal
+    {
+        alignas(TOOL_CACHE_LINE_SIZE) u32 event;
+        u32 sleepers;
+    };
+    
+    //~ MPMC queue
+    
+    // Any number of producers and consumers (Dmitry Vyukov's bounded queue). Every slot holds a sequence number
+    // telling which lap of the ring it is ready for, so producers and consumers only contend on their own position.
+    struct MPMCQueue
+    {
+        u8* slots;
+        u64 mask;
+        u64 elementSize;
+        u64 stride; // Sequence number then element
+        
+        alignas(TOOL_CACHE_LINE_SIZE) u64 head; // Next position to push
+        alignas(TOOL_CACHE_LINE_SIZE) u64 tail; // Next position to pop
+        
+        QueueSignal notEmpty;
+        QueueSignal notFull;
+    };
+    
+    //~ SPSC queue
+    
+    // A single producer and a single consumer. Each side keeps a cached copy of the other's position,
+    // so the shared positions are only read when the cached one suggests the queue is full or empty.
+    struct SPSCQueue
+    {
+        u8* elements;
+        u64 mask;
+        u64 elementSize;
+        
+        alignas(TOOL_CACHE_LINE_SIZE) u64 head; // Written by the producer
+        u64 cachedTail;
+        
+        alignas(TOOL_CACHE_LINE_SIZE) u64 tail; // Written by the consumer
+        u64 cachedHead;
+        
+        QueueSignal notEmpty;
+        QueueSignal notFull;
+    };
+    
+    
+    
+    //- Functions
+    
+    //~ MPMC queue
+    
+    void MPMCQueueCreate(MPMCQueue* queue, u64 capacity, u64 elementSize);
+    void MPMCQueueDestroy(MPMCQueue* queue); // Elements still queued are dropped
+    
+    b8 MPMCQueueTryPush(MPMCQueue* queue, const void* element); // Value of false indicates a full queue
+    b8 MPMCQueueTryPop(MPMCQueue* queue, void* element);        // Value of false indicates an empty queue
+    
+    void MPMCQueuePush(MPMCQueue* queue, const void* element);
+    void MPMCQueuePop(MPMCQueue* queue, void* element);
+    
+    // Consecutive elements, returning how many were pushed or popped
+    u64 MPMCQueuePushBatch(MPMCQueue* queue, const void* elements, u64 count);
+    u64 MPMCQueuePopBatch(MPMCQueue* queue, void* elements, u64 count);
+    
+    // Might be outdated as soon as it returns, when other threads use the queue
+    u64 MPMCQueueCount(const MPMCQueue* queue);
+    
+    //~ SPSC queue
+    
+    void SPSCQueueCreate(SPSCQueue* queue, u64 capacity, u64 elementSize);
+    void SPSCQueueDestroy(SPSCQueue* queue); // Elements still queued are dropped
+    
+    b8 SPSCQueueTryPush(SPSCQueue* queue, const void* element); // Producer only. Value of false indicates a full queue.
+    b8 SPSCQueueTryPop(SPSCQueue* queue, void* element);        // Consumer only. Value of false indicates an empty queue.
+    
+    void SPSCQueuePush(SPSCQueue* queue, const void* element);
+    void SPSCQueuePop(SPSCQueue* queue, void* element);
+    
+    u64 SPSCQueuePushBatch(SPSCQueue* queue, const void* elements, u64 count);
+    u64 SPSCQueuePopBatch(SPSCQueue* queue, void* elements, u64 count);
+    
+    u64 SPSCQueueCount(const SPSCQueue* queue);
+}
+
+#endif //_TOOL_QUEUE_H
@@ -0,0 +1,414 @@
+#ifndef _TOOL_TASK_H
+#define _TOOL_TASK_H
+
+#include "basics.h"
+#include "memory.h"
+#include "atomic.h"
+#include "threading.h"
+#include "io.h"
+#include "async.h"
+
+#include <coroutine>
+#include <exception>
+
+
+
+//~ Definitions
+
+// Bytes in front of every coroutine frame, recording where the frame was allocated
+#define TOOL_TASK_FRAME_PREFIX 16
+
+
+
+namespace Tool
+{
+    //- Task
+    // Coroutines returning Task<T> start suspended, and run once awaited (co_await) or waited on (TaskWait).
+    // Frames are allocated on the heap, or on the arena passed as the first parameter of the coroutine.
+    // Arena frames are never freed individually, so the arena frame has to outlive the task.
+    
+    template<typename T> struct Task;
+    
+    //~ Promise
+    
+    enum TaskFrameSource : u64
+    {
+        TaskFrameHeap,
+        TaskFrameArena
+    };
+    
+    struct TaskPromiseBase
+    {
+        std::coroutine_handle<> continuation = nullptr; // Resumed on completion, if the task is awaited by a coroutine
+        std::exception_ptr exception = nullptr;
+        u32 done = 0; // Set on completion otherwise, for TaskWait
+        
+        static void* operator new(size_t size)
+        {
+            u8* start = (u8*)ClassicAlloc(TOOL_TASK_FRAME_PREFIX + size);
+            *(TaskFrameSource*)start = TaskFrameHeap;
+            return start + TOOL_TASK_FRAME_PREFIX;
+        }
+        
+        template<typename... Args> static void* operator new(size_t size, Arena* arena, Args&...)
+        {
+            u8* start = (u8*)ArenaAllocAligned(arena, TOOL_TASK_FRAME_PREFIX + size, TOOL_DEFAULT_ALIGNMENT);
+            *(TaskFrameSource*)start = TaskFrameArena;
+            return start + TOOL_TASK_FRAME_PREFIX;
+        }
+        
+        static void operator delete(void* frame, size_t)
+        {
+            u8* start = (u8*)frame - TOOL_TASK_FRAME_PREFIX;
+            
+            if (*(TaskFrameSource*)start == TaskFrameHeap)
+            {
+                ClassicDealloc(start);
+            }
+        }
+        
+        struct FinalAwaiter
+        {
+            bool await_ready() noexcept { return false; }
+            void await_resume() noexcept {}
+            
+            template<typename Promise> std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+            {
+                TaskPromiseBase& promise = handle.promise();
+                
+                if (promise.continuation)
+                {
+                    return promise.continuation;
+                }
+                
+                // The waiting thread might destroy the frame as soon as it is done, so only the address is used afterwards
+                AtomicStore(&promise.done, 1u);
+                FutexWakeAll(&promise.done);
+                
+                return std::noop_coroutine();
+            }
+        };
+        
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        
+        void unhandled_exception() { exception = std::current_exception(); }
+    };
+    
+    template<typename T> struct TaskPromise : TaskPromiseBase
+    {
+        alignas(T) u8 value[sizeof(T)];
+        b8 hasValue = false;
+        
+        ~TaskPromise()
+        {
+            if (hasValue)
+            {
+                ((T*)value)->~T();
+            }
+        }
+        
+        void return_value(T result)
+        {
+            new ((T*)value) T((T&&)result);
+            hasValue = true;
+        }
+        
+        T Result()
+        {
+            if (exception)
+            {
+                std::rethrow_exception(exception);
+            }
+            
+            return (T&&)*(T*)value;
+        }
+    };
+    
+    template<> struct TaskPromise<void> : TaskPromiseBase
+    {
+        void return_void() {}
+        
+        void Result()
+        {
+            if (exception)
+            {
+                std::rethrow_exception(exception);
+            }
+        }
+    };
+    
+    //~ Task
+    
+    template<typename T> struct [[nodiscard]] Task
+    {
+        struct promise_type : TaskPromise<T>
+        {
+            Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        };
+        
+        std::coroutine_handle<promise_type> handle = nullptr;
+        
+        Task() = default;
+        explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+        
+        Task(Task&& other) : handle(other.handle) { other.handle = nullptr; }
+        Task& operator=(Task&& other)
+        {
+            if (handle)
+            {
+                handle.destroy();
+            }
+            
+            handle = other.handle;
+            other.handle = nullptr;
+            return *this;
+        }
+        
+        Task(const Task&) = delete;
+        Task& operator=(const Task&) = delete;
+        
+        ~Task()
+        {
+            if (handle)
+            {
+                handle.destroy();
+            }
+        }
+        
+        // Awaiting starts the task on the awaiting thread, and resumes the awaiting coroutine wherever the task finishes.
+        struct Awaiter
+        {
+            std::coroutine_handle<promise_type> handle;
+            
+            bool await_ready() noexcept { return false; }
+            T await_resume() { return handle.promise().Result(); }
+            
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+            {
+                handle.promise().continuation = awaiting;
+                return handle;
+            }
+        };
+        
+        Awaiter operator co_await() { return { handle }; }
+    };
+    
+    
+    
+    //- Awaitables and helpers
+    
+    //~ Pool resumption
+    
+    inline void TaskResume(void* address)
+    {
+        std::coroutine_handle<>::from_address(address).resume();
+    }
+    
+    struct TaskSwitchAwaiter
+    {
+        ThreadPool* pool;
+        
+        bool await_ready() noexcept { return false; }
+        void await_resume() noexcept {}
+        
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            ThreadPoolSubmit(pool, TaskResume, handle.address());
+        }
+    };
+    
+    // Continues the awaiting coroutine on a worker of the pool.
+    inline TaskSwitchAwaiter TaskSwitch(ThreadPool* pool) { return { pool }; }
+    
+    //~ Blocking work offload
+    
+    struct TaskOffloadAwaiter
+    {
+        ThreadPool* pool;
+        ThreadFunction function;
+        void* data;
+        
+        std::coroutine_handle<> handle;
+        std::exception_ptr exception;
+        
+        static void Run(void* job)
+        {
+            TaskOffloadAwaiter* awaiter = (TaskOffloadAwaiter*)job;
+            
+            try
+            {
+                awaiter->function(awaiter->data);
+            }
+            catch (...)
+            {
+                awaiter->exception = std::current_exception();
+            }
+            
+            awaiter->handle.resume();
+        }
+        
+        bool await_ready() noexcept { return false; }
+        
+        void await_suspend(std::coroutine_handle<> awaiting)
+        {
+            handle = awaiting;
+            ThreadPoolSubmit(pool, Run, this);
+        }
+        
+        void await_resume()
+        {
+            if (exception)
+            {
+                std::rethrow_exception(exception);
+            }
+        }
+    };
+    
+    // Runs a blocking function on a worker of the pool, then continues the awaiting coroutine on that worker.
+    // Exceptions thrown by the function are rethrown to the awaiting coroutine.
+    inline TaskOffloadAwaiter TaskOffload(ThreadPool* pool, ThreadFunction function, void* data)
+    {
+        return { pool, function, data, nullptr, nullptr };
+    }
+    
+    //~ File IO
+    
+    struct TaskFileReadAwaiter
+    {
+        TaskOffloadAwaiter offload;
+        
+        File file;
+        void* destination;
+        u64 size;
+        u64 readSize;
+        
+        static void Read(void* data)
+        {
+            TaskFileReadAwaiter* awaiter = (TaskFileReadAwaiter*)data;
+            FileRead(awaiter->file, awaiter->destination, awaiter->size, &awaiter->readSize);
+        }
+        
+        bool await_ready() noexcept { return false; }
+        
+        void await_suspend(std::coroutine_handle<> awaiting)
+        {
+            offload.function = Read;
+            offload.data = this;
+            offload.await_suspend(awaiting);
+        }
+        
+        u64 await_resume()
+        {
+            offload.await_resume();
+            return readSize;
+        }
+    };
+    
+    // Reads from the file on a worker of the pool, resuming the awaiting coroutine there with the number of bytes read.
+    inline TaskFileReadAwaiter TaskFileRead(ThreadPool* pool, File file, void* destination, u64 size)
+    {
+        return { { pool, nullptr, nullptr, nullptr, nullptr }, file, destination, size, 0 };
+    }
+    
+    //~ Asynchronous IO
+    
+    struct TaskIOAwaiter
+    {
+        IOEngine* engine;
+        ThreadPool* pool;
+        IORequest request;
+        
+        std::coroutine_handle<> handle;
+        
+        static void Complete(IORequest*, void* data)
+        {
+            TaskIOAwaiter* awaiter = (TaskIOAwaiter*)data;
+            
+            if (awaiter->pool != nullptr)
+            {
+                ThreadPoolSubmit(awaiter->pool, TaskResume, awaiter->handle.address());
+            }
+            else
+            {
+                awaiter->handle.resume();
+            }
+        }
+        
+        bool await_ready() noexcept { return false; }
+        
+        void await_suspend(std::coroutine_handle<> awaiting)
+        {
+            handle = awaiting;
+            request.callback = Complete;
+            request.data = this;
+            IOEngineSubmit(engine, &request);
+        }
+        
+        // Bytes transferred, or the negated error code on failure
+        i64 await_resume() { return request.result; }
+    };
+    
+    // Transfers through the engine without blocking a thread. The awaiting coroutine resumes on a worker of the pool
+    // if given, or otherwise on the engine's completion thread, which should then not be kept busy for long.
+    inline TaskIOAwaiter TaskFileReadAsync(IOEngine* engine, File file, void* destination, u64 size, u64 offset,
+                                           ThreadPool* pool = nullptr)
+    {
+        TaskIOAwaiter awaiter = {};
+        awaiter.engine = engine;
+        awaiter.pool = pool;
+        awaiter.request.type = IORequestTypeRead;
+        awaiter.request.file = file;
+        awaiter.request.buffer = destination;
+        awaiter.request.size = size;
+        awaiter.request.offset = offset;
+        return awaiter;
+    }
+    
+    inline TaskIOAwaiter TaskFileWriteAsync(IOEngine* engine, File file, const void* source, u64 size, u64 offset,
+                                            ThreadPool* pool = nullptr)
+    {
+        TaskIOAwaiter awaiter = {};
+        awaiter.engine = engine;
+        awaiter.pool = pool;
+        awaiter.request.type = IORequestTypeWrite;
+        awaiter.request.file = file;
+        awaiter.request.buffer = (void*)source;
+        awaiter.request.size = size;
+        awaiter.request.offset = offset;
+        return awaiter;
+    }
+    
+    //~ Waiting from outside of coroutines
+    
+    // Starts the task, on a worker of the pool if given or on the calling thread otherwise,
+    // then blocks until it completes and returns its result.
+    template<typename T> T TaskWait(Task<T>& task, ThreadPool* pool = nullptr)
+    {
+        auto& promise = task.handle.promise();
+        
+        if (pool != nullptr)
+        {
+            ThreadPoolSubmit(pool, TaskResume, task.handle.address());
+        }
+        else
+        {
+            task.handle.resume();
+        }
+        
+        while (AtomicLoad(&promise.done) == 0)
+        {
+            FutexWait(&promise.done, 0);
+        }
+        
+        return promise.Result();
+    }
+    
+    template<typename T> T TaskWait(Task<T>&& task, ThreadPool* pool = nullptr)
+    {
+        Task<T> owned = (Task<T>&&)task;
+        return TaskWait(owned, pool);
+    }
+}
+
+#endif //_TOOL_TASK_H
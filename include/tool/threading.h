@@ -2,6 +2,27 @@
 #define THREADING_H
 
 #include "basics.h"
+#include "atomic.h"
+#include "memory.h"
+#include "queue.h"
+
+
+
+//~ Definitions
+
+#define TOOL_THREAD_POOL_DEQUE_SIZE 4096     // Jobs each worker can hold, a power of 2
+#define TOOL_THREAD_POOL_INJECTION_SIZE 4096 // Jobs submitted from outside the pool that can wait at once, a power of 2
+#define TOOL_THREAD_POOL_SPIN_COUNT 64       // Rounds of searching for jobs before a worker sleeps
+#define TOOL_THREAD_ARRAY_SPIN_COUNT 4096    // Checks for a new dispatch or for completion before sleeping
+#define TOOL_BARRIER_SPIN_COUNT 256          // Checks for the end of a round before sleeping
+#define TOOL_SPIN_MUTEX_MAX_SPIN_COUNT 1024  // Upper bound of the adaptive spin count
+#define TOOL_LOCK_SPIN_COUNT 256             // Spins of ticket and reader-writer locks before sleeping
+
+#ifndef TOOL_MUTEX_SPIN_COUNT
+#define TOOL_MUTEX_SPIN_COUNT 100            // Lock attempts of a Linux mutex before sleeping, as critical sections tend to be short
+#endif
+
+// Lock contention is only counted when TOOL_THREADING_STATS is defined, see the CMake option of the same name
 
 
 
@@ -11,43 +32,183 @@ namespace Tool
     
     //~ Threading
     
+    // Handles. On Linux, threads are pthreads, while semaphores and mutexes point to futex words on the heap.
     typedef u64 Thread;
     typedef u64 Semaphore;
     typedef u64 Mutex;
     
-    // TODO(crazy): Implement
-    typedef u64 Barrier;
+    // Reusable barrier for a fixed number of threads. Every round bumps the generation, which waiting threads spin and sleep on.
+    struct Barrier
+    {
+        u32 count;
+        
+        alignas(TOOL_CACHE_LINE_SIZE) u32 arrived;
+        
+        alignas(TOOL_CACHE_LINE_SIZE) u32 generation;
+        u32 sleepers;
+    };
+    
+    typedef void (*ThreadFunction)(void* data);
+    typedef void (*ThreadArrayFunction)(void* data, i32 index);
+    typedef void (*ThreadPoolFunction)(void* job);
+    typedef void (*BarrierFunction)(void* data);
+    
+    //~ Locks
+    // Zero-initialized locks are unlocked, and need no cleanup. Waiting threads spin, then sleep on a futex.
+    
+    // Contention counters, embedded in every lock
+    struct LockStats
+    {
+        u64 acquisitions;
+        u64 contentions; // Acquisitions that did not succeed right away
+        u64 sleeps;      // Waits in the kernel
+    };
+    
+    // Mutex that spins for about as long as recent acquisitions had to, before sleeping.
+    struct SpinMutex
+    {
+        u32 state;
+        i32 spinCount; // Running average of successful spins
+        
+#ifdef TOOL_THREADING_STATS
+        LockStats stats;
+#endif
+    };
+    
+    // First-come, first-served lock. Every release wakes all sleepers, so it suits short critical sections with few waiters.
+    struct TicketLock
+    {
+        u32 next;
+        u32 serving;
+        u32 sleepers;
+        
+#ifdef TOOL_THREADING_STATS
+        LockStats stats;
+#endif
+    };
     
-    // TODO(crazy): Implement
+    // Shared for readers, exclusive for writers. Waiting writers keep new readers out, so writers don't starve.
+    struct RWLock
+    {
+        u32 state; // Reader count, with writer flags in the top bits
+        u32 sleepers;
+        
+#ifdef TOOL_THREADING_STATS
+        LockStats stats;
+#endif
+    };
+    
+    //~ Thread array
+    
+    // Persistent threads running the same function at once, each with its own index. The dispatching thread takes index 0.
     struct ThreadArray
     {
         Thread* threads;
-        i32 count;
+        i32 count; // Including the dispatching thread
+        
+        ThreadArrayFunction function;
+        void* data;
+        
+        // Threads sleep on the generation, which every dispatch bumps
+        alignas(TOOL_CACHE_LINE_SIZE) u32 generation;
+        u32 sleepers;
+        u32 stopping;
+        u32 started; // Hands out indices as threads start
+        
+        // Threads still running the current dispatch, which the dispatching thread sleeps on
+        alignas(TOOL_CACHE_LINE_SIZE) u32 remaining;
+        u32 waiting;
     };
     
-    // TODO(crazy): Implement
-    struct ThreadPool
+    //~ Parallel for
+    
+    enum ParallelSchedule
     {
-        struct Job
-        { 
-            void* data;
-            b8 active;
-        };
+        ParallelScheduleStatic,  // One contiguous block per thread, rounded to the grain. Best for uniform iterations.
+        ParallelScheduleDynamic, // Threads claim grain-sized chunks until the range runs out.
+        ParallelScheduleGuided   // Claimed chunks shrink with the remaining range, down to the grain.
+    };
+    
+    // Runs iterations [begin, end) of a range
+    typedef void (*ParallelForFunction)(void* data, i64 begin, i64 end, i32 threadIndex);
+    
+    //~ Thread pool
+    
+    struct ThreadPoolJob
+    {
+        ThreadPoolFunction function;
+        void* data;
+    };
+    
+    struct ThreadPool;
+    
+    // Each worker owns a Chase-Lev deque: the worker pushes and takes jobs at the bottom, idle workers steal from the top.
+    struct alignas(TOOL_CACHE_LINE_SIZE) ThreadPoolWorker
+    {
+        i64 top;
+        alignas(TOOL_CACHE_LINE_SIZE) i64 bottom;
+        ThreadPoolJob* jobs;
         
-        Thread* threads;
+        ThreadPool* pool;
+        Thread thread;
+        u32 random; // Picks steal victims
+    };
+    
+    struct ThreadPool
+    {
+        ThreadPoolWorker* workers;
         i32 count;
         
-        Job* jobQueue;
-        i32 jobReadHead;
-        i32 jobWriteHead;
-        i32 jobCapacity;
+        // Jobs submitted by threads outside the pool
+        MPMCQueue injected;
         
-        Semaphore semaphore;
+        // Jobs submitted but not yet finished, waited on by ThreadPoolWait
+        alignas(TOOL_CACHE_LINE_SIZE) u32 pending;
+        u32 pendingWaiters;
+        
+        // Idle workers sleep on the epoch, which submissions bump when a worker might be asleep
+        alignas(TOOL_CACHE_LINE_SIZE) u32 epoch;
+        u32 sleepers;
+        u32 stopping;
     };
     
-    typedef void (*ThreadFunction)(void* data);
-    typedef void (*ThreadArrayFunction)(void* data, i32 index);
-    typedef void (*ThreadPoolFunction)(void* job);
+    //~ Job graph
+    
+    struct JobGraph;
+    struct JobGraphLink;
+    
+    struct JobGraphJob
+    {
+        ThreadPoolFunction function;
+        void* data;
+        
+        JobGraph* graph;
+        JobGraphJob* next; // Every job of the graph, in order of addition
+        JobGraphLink* dependents; // Jobs waiting on this one
+        
+        u32 dependencyCount;
+        u32 remaining; // Dependencies left to finish in the current run
+    };
+    
+    struct JobGraphLink
+    {
+        JobGraphJob* job;
+        JobGraphLink* next;
+    };
+    
+    // Jobs with dependencies, built once onto an arena and run any number of times on a thread pool.
+    struct JobGraph
+    {
+        Arena* arena;
+        ThreadPool* pool; // Of the current run
+        
+        JobGraphJob* first;
+        JobGraphJob* last;
+        u32 jobCount;
+        
+        // Jobs left to finish in the current run, which the running thread sleeps on
+        alignas(TOOL_CACHE_LINE_SIZE) u32 remaining;
+    };
     
     
     
@@ -61,6 +222,28 @@ namespace Tool
     void ThreadJoin(Thread thread);
     b8 ThreadTryJoin(Thread thread); // Value of true indicates successful join and release
     
+    // Number of logical processors available to the process
+    i32 ThreadHardwareCount();
+    
+    // Handle of the calling thread, for ThreadSetAffinity. It is not owned, so it must not be joined nor detached.
+    Thread ThreadCurrent();
+    
+    // Restricts the thread to one logical processor, as indexed by CPULogical::index (see topology.h).
+    void ThreadSetAffinity(Thread thread, i32 logicalIndex);
+    
+    // Logical processor the calling thread is running on, which may change right after the call unless pinned.
+    i32 ThreadGetCurrentCore();
+    
+    //~ Futex
+    
+    // Sleeps while the value at 'address' equals 'expected', until woken or until the timeout in milliseconds passes.
+    // Negative timeouts never pass. Might return spuriously. Value of false indicates a timeout.
+    b8 FutexWait(u32* address, u32 expected, i32 timeout = -1);
+    
+    // Wakes one or every thread sleeping on the address, within the same process.
+    void FutexWake(u32* address);
+    void FutexWakeAll(u32* address);
+    
     //~ Semaphore
     
     Semaphore SemaphoreCreate(u32 value = 0);
@@ -71,13 +254,92 @@ namespace Tool
     b8 SemaphoreTryWait(Semaphore semaphore); // Value of true indicates successful decrement
     
     //~ Mutex
+    // Windows mutexes are recursive, Linux mutexes are not. Don't rely on either.
+    // Linux mutexes are locked without system calls unless contended.
     
     Mutex MutexCreate();
     void MutexDestroy(Mutex mutex);
     
     void MutexLock(Mutex mutex);
-    b8 MutexTryLock(Mutex mutex, i32 timeout = 0);
+    b8 MutexTryLock(Mutex mutex, i32 timeout = 0); // Timeout in milliseconds, negative to wait indefinitely
     void MutexUnlock(Mutex mutex);
+    
+    //~ Spin mutex
+    
+    void SpinMutexLock(SpinMutex* mutex);
+    b8 SpinMutexTryLock(SpinMutex* mutex); // Value of true indicates the lock was acquired, without waiting
+    void SpinMutexUnlock(SpinMutex* mutex);
+    
+    //~ Ticket lock
+    
+    void TicketLockAcquire(TicketLock* lock);
+    void TicketLockRelease(TicketLock* lock);
+    
+    //~ Reader-writer lock
+    
+    void RWLockReadLock(RWLock* lock);
+    b8 RWLockTryReadLock(RWLock* lock);
+    void RWLockReadUnlock(RWLock* lock);
+    
+    void RWLockWriteLock(RWLock* lock);
+    b8 RWLockTryWriteLock(RWLock* lock);
+    void RWLockWriteUnlock(RWLock* lock);
+    
+    //~ Barrier
+    
+    void BarrierInit(Barrier* barrier, u32 count);
+    
+    // Waits until 'count' threads have arrived. The last to arrive runs the serial function (if any) before releasing the others,
+    // and gets a value of true. The barrier can be waited on again right away.
+    b8 BarrierWait(Barrier* barrier, BarrierFunction serial = nullptr, void* data = nullptr);
+    
+    //~ Job graph
+    
+    // Jobs and dependencies are allocated onto the arena, which has to outlive the graph.
+    void JobGraphInit(JobGraph* graph, Arena* arena);
+    
+    JobGraphJob* JobGraphAdd(JobGraph* graph, ThreadPoolFunction function, void* data);
+    
+    // Makes the job wait for the dependency to finish, in every run. Dependencies may not form cycles.
+    void JobGraphDepend(JobGraphJob* job, JobGraphJob* dependency);
+    
+    // Runs every job on the pool, each once its dependencies have finished, and returns once all are done.
+    // Helps running pool jobs while waiting, so can be called from within jobs of the same pool.
+    // A graph may only run once at a time, and may not change while running.
+    void JobGraphRun(JobGraph* graph, ThreadPool* pool);
+    
+    //~ Thread array
+    
+    // Starts 'threadCount' - 1 threads, or one per logical processor for zero, which sleep between dispatches.
+    void ThreadArrayCreate(ThreadArray* array, i32 threadCount = 0);
+    void ThreadArrayDestroy(ThreadArray* array);
+    
+    // Runs the function on every thread of the array, including the calling thread as index 0, and returns once all are done.
+    // Only one thread may dispatch onto an array at a time, and never from within a dispatched function.
+    void ThreadArrayRun(ThreadArray* array, ThreadArrayFunction function, void* data);
+    
+    //~ Parallel for
+    
+    // Splits the range [begin, end) across the threads of the array. The grain is the smallest chunk handed out,
+    // and zero picks one based on the range and thread count. Ranges within a single grain run on the calling thread.
+    void ParallelFor(ThreadArray* array, i64 begin, i64 end, ParallelForFunction function, void* data,
+                     ParallelSchedule schedule = ParallelScheduleStatic, i64 grain = 0);
+    
+    //~ Thread pool
+    
+    // Starts a pool of 'threadCount' workers, or one per logical processor for zero.
+    void ThreadPoolCreate(ThreadPool* pool, i32 threadCount = 0);
+    
+    // Waits for every submitted job, then stops the workers.
+    void ThreadPoolDestroy(ThreadPool* pool);
+    
+    // Queues a job, callable from any thread, including from within jobs.
+    // Jobs submitted by a worker go onto its own deque, others onto a shared queue. Jobs run inline when queues are full.
+    void ThreadPoolSubmit(ThreadPool* pool, ThreadPoolFunction function, void* data);
+    
+    // Helps running jobs until every submitted job has finished, sleeping while the last ones run elsewhere.
+    // Cannot be called from within jobs of the same pool.
+    void ThreadPoolWait(ThreadPool* pool);
 };
 
 #endif //THREADING_H
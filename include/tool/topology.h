@@ -0,0 +1,76 @@
+#ifndef _TOOL_TOPOLOGY_H
+#define _TOOL_TOPOLOGY_H
+
+#include "basics.h"
+#include "memory.h"
+
+
+
+//~ Definitions
+
+#define TOOL_TOPOLOGY_MAX_LOGICAL 1024 // Logical processors beyond this index are ignored
+#define TOOL_TOPOLOGY_MAX_CACHES 8     // Distinct cache levels and types
+
+
+
+namespace Tool
+{
+    //- Types
+    
+    //~ CPU topology
+    
+    enum CPUCacheType
+    {
+        CPUCacheTypeData,
+        CPUCacheTypeInstruction,
+        CPUCacheTypeUnified
+    };
+    
+    // One kind of cache, as seen from the first logical processor
+    struct CPUCache
+    {
+        i32 level;
+        CPUCacheType type;
+        
+        u64 size;
+        u32 lineSize;
+        i32 sharingCount; // Logical processors sharing one instance of the cache
+    };
+    
+    struct CPULogical
+    {
+        i32 index;   // Used by the system, and by ThreadSetAffinity
+        i32 core;    // Physical core, counted from 0 across packages
+        i32 package;
+        i32 node;    // NUMA node
+        i32 smt;     // Among the logical processors of the same core, counted from 0
+    };
+    
+    struct CPUTopology
+    {
+        CPULogical* logical;
+        i32 logicalCount;
+        i32 physicalCount;
+        i32 packageCount;
+        i32 nodeCount;
+        
+        CPUCache caches[TOOL_TOPOLOGY_MAX_CACHES]; // Sorted by level, data before instruction caches
+        i32 cacheCount;
+        u32 cacheLineSize;
+    };
+    
+    
+    
+    //- Functions
+    
+    //~ CPU topology
+    
+    // Reads the processor layout of the system, from /sys on Linux (with CPUID for missing cache information)
+    // and GetLogicalProcessorInformationEx on Windows. Logical processors are allocated onto the arena.
+    void CPUTopologyQuery(CPUTopology* topology, Arena* arena);
+    
+    // Largest cache of the given level and type (unified caches match both data and instruction), or nullptr.
+    const CPUCache* CPUTopologyCache(const CPUTopology* topology, i32 level, CPUCacheType type = CPUCacheTypeData);
+}
+
+#endif //_TOOL_TOPOLOGY_H
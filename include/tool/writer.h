@@ -0,0 +1,95 @@
+#ifndef _TOOL_WRITER_H
+#define _TOOL_WRITER_H
+
+#include "basics.h"
+#include "memory.h"
+#include "exception.h"
+#include "threading.h"
+#include "temporal.h"
+#include "io.h"
+
+
+
+//~ Definitions
+
+#define TOOL_FILE_WRITER_CAPACITY (1 << 20) // Default size of the buffer
+#define TOOL_FILE_WRITER_FLUSH_INTERVAL 10  // Default milliseconds the flush thread lets records wait before writing them
+#define TOOL_FILE_WRITER_END ~(u64)0        // Position standing for everything appended so far
+
+
+
+namespace Tool
+{
+    //- Types
+    // Buffered appending onto a file. Records are copied into a circular buffer, and written in large batches
+    // by a background thread, or by whoever needs the room or the data on the file first.
+    // Positions count the bytes appended through the writer, not offsets of the file.
+    
+    enum FileWriterFlags
+    {
+        // Without the flush thread, the buffer is only written when full, or on FileWriterFlush and FileWriterSync
+        FileWriterFlagsNoThread = 1 << 0
+    };
+    
+    struct FileWriter
+    {
+        File file;
+        i32 flags;
+        i32 flushInterval;
+        i32 syncInterval;
+        
+        // Mirrored over its whole size, so the pending bytes are always contiguous and written in one call
+        Circular buffer;
+        u64 threshold; // Pending bytes that wake the flush thread early
+        
+        SpinMutex appendLock; // Guards the buffer and 'appended'
+        Mutex writeLock;      // Held while writing and syncing, where callers needing either queue up
+        
+        Thread thread;
+        u32 event; // Bumped to wake the flush thread
+        u32 stop;
+        Timepoint lastSync;
+        
+        alignas(TOOL_CACHE_LINE_SIZE) u64 appended;
+        alignas(TOOL_CACHE_LINE_SIZE) u64 written;
+        u64 synced;
+        
+        // A failed write or sync is raised again by every later call, as the file is missing data
+        u32 failed;
+        Exception failure;
+    };
+    
+    
+    
+    //- Functions
+    
+    // Starts a writer appending at the file position, with a buffer of at least 'capacity' bytes.
+    // The flush thread writes pending records every 'flushInterval' milliseconds, and as soon as a quarter
+    // of the buffer is pending. A negative interval writes on size alone.
+    // With a non-negative 'syncInterval', written data is also synced once that many milliseconds passed since
+    // the last sync, checked whenever the thread writes. Otherwise, data is only synced on FileWriterSync.
+    void FileWriterCreate(FileWriter* writer, File file, u64 capacity = TOOL_FILE_WRITER_CAPACITY, i32 flags = 0,
+                          i32 flushInterval = TOOL_FILE_WRITER_FLUSH_INTERVAL, i32 syncInterval = -1);
+    
+    // Writes what is left, and syncs it when a sync interval was given. Does not close the file.
+    void FileWriterDestroy(FileWriter* writer);
+    
+    // Copies the record into the buffer, which is a memcpy unless the buffer is full. Records not smaller than
+    // the buffer are written directly. Callable from any thread, and records stay whole and in order.
+    // Returns the position past the record, for FileWriterSync.
+    u64 FileWriterAppend(FileWriter* writer, const void* data, u64 size);
+    
+    // Appends in two steps, for records formatted in place. The writer stays locked in between, and the reserved size
+    // must be smaller than the buffer.
+    void* FileWriterAppendBegin(FileWriter* writer, u64 reservedSize);
+    u64 FileWriterAppendEnd(FileWriter* writer, u64 actualSize);
+    
+    // Blocks until every byte before the position is written to the file
+    void FileWriterFlush(FileWriter* writer, u64 position = TOOL_FILE_WRITER_END);
+    
+    // Blocks until every byte before the position is durable. Threads syncing at the same time share a single
+    // system call (group commit), as whoever syncs first covers all records appended until then.
+    void FileWriterSync(FileWriter* writer, u64 position = TOOL_FILE_WRITER_END);
+}
+
+#endif //_TOOL_WRITER_H
@@ -0,0 +1,662 @@
+#include "async.h"
+#include "exception.h"
+#include "memory.h"
+#include "atomic.h"
+#include "utility.h"
+#include "mathematics.h"
+#include "internal.h"
+
+#ifdef TOOL_LINUX
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+
+
+//~ Definitions
+
+#define TOOL_IO_ENGINE_TRANSFER_MAX (1u << 30) // Largest single transfer, as the ring takes 32-bit lengths
+
+
+
+namespace Tool
+{
+    //- IO engine
+    
+    //~ IO engine static helpers
+    
+    // Engine whose completions the calling thread runs, which may submit beyond the limit
+    static thread_local IOEngine* ioEngineCompleting = nullptr;
+    
+    // Value of false indicates a full engine when not waiting
+    static b8 IOEngineReserve(IOEngine* engine, b8 wait)
+    {
+        // Waiting here would wait for this very thread
+        if (ioEngineCompleting == engine)
+        {
+            AtomicAdd(&engine->inFlight, 1u);
+            return true;
+        }
+        
+        while (true)
+        {
+            u32 count = AtomicLoad(&engine->inFlight);
+            
+            if (count < engine->depth)
+            {
+                if (AtomicCompareExchange(&engine->inFlight, &count, count + 1))
+                {
+                    return true;
+                }
+                
+                continue;
+            }
+            
+            if (!wait)
+            {
+                return false;
+            }
+            
+            AtomicAdd(&engine->inFlightWaiters, 1u);
+            FutexWait(&engine->inFlight, count);
+            AtomicAdd(&engine->inFlightWaiters, (u32)-1);
+        }
+    }
+    
+    static void IOEngineComplete(IOEngine* engine, IORequest* request, i64 result)
+    {
+        // The request may be reused as soon as it is handed over, so nothing is read from it afterwards
+        IORequestFunction callback = request->callback;
+        void* data = request->data;
+        request->result = result;
+        
+        if (callback != nullptr)
+        {
+            callback(request, data);
+        }
+        else
+        {
+            AtomicStore(&request->done, 1u);
+            FutexWakeAll(&request->done);
+        }
+        
+        AtomicAdd(&engine->inFlight, (u32)-1);
+        
+        if (AtomicLoad(&engine->inFlightWaiters) != 0)
+        {
+            FutexWakeAll(&engine->inFlight);
+        }
+    }
+    
+    //~ IO engine thread fallback
+    
+    static void IOEngineFallbackRun(void* data)
+    {
+        IORequest* request = (IORequest*)data;
+        IOEngine* engine = request->engine;
+        
+        i64 result;
+        try
+        {
+            u64 transferred = 0;
+            if (request->type == IORequestTypeRead)
+            {
+                FileReadAt(request->file, request->buffer, request->size, request->offset, &transferred);
+            }
+            else
+            {
+                FileWriteAt(request->file, request->buffer, request->size, request->offset, &transferred);
+            }
+            
+            request->transferred = transferred;
+            result = (i64)transferred;
+        }
+        catch (Exception& exception)
+        {
+            result = exception.type == ExceptionTypeUnix ? -exception.dataSigned :
+                     exception.type == ExceptionTypeWindows ? -(i64)exception.dataUnsigned : -1;
+        }
+        
+        ioEngineCompleting = engine;
+        IOEngineComplete(engine, request, result);
+        ioEngineCompleting = nullptr;
+    }
+    
+    //~ IO engine io_uring implementation
+    
+#ifdef TOOL_LINUX
+    
+    static i32 UringSetup(u32 entries, io_uring_params* params)
+    {
+        return (i32)syscall(__NR_io_uring_setup, entries, params);
+    }
+    
+    static i32 UringEnter(i32 descriptor, u32 submitCount, u32 waitCount, u32 flags)
+    {
+        return (i32)syscall(__NR_io_uring_enter, descriptor, submitCount, waitCount, flags, nullptr, 0);
+    }
+    
+    static i32 UringRegister(i32 descriptor, u32 opcode, const void* argument, u32 count)
+    {
+        return (i32)syscall(__NR_io_uring_register, descriptor, opcode, argument, count);
+    }
+    
+    // Kernels before 5.6 set up rings but lack plain reads and writes
+    static b8 UringSupported(i32 descriptor)
+    {
+        u8 buffer[sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op)] = {};
+        io_uring_probe* probe = (io_uring_probe*)buffer;
+        
+        if (UringRegister(descriptor, IORING_REGISTER_PROBE, probe, 256) < 0)
+        {
+            return false;
+        }
+        
+        return probe->last_op >= IORING_OP_WRITE &&
+               (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+               (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    }
+    
+    static void* UringMap(i32 descriptor, u64 size, u64 offset)
+    {
+        void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, descriptor, (off_t)offset);
+        return mapping != MAP_FAILED ? mapping : nullptr;
+    }
+    
+    // Also releases rings set up partially, where mappings that failed are null
+    static void UringDestroy(IOEngine* engine)
+    {
+        if (engine->submissionEntries != nullptr)
+        {
+            munmap(engine->submissionEntries, engine->submissionEntriesSize);
+        }
+        
+        if (engine->completionRing != nullptr && engine->completionRing != engine->submissionRing)
+        {
+            munmap(engine->completionRing, engine->completionRingSize);
+        }
+        
+        if (engine->submissionRing != nullptr)
+        {
+            munmap(engine->submissionRing, engine->submissionRingSize);
+        }
+        
+        close(engine->ringDescriptor);
+    }
+    
+    static b8 UringCreate(IOEngine* engine)
+    {
+        io_uring_params params = {};
+        
+        i32 descriptor = UringSetup(engine->depth, &params);
+        if (descriptor < 0)
+        {
+            return false;
+        }
+        
+        if (!UringSupported(descriptor) || !(params.features & IORING_FEAT_NODROP))
+        {
+            close(descriptor);
+            return false;
+        }
+        
+        engine->ringDescriptor = descriptor;
+        engine->submissionRingSize = params.sq_off.array + params.sq_entries * sizeof(u32);
+        engine->completionRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        
+        // Newer kernels map both rings at once
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+        {
+            engine->submissionRingSize = TOOL_MAX(engine->submissionRingSize, engine->completionRingSize);
+            engine->completionRingSize = engine->submissionRingSize;
+        }
+        
+        engine->submissionEntriesSize = params.sq_entries * sizeof(io_uring_sqe);
+        
+        engine->submissionRing = UringMap(descriptor, engine->submissionRingSize, IORING_OFF_SQ_RING);
+        engine->completionRing = params.features & IORING_FEAT_SINGLE_MMAP ? engine->submissionRing :
+                                 UringMap(descriptor, engine->completionRingSize, IORING_OFF_CQ_RING);
+        engine->submissionEntries = UringMap(descriptor, engine->submissionEntriesSize, IORING_OFF_SQES);
+        
+        // Failing to map the rings falls back to threads, like rings that are unsupported
+        if (engine->submissionRing == nullptr || engine->completionRing == nullptr || engine->submissionEntries == nullptr)
+        {
+            UringDestroy(engine);
+            return false;
+        }
+        
+        u8* submission = (u8*)engine->submissionRing;
+        engine->submissionTail = (u32*)(submission + params.sq_off.tail);
+        engine->submissionArray = (u32*)(submission + params.sq_off.array);
+        engine->submissionMask = *(u32*)(submission + params.sq_off.ring_mask);
+        engine->submissionCount = params.sq_entries;
+        
+        u8* completion = (u8*)engine->completionRing;
+        engine->completionHead = (u32*)(completion + params.cq_off.head);
+        engine->completionTail = (u32*)(completion + params.cq_off.tail);
+        engine->completions = completion + params.cq_off.cqes;
+        engine->completionMask = *(u32*)(completion + params.cq_off.ring_mask);
+        
+        // The completion ring is twice as large, leaving headroom for requests resubmitted from callbacks past the depth
+        engine->depth = params.sq_entries;
+        return true;
+    }
+    
+    // Continues the request from where it got to, with null requests making the completion thread stop
+    static void UringPrepare(IOEngine* engine, io_uring_sqe* entry, IORequest* request)
+    {
+        *entry = {};
+        
+        if (request == nullptr)
+        {
+            entry->opcode = IORING_OP_NOP;
+            return;
+        }
+        
+        u8* buffer = (u8*)request->buffer + request->transferred;
+        u32 size = (u32)TOOL_MIN(request->size - request->transferred, TOOL_IO_ENGINE_TRANSFER_MAX);
+        b8 read = request->type == IORequestTypeRead;
+        
+        entry->opcode = read ? IORING_OP_READ : IORING_OP_WRITE;
+        entry->fd = LinuxDescriptor(request->file);
+        entry->off = request->offset + request->transferred;
+        entry->addr = (u64)buffer;
+        entry->len = size;
+        entry->user_data = (u64)request;
+        
+        // Transfers within a single registered buffer skip pinning its pages
+        if (engine->buffers != nullptr && buffer >= engine->buffers)
+        {
+            u64 index = (u64)(buffer - engine->buffers) / engine->bufferSize;
+            u8* end = engine->buffers + (index + 1) * engine->bufferSize;
+            
+            if (index < engine->bufferCount && buffer + size <= end)
+            {
+                entry->opcode = read ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+                entry->buf_index = (u16)index;
+            }
+        }
+    }
+    
+    static void UringSubmit(IOEngine* engine, IORequest* const* requests, u32 count);
+    
+    // Handles the completions in the ring. Value of false indicates the request to stop.
+    static b8 UringReap(IOEngine* engine)
+    {
+        io_uring_cqe* completions = (io_uring_cqe*)engine->completions;
+        
+        u32 head = *engine->completionHead;
+        u32 tail = AtomicLoad(engine->completionTail);
+        
+        for (; head != tail; head++)
+        {
+            io_uring_cqe* completion = &completions[head & engine->completionMask];
+            IORequest* request = (IORequest*)completion->user_data;
+            i32 result = completion->res;
+            
+            AtomicStore(engine->completionHead, head + 1);
+            
+            if (request == nullptr)
+            {
+                return false;
+            }
+            
+            // Short transfers continue, until the end of the file or an error. Short unbuffered reads already
+            // reached the end, and continuing them would be misaligned.
+            if (result > 0)
+            {
+                u64 requested = TOOL_MIN(request->size - request->transferred, TOOL_IO_ENGINE_TRANSFER_MAX);
+                request->transferred += (u64)result;
+                
+                b8 ended = request->type == IORequestTypeRead && (u64)result < requested && FileAlignment(request->file) > 1;
+                if (request->transferred < request->size && !ended)
+                {
+                    UringSubmit(engine, &request, 1);
+                    continue;
+                }
+            }
+            
+            IOEngineComplete(engine, request, result < 0 ? (i64)result : (i64)request->transferred);
+        }
+        
+        return true;
+    }
+    
+    // Makes the kernel consume 'count' entries published to the submission ring, with the submit lock held
+    static void UringEnterAll(IOEngine* engine, u32 count)
+    {
+        u32 submitted = 0;
+        while (submitted < count)
+        {
+            i32 result = UringEnter(engine->ringDescriptor, count - submitted, 0, 0);
+            if (result < 0)
+            {
+                if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                {
+                    // Busy while the kernel holds back completions for want of room in the ring. Other threads
+                    // wait for the completion thread to drain it, which drains it here instead. Its submissions
+                    // meanwhile are deferred, and it cannot see the request to stop, which follows every other.
+                    if (ioEngineCompleting == engine)
+                    {
+                        UringReap(engine);
+                        UringEnter(engine->ringDescriptor, 0, 0, IORING_ENTER_GETEVENTS);
+                    }
+                    
+                    SpinPause();
+                    continue;
+                }
+                
+                ExceptErrno();
+            }
+            
+            submitted += (u32)result;
+        }
+    }
+    
+    static void UringSubmit(IOEngine* engine, IORequest* const* requests, u32 count)
+    {
+        if (ioEngineCompleting == engine)
+        {
+            for (u32 i = 0; i < count; i++)
+            {
+                IORequest* request = requests[i];
+                request->next = nullptr;
+                
+                if (engine->deferredLast != nullptr)
+                {
+                    engine->deferredLast->next = request;
+                }
+                else
+                {
+                    engine->deferredFirst = request;
+                }
+                
+                engine->deferredLast = request;
+            }
+            
+            return;
+        }
+        
+        SpinMutexLock(&engine->submitLock);
+        TOOL_DEFER(SpinMutexUnlock(&engine->submitLock));
+        
+        io_uring_sqe* entries = (io_uring_sqe*)engine->submissionEntries;
+        
+        // The kernel consumes every submitted entry before returning, so each batch can fill the whole ring
+        u32 done = 0;
+        while (done < count)
+        {
+            u32 tail = *engine->submissionTail;
+            u32 batch = TOOL_MIN(count - done, engine->submissionCount);
+            
+            for (u32 i = 0; i < batch; i++)
+            {
+                u32 index = (tail + i) & engine->submissionMask;
+                UringPrepare(engine, &entries[index], requests[done + i]);
+                engine->submissionArray[index] = index;
+            }
+            
+            AtomicStore(engine->submissionTail, tail + batch);
+            UringEnterAll(engine, batch);
+            
+            done += batch;
+        }
+    }
+    
+    // Sends the requests the completion thread deferred, unless another thread is submitting
+    static void UringSubmitDeferred(IOEngine* engine)
+    {
+        // The other thread might be waiting for room in the completion ring, which this thread makes
+        if (!SpinMutexTryLock(&engine->submitLock))
+        {
+            UringEnter(engine->ringDescriptor, 0, 0, IORING_ENTER_GETEVENTS);
+            SpinPause();
+            return;
+        }
+        
+        TOOL_DEFER(SpinMutexUnlock(&engine->submitLock));
+        
+        io_uring_sqe* entries = (io_uring_sqe*)engine->submissionEntries;
+        
+        while (engine->deferredFirst != nullptr)
+        {
+            u32 tail = *engine->submissionTail;
+            u32 batch = 0;
+            
+            while (engine->deferredFirst != nullptr && batch < engine->submissionCount)
+            {
+                IORequest* request = engine->deferredFirst;
+                engine->deferredFirst = request->next;
+                
+                u32 index = (tail + batch) & engine->submissionMask;
+                UringPrepare(engine, &entries[index], request);
+                engine->submissionArray[index] = index;
+                batch++;
+            }
+            
+            if (engine->deferredFirst == nullptr)
+            {
+                engine->deferredLast = nullptr;
+            }
+            
+            AtomicStore(engine->submissionTail, tail + batch);
+            UringEnterAll(engine, batch);
+        }
+    }
+    
+    static void UringCompletionMain(void* data)
+    {
+        IOEngine* engine = (IOEngine*)data;
+        ioEngineCompleting = engine;
+        
+        while (true)
+        {
+            if (!UringReap(engine))
+            {
+                return;
+            }
+            
+            if (engine->deferredFirst != nullptr)
+            {
+                UringSubmitDeferred(engine);
+                continue;
+            }
+            
+            UringEnter(engine->ringDescriptor, 0, 1, IORING_ENTER_GETEVENTS);
+        }
+    }
+    
+#endif
+    
+    //~ IO engine general implementation
+    
+    void IOEngineCreate(IOEngine* engine, u32 depth, i32 flags)
+    {
+        *engine = {};
+        
+        engine->depth = 1;
+        while (engine->depth < depth)
+        {
+            engine->depth <<= 1;
+        }
+    
+#ifdef TOOL_LINUX
+        if (!(flags & IOEngineFlagsFallback))
+        {
+            engine->uring = UringCreate(engine);
+        }
+        
+        if (engine->uring)
+        {
+            engine->completionThread = ThreadCreate(UringCompletionMain, engine);
+            return;
+        }
+#endif
+        
+        engine->fallback = ClassicAlloc<ThreadPool>();
+        ThreadPoolCreate(engine->fallback, TOOL_IO_ENGINE_FALLBACK_THREADS);
+    }
+    
+    void IOEngineDestroy(IOEngine* engine)
+    {
+        IOEngineWait(engine);
+    
+#ifdef TOOL_LINUX
+        if (engine->uring)
+        {
+            IORequest* stop = nullptr;
+            UringSubmit(engine, &stop, 1);
+            ThreadJoin(engine->completionThread);
+            
+            UringDestroy(engine);
+        }
+#endif
+        
+        if (engine->fallback != nullptr)
+        {
+            ThreadPoolDestroy(engine->fallback);
+            ClassicDealloc(engine->fallback);
+        }
+        
+        *engine = {};
+    }
+    
+    void IOEngineRegisterBuffers(IOEngine* engine, Arena* arena, u32 count, u64 size)
+    {
+        size = (size + TOOL_IO_ENGINE_BUFFER_ALIGNMENT - 1) & ~(u64)(TOOL_IO_ENGINE_BUFFER_ALIGNMENT - 1);
+        
+        engine->buffers = (u8*)ArenaAllocAligned(arena, count * size, TOOL_IO_ENGINE_BUFFER_ALIGNMENT);
+        engine->bufferSize = size;
+        engine->bufferCount = count;
+    
+#ifdef TOOL_LINUX
+        if (engine->uring)
+        {
+            UringRegister(engine->ringDescriptor, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+            
+            Arena* scratch = ArenaScratchBegin(&arena, 1);
+            TOOL_DEFER(ArenaScratchEnd(scratch));
+            
+            iovec* vectors = (iovec*)ArenaAllocAligned(scratch, count * sizeof(iovec), alignof(iovec));
+            for (u32 i = 0; i < count; i++)
+            {
+                vectors[i] = { engine->buffers + i * size, size };
+            }
+            
+            if (UringRegister(engine->ringDescriptor, IORING_REGISTER_BUFFERS, vectors, count) < 0)
+            {
+                ExceptErrno();
+            }
+        }
+#endif
+    }
+    
+    void* IOEngineBuffer(IOEngine* engine, u32 index)
+    {
+        return engine->buffers + index * engine->bufferSize;
+    }
+    
+    void IOEngineSubmit(IOEngine* engine, IORequest* const* requests, u32 count)
+    {
+        // Reserved requests are only submitted together, so they are submitted before waiting for room,
+        // as they might be what other submitters wait on
+        u32 submitted = 0;
+        
+        for (u32 i = 0; i < count; i++)
+        {
+            if (!IOEngineReserve(engine, false))
+            {
+#ifdef TOOL_LINUX
+                if (engine->uring && submitted < i)
+                {
+                    UringSubmit(engine, requests + submitted, i - submitted);
+                    submitted = i;
+                }
+#endif
+                
+                IOEngineReserve(engine, true);
+            }
+            
+            IORequest* request = requests[i];
+            request->engine = engine;
+            request->result = 0;
+            request->transferred = 0;
+            request->done = 0;
+            
+            if (engine->fallback != nullptr)
+            {
+                ThreadPoolSubmit(engine->fallback, IOEngineFallbackRun, request);
+            }
+        }
+    
+#ifdef TOOL_LINUX
+        if (engine->uring && submitted < count)
+        {
+            UringSubmit(engine, requests + submitted, count - submitted);
+        }
+#endif
+    }
+    
+    void IOEngineSubmit(IOEngine* engine, IORequest* request)
+    {
+        IOEngineSubmit(engine, &request, 1);
+    }
+    
+    void IOEngineRead(IOEngine* engine, IORequest* request, File file, void* destination, u64 size, u64 offset,
+                      IORequestFunction callback, void* data)
+    {
+        request->type = IORequestTypeRead;
+        request->file = file;
+        request->buffer = destination;
+        request->size = size;
+        request->offset = offset;
+        request->callback = callback;
+        request->data = data;
+        
+        IOEngineSubmit(engine, request);
+    }
+    
+    void IOEngineWrite(IOEngine* engine, IORequest* request, File file, const void* source, u64 size, u64 offset,
+                       IORequestFunction callback, void* data)
+    {
+        request->type = IORequestTypeWrite;
+        request->file = file;
+        request->buffer = (void*)source;
+        request->size = size;
+        request->offset = offset;
+        request->callback = callback;
+        request->data = data;
+        
+        IOEngineSubmit(engine, request);
+    }
+    
+    i64 IORequestWait(IORequest* request)
+    {
+        while (AtomicLoad(&request->done) == 0)
+        {
+            FutexWait(&request->done, 0);
+        }
+        
+        return request->result;
+    }
+    
+    void IOEngineWait(IOEngine* engine)
+    {
+        while (true)
+        {
+            u32 count = AtomicLoad(&engine->inFlight);
+            if (count == 0)
+            {
+                return;
+            }
+            
+            AtomicAdd(&engine->inFlightWaiters, 1u);
+            FutexWait(&engine->inFlight, count);
+            AtomicAdd(&engine->inFlightWaiters, (u32)-1);
+        }
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef _TOOL_INTERNAL_H
+#define _TOOL_INTERNAL_H
+
+#include "io.h"
+
+
+
+// Helpers shared between translation units of the library, not part of its interface
+
+namespace Tool
+{
+    //- File IO
+    
+#ifdef TOOL_LINUX
+    
+    // Files hold the descriptor plus one in the low half, and for unbuffered files the log2 of their alignment above
+    static inline i32 LinuxDescriptor(File file)
+    {
+        return (i32)((file & 0xFFFFFFFF) - 1);
+    }
+    
+#endif
+}
+
+#endif //_TOOL_INTERNAL_H
@@ -2,6 +2,10 @@
 #include "io.h"
 #include "text.h"
 #include "threading.h"
+#include "exception.h"
+#include "mathematics.h"
+#include "utility.h"
+#include "internal.h"
 
 #if defined(TOOL_WINDOWS)
 
@@ -9,29 +13,51 @@
 
 #elif defined(TOOL_UNIX)
 
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #endif
 
 
+
+//~ Definitions
+
+#define TOOL_IO_TRANSFER_MAX (1ull << 30) // Largest single system call transfer, as both systems cap them below 4GB
+
+
 namespace Tool
 {
     //- File IO
     
+    //~ File IO static helpers
+    
+    // Systems only report misaligned unbuffered transfers as invalid parameters, so these are told apart
+    static void FileCheckAlignment(File file, const void* buffer, u64 size, u64 offset)
+    {
+        if (!FileAligned(file, buffer, size, offset))
+        {
+            Except("Unbuffered transfers need buffers, sizes and offsets aligned to %u bytes (buffer %p, size %llu, offset %llu).",
+                   FileAlignment(file), buffer, size, offset);
+        }
+    }
+    
     //~ File IO Windows implementation
     
 #ifdef TOOL_WINDOWS
     
-    static const c16* WindowsConvertPath(const c8* path)
+    // Converts the path to a UTF-16 Windows path, allocated onto the given (scratch) arena
+    static const c16* WindowsConvertPath(const c8* path, Arena* arena)
     {
-        static StringBuilder builder = {};
-        if (builder.type == StringTypeNone)
-        {
-            StringBuilderInit(&builder, 1024, StringTypeUTF16);
-        }
-        
-        StringBuilderReset(&builder);
-        StringBuilderAdd(&builder, path);
+        // A UTF-8 string never holds more characters than bytes
+        u64 size = CStr8Size(path);
+        c16* converted = (c16*)ArenaAlloc(arena, size + 1, sizeof(c16));
+        u64 count = Str16FromCStr8(converted, path, size, size + 1);
+        converted[count] = L'\0';
         
-        c16* current = builder.str16;
+        c16* current = converted;
         while (*current != L'\0')
         {
             b8 forwardSlash = *current == L'/';
@@ -41,7 +67,7 @@ namespace Tool
             current++;
         }
         
-        return builder.str16;
+        return converted;
     }
     
     b8 FileOpen(File* outFile, const c8* filename, OpenMode mode, i32 flags)
@@ -63,10 +89,10 @@ namespace Tool
             case OpenModeOverwriteExisting: disposition = TRUNCATE_EXISTING; break;
         }
         
-        HANDLE mutex = CreateMutex(nullptr, false, TEXT("LocalTOOLFileOpen"));
-        WaitForSingleObject(mutex, INFINITE);
+        Arena* scratch = ArenaScratchBegin();
+        TOOL_DEFER(ArenaScratchEnd(scratch));
         
-        const c16* parsedFilename = WindowsConvertPath(filename);
+        const c16* parsedFilename = WindowsConvertPath(filename, scratch);
         
         u32 access = GENERIC_READ | (GENERIC_WRITE * (mode != OpenModeRead));
         u32 shareMode = 
@@ -75,13 +101,11 @@ namespace Tool
         u32 flagsAndAttributes = 
             FILE_ATTRIBUTE_NORMAL |
             FILE_FLAG_NO_BUFFERING * ((flags & OpenFlagsUnbuffered) != 0) |
-            FILE_FLAG_OVERLAPPED * ((flags & 0/*OpenFlagsAsynchronous*/) != 0);
+            FILE_FLAG_OVERLAPPED * ((flags & OpenFlagsAsynchronous) != 0);
         
         *handle = CreateFileW((wchar_t*)parsedFilename, access, shareMode, 
                               nullptr, disposition, flagsAndAttributes, nullptr);
         
-        ReleaseMutex(mutex);
-        
         if (*handle == INVALID_HANDLE_VALUE)
         {
             *outFile = 0;
@@ -101,7 +125,10 @@ namespace Tool
     
     b8 FileExists(const c8* filename)
     {
-        const c16* parsedFilename = WindowsConvertPath(filename);
+        Arena* scratch = ArenaScratchBegin();
+        TOOL_DEFER(ArenaScratchEnd(scratch));
+        
+        const c16* parsedFilename = WindowsConvertPath(filename, scratch);
         
         u32 attributes = GetFileAttributesW((wchar_t*)parsedFilename);
         
@@ -133,29 +160,358 @@ namespace Tool
         return (u64)size;
     }
     
-    void FileRead(File file, void* destination, u32 size, u32* actual)
+    void FileSync(File file)
+    {
+        if (!FlushFileBuffers(*(HANDLE*)&file))
+        {
+            ExceptWindowsLast();
+        }
+    }
+    
+    u32 FileAlignment(File file)
+    {
+        FILE_STORAGE_INFO info;
+        if (file == 0 || !GetFileInformationByHandleEx(*(HANDLE*)&file, FileStorageInfo, &info, sizeof(info)))
+        {
+            return TOOL_FILE_DEFAULT_ALIGNMENT;
+        }
+        
+        return (u32)info.LogicalBytesPerSector;
+    }
+    
+    // Transfers in chunks a DWORD can hold, stopping early at the end of the file.
+    // Every transfer is given its offset, as files opened for asynchronous access have no position of their own,
+    // so sequential transfers read the file position and move it forward here.
+    static u64 FileTransfer(File file, void* buffer, u64 size, const u64* offset, b8 write)
+    {
+        HANDLE handle = *(HANDLE*)&file;
+        u64 start = 0;
+        u64 total = 0;
+        
+        if (offset != nullptr)
+        {
+            start = *offset;
+        }
+        else
+        {
+            LARGE_INTEGER current = {};
+            if (!SetFilePointerEx(handle, {}, &current, FILE_CURRENT))
+            {
+                ExceptWindowsLast();
+            }
+            
+            start = (u64)current.QuadPart;
+        }
+        
+        while (total < size)
+        {
+            DWORD chunk = (DWORD)TOOL_MIN(size - total, TOOL_IO_TRANSFER_MAX);
+            DWORD transferred = 0;
+            
+            OVERLAPPED overlapped = {};
+            overlapped.Offset = (DWORD)(start + total);
+            overlapped.OffsetHigh = (DWORD)((start + total) >> 32);
+            
+            b8 success = write ?
+                WriteFile(handle, (const u8*)buffer + total, chunk, &transferred, &overlapped) :
+                ReadFile(handle, (u8*)buffer + total, chunk, &transferred, &overlapped);
+            
+            // Files opened for asynchronous access complete in the background, so are waited on
+            if (!success && GetLastError() == ERROR_IO_PENDING)
+            {
+                success = GetOverlappedResult(handle, &overlapped, &transferred, TRUE);
+            }
+            
+            if (!success)
+            {
+                DWORD error = GetLastError();
+                if (error == ERROR_HANDLE_EOF)
+                {
+                    break;
+                }
+                
+                if (error == ERROR_INVALID_PARAMETER)
+                {
+                    FileCheckAlignment(file, (u8*)buffer + total, chunk, start + total);
+                }
+                
+                ExceptWindows(error);
+            }
+            
+            total += transferred;
+            
+            if (transferred < chunk)
+            {
+                break;
+            }
+        }
+        
+        if (offset == nullptr)
+        {
+            LARGE_INTEGER end = {};
+            end.QuadPart = (LONGLONG)(start + total);
+            SetFilePointerEx(handle, end, nullptr, FILE_BEGIN);
+        }
+        
+        return total;
+    }
+    
+#endif 
+    
+    //~ File IO Linux implementation
+    
+#ifdef TOOL_LINUX
+    
+    // Alignment direct transfers of the file need, of both memory and file offsets
+    static u32 LinuxDirectAlignment(i32 descriptor)
+    {
+        u32 alignment = TOOL_FILE_DEFAULT_ALIGNMENT;
+        
+#ifdef STATX_DIOALIGN
+        struct statx status;
+        if (statx(descriptor, "", AT_EMPTY_PATH, STATX_DIOALIGN, &status) == 0 && (status.stx_mask & STATX_DIOALIGN) &&
+            status.stx_dio_offset_align != 0)
+        {
+            alignment = TOOL_MAX(status.stx_dio_mem_align, status.stx_dio_offset_align);
+        }
+#endif
+        
+        return alignment;
+    }
+    
+    b8 FileOpen(File* outFile, const c8* filename, OpenMode mode, i32 flags)
+    {
+        i32 openFlags = O_CLOEXEC;
+        b8 append = false;
+        
+        switch (mode)
+        {
+            case OpenModeRead:              openFlags |= O_RDONLY; break;
+            case OpenModeNew:               openFlags |= O_RDWR | O_CREAT | O_EXCL; break;
+            case OpenModeNewOrAppend:       openFlags |= O_RDWR | O_CREAT; append = true; break;
+            case OpenModeNewOrOverwrite:    openFlags |= O_RDWR | O_CREAT | O_TRUNC; break;
+            case OpenModeAppendExisting:    openFlags |= O_RDWR; append = true; break;
+            case OpenModeOverwriteExisting: openFlags |= O_RDWR | O_TRUNC; break;
+        }
+        
+        b8 direct = (flags & OpenFlagsUnbuffered) != 0;
+        
+        i32 descriptor;
+        while (true)
+        {
+            descriptor = open(filename, openFlags | (direct ? O_DIRECT : 0), 0644);
+            
+            if (descriptor < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            
+            // Filesystems without direct access (such as tmpfs) refuse the flag, so those files stay buffered
+            if (descriptor < 0 && errno == EINVAL && direct)
+            {
+                direct = false;
+                continue;
+            }
+            
+            break;
+        }
+        
+        if (descriptor < 0)
+        {
+            *outFile = 0;
+            return false;
+        }
+        
+        u64 alignmentShift = 0;
+        if (direct)
+        {
+            u32 alignment = LinuxDirectAlignment(descriptor);
+            while ((1u << alignmentShift) < alignment)
+            {
+                alignmentShift++;
+            }
+        }
+        
+        // Positioned once like on Windows, rather than with O_APPEND, which would also move positional writes
+        if (append)
+        {
+            lseek(descriptor, 0, SEEK_END);
+        }
+        
+        *outFile = ((File)descriptor + 1) | (alignmentShift << 32);
+        return true;
+    }
+    
+    u32 FileAlignment(File file)
+    {
+        u32 shift = (u32)(file >> 32) & 0xFF;
+        return 1u << shift;
+    }
+    
+    b8 FileExists(const c8* filename)
+    {
+        struct stat status;
+        return stat(filename, &status) == 0 && S_ISREG(status.st_mode);
+    }
+    
+    void FileClose(File file)
     {
         if (file == 0)
         {
             return;
         }
         
-        HANDLE* handle = (HANDLE*)&file;
-        ReadFile(*handle, destination, size, (LPDWORD)actual, nullptr);
+        close(LinuxDescriptor(file));
     }
     
-    void FileWrite(File file, const void* source, u32 size, u32* actual)
+    u64 FileSize(File file)
     {
         if (file == 0)
         {
-            return;
+            return 0;
         }
         
-        HANDLE* handle = (HANDLE*)&file;
-        WriteFile(*handle, source, size, (LPDWORD)actual, nullptr);
+        struct stat status;
+        if (fstat(LinuxDescriptor(file), &status) != 0)
+        {
+            ExceptErrno();
+        }
+        
+        return (u64)status.st_size;
+    }
+    
+    void FileSync(File file)
+    {
+        i32 result;
+        do
+        {
+            result = fdatasync(LinuxDescriptor(file));
+        }
+        while (result != 0 && errno == EINTR);
+        
+        if (result != 0)
+        {
+            ExceptErrno();
+        }
+    }
+    
+    // Repeats short transfers until done, stopping early at the end of the file
+    static u64 FileTransfer(File file, void* buffer, u64 size, const u64* offset, b8 write)
+    {
+        i32 descriptor = LinuxDescriptor(file);
+        u64 total = 0;
+        
+        while (total < size)
+        {
+            u64 chunk = TOOL_MIN(size - total, TOOL_IO_TRANSFER_MAX);
+            u8* start = (u8*)buffer + total;
+            
+            ssize_t transferred;
+            if (offset != nullptr)
+            {
+                off_t position = (off_t)(*offset + total);
+                transferred = write ? pwrite(descriptor, start, chunk, position) : pread(descriptor, start, chunk, position);
+            }
+            else
+            {
+                transferred = write ? ::write(descriptor, start, chunk) : read(descriptor, start, chunk);
+            }
+            
+            if (transferred < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                
+                if (errno == EINVAL)
+                {
+                    u64 position = offset != nullptr ? *offset + total : (u64)lseek(descriptor, 0, SEEK_CUR);
+                    FileCheckAlignment(file, start, chunk, position);
+                }
+                
+                ExceptErrno();
+            }
+            
+            if (transferred == 0)
+            {
+                break;
+            }
+            
+            total += (u64)transferred;
+            
+            // Unbuffered reads are only short at the end of the file, where the next one would be misaligned
+            if (!write && (u64)transferred < chunk && FileAlignment(file) > 1)
+            {
+                break;
+            }
+        }
+        
+        return total;
+    }
+    
+#endif
+    
+    //~ File IO general implementation
+    
+#if defined(TOOL_WINDOWS) || defined(TOOL_LINUX)
+    
+    void FileRead(File file, void* destination, u64 size, u64* outSize)
+    {
+        u64 transferred = file != 0 ? FileTransfer(file, destination, size, nullptr, false) : 0;
+        
+        if (outSize != nullptr)
+        {
+            *outSize = transferred;
+        }
     }
     
-    b8 FileDump(const c8* filename, void** outDump, u32* outSize, MemoryAllocator allocator)
+    void FileWrite(File file, const void* source, u64 size, u64* outSize)
+    {
+        u64 transferred = file != 0 ? FileTransfer(file, (void*)source, size, nullptr, true) : 0;
+        
+        if (outSize != nullptr)
+        {
+            *outSize = transferred;
+        }
+    }
+    
+    void FileReadAt(File file, void* destination, u64 size, u64 offset, u64* outSize)
+    {
+        u64 transferred = file != 0 ? FileTransfer(file, destination, size, &offset, false) : 0;
+        
+        if (outSize != nullptr)
+        {
+            *outSize = transferred;
+        }
+    }
+    
+    void FileWriteAt(File file, const void* source, u64 size, u64 offset, u64* outSize)
+    {
+        u64 transferred = file != 0 ? FileTransfer(file, (void*)source, size, &offset, true) : 0;
+        
+        if (outSize != nullptr)
+        {
+            *outSize = transferred;
+        }
+    }
+    
+    b8 FileAligned(File file, const void* buffer, u64 size, u64 offset)
+    {
+        u64 mask = FileAlignment(file) - 1;
+        return (((u64)buffer | size | offset) & mask) == 0;
+    }
+    
+    void* FileBufferAlloc(MemoryRegion* region, u64 size)
+    {
+        u64 start = (region->committed + TOOL_FILE_BUFFER_ALIGNMENT - 1) & ~(u64)(TOOL_FILE_BUFFER_ALIGNMENT - 1);
+        u64 end = start + ((size + TOOL_FILE_BUFFER_ALIGNMENT - 1) & ~(u64)(TOOL_FILE_BUFFER_ALIGNMENT - 1));
+        
+        RegionCommit(region, end);
+        return (u8*)region->start + start;
+    }
+    
+    b8 FileDump(const c8* filename, void** outDump, u64* outSize, MemoryAllocator allocator)
     {
         File file = 0;
         b8 success = FileOpen(&file, filename, OpenModeRead);
@@ -164,21 +520,261 @@ namespace Tool
             return false;
         }
         
-        u32 size = (u32)FileSize(file);
-        void* allocation = AllocatorAlloc(allocator, size + 1);
+        TOOL_DEFER(FileClose(file));
+        
+        u64 size = FileSize(file);
+        u8* allocation = (u8*)AllocatorAlloc(allocator, size + 1);
         if (allocation == nullptr)
         {
             return false;
         }
         
-        FileRead(file, allocation, size);
-        FileClose(file);
+        FileReadAt(file, allocation, size, 0, &size);
+        allocation[size] = 0;
         
         *outDump = allocation;
         *outSize = size;
         return true;
     }
     
-#endif 
+#endif
+    
+    
+    
+    //- File mapping
+    
+    //~ File mapping static helpers
+    
+    // Finds the views of a file range, returning false when outside the file
+    static b8 FileMapView(File file, u64 offset, u64* size, u64 granularity, u64* viewOffset, u64* viewSize)
+    {
+        u64 fileSize = FileSize(file);
+        if (offset > fileSize || *size > fileSize - offset)
+        {
+            return false;
+        }
+        
+        if (*size == 0)
+        {
+            *size = fileSize - offset;
+        }
+        
+        *viewOffset = offset & ~(granularity - 1);
+        *viewSize = *size + (offset - *viewOffset);
+        return true;
+    }
+    
+    // Narrows a range of the mapping to whole pages, returning false when empty
+    static b8 FileMapPages(FileMapping* mapping, u64 offset, u64 size, u64 pageSize, u8** outStart, u64* outSize)
+    {
+        if (offset >= mapping->size)
+        {
+            return false;
+        }
+        
+        size = size == 0 ? mapping->size - offset : TOOL_MIN(size, mapping->size - offset);
+        
+        u8* start = (u8*)mapping->data + offset;
+        u8* pageStart = (u8*)((u64)start & ~(pageSize - 1));
+        
+        *outStart = pageStart;
+        *outSize = (u64)(start + size - pageStart);
+        return true;
+    }
+    
+    //~ File mapping Windows implementation
+    
+#ifdef TOOL_WINDOWS
+    
+    b8 FileMap(FileMapping* outMapping, File file, FileMapMode mode, u64 offset, u64 size)
+    {
+        *outMapping = {};
+        
+        SYSTEM_INFO systemInfo;
+        GetSystemInfo(&systemInfo);
+        
+        u64 viewOffset, viewSize;
+        if (file == 0 || !FileMapView(file, offset, &size, systemInfo.dwAllocationGranularity, &viewOffset, &viewSize))
+        {
+            return false;
+        }
+        
+        // Empty files cannot be mapped, but empty ranges need not be
+        if (size == 0)
+        {
+            return true;
+        }
+        
+        DWORD protection = 0;
+        DWORD access = 0;
+        
+        switch (mode)
+        {
+            case FileMapModeRead:        protection = PAGE_READONLY;  access = FILE_MAP_READ; break;
+            case FileMapModeCopyOnWrite: protection = PAGE_WRITECOPY; access = FILE_MAP_COPY; break;
+            case FileMapModeWrite:       protection = PAGE_READWRITE; access = FILE_MAP_WRITE; break;
+        }
+        
+        HANDLE handle = *(HANDLE*)&file;
+        HANDLE object = CreateFileMappingW(handle, nullptr, protection, 0, 0, nullptr);
+        if (object == nullptr)
+        {
+            return false;
+        }
+        
+        void* view = MapViewOfFile(object, access, (DWORD)(viewOffset >> 32), (DWORD)viewOffset, (SIZE_T)viewSize);
+        if (view == nullptr)
+        {
+            CloseHandle(object);
+            return false;
+        }
+        
+        if (mode == FileMapModeWrite)
+        {
+            HANDLE duplicate = nullptr;
+            DuplicateHandle(GetCurrentProcess(), handle, GetCurrentProcess(), &duplicate, 0, FALSE, DUPLICATE_SAME_ACCESS);
+            outMapping->file = *(File*)&duplicate;
+        }
+        
+        outMapping->data = (u8*)view + (offset - viewOffset);
+        outMapping->size = size;
+        outMapping->view = view;
+        outMapping->viewSize = viewSize;
+        outMapping->handle = *(u64*)&object;
+        return true;
+    }
+    
+    void FileUnmap(FileMapping* mapping)
+    {
+        if (mapping->view != nullptr)
+        {
+            UnmapViewOfFile(mapping->view);
+            CloseHandle(*(HANDLE*)&mapping->handle);
+            FileClose(mapping->file);
+        }
+        
+        *mapping = {};
+    }
+    
+    void FileMapAdvise(FileMapping* mapping, FileMapHint hint, u64 offset, u64 size)
+    {
+        u8* start;
+        u64 length;
+        if (hint != FileMapHintWillNeed || !FileMapPages(mapping, offset, size, 1, &start, &length))
+        {
+            return;
+        }
+        
+        WIN32_MEMORY_RANGE_ENTRY range = { start, (SIZE_T)length };
+        PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+    }
+    
+    void FileMapFlush(FileMapping* mapping, u64 offset, u64 size, b8 wait)
+    {
+        u8* start;
+        u64 length;
+        if (!FileMapPages(mapping, offset, size, 1, &start, &length))
+        {
+            return;
+        }
+        
+        if (!FlushViewOfFile(start, (SIZE_T)length))
+        {
+            ExceptWindowsLast();
+        }
+        
+        if (wait && mapping->file != 0 && !FlushFileBuffers(*(HANDLE*)&mapping->file))
+        {
+            ExceptWindowsLast();
+        }
+    }
+    
+#endif
+    
+    //~ File mapping Linux implementation
+    
+#ifdef TOOL_LINUX
+    
+    b8 FileMap(FileMapping* outMapping, File file, FileMapMode mode, u64 offset, u64 size)
+    {
+        *outMapping = {};
+        
+        u64 viewOffset, viewSize;
+        if (file == 0 || !FileMapView(file, offset, &size, (u64)sysconf(_SC_PAGESIZE), &viewOffset, &viewSize))
+        {
+            return false;
+        }
+        
+        // Empty ranges cannot be mapped
+        if (size == 0)
+        {
+            return true;
+        }
+        
+        i32 protection = PROT_READ | (mode != FileMapModeRead ? PROT_WRITE : 0);
+        i32 flags = mode == FileMapModeWrite ? MAP_SHARED : MAP_PRIVATE;
+        
+        void* view = mmap(nullptr, viewSize, protection, flags, LinuxDescriptor(file), (off_t)viewOffset);
+        if (view == MAP_FAILED)
+        {
+            return false;
+        }
+        
+        outMapping->data = (u8*)view + (offset - viewOffset);
+        outMapping->size = size;
+        outMapping->view = view;
+        outMapping->viewSize = viewSize;
+        return true;
+    }
+    
+    void FileUnmap(FileMapping* mapping)
+    {
+        if (mapping->view != nullptr)
+        {
+            munmap(mapping->view, mapping->viewSize);
+        }
+        
+        *mapping = {};
+    }
+    
+    void FileMapAdvise(FileMapping* mapping, FileMapHint hint, u64 offset, u64 size)
+    {
+        u8* start;
+        u64 length;
+        if (!FileMapPages(mapping, offset, size, (u64)sysconf(_SC_PAGESIZE), &start, &length))
+        {
+            return;
+        }
+        
+        i32 advice = MADV_NORMAL;
+        switch (hint)
+        {
+            case FileMapHintNormal:     advice = MADV_NORMAL; break;
+            case FileMapHintSequential: advice = MADV_SEQUENTIAL; break;
+            case FileMapHintRandom:     advice = MADV_RANDOM; break;
+            case FileMapHintWillNeed:   advice = MADV_WILLNEED; break;
+            case FileMapHintDontNeed:   advice = MADV_DONTNEED; break;
+        }
+        
+        // Advice is only a hint, so failures are not worth reporting
+        madvise(start, length, advice);
+    }
+    
+    void FileMapFlush(FileMapping* mapping, u64 offset, u64 size, b8 wait)
+    {
+        u8* start;
+        u64 length;
+        if (!FileMapPages(mapping, offset, size, (u64)sysconf(_SC_PAGESIZE), &start, &length))
+        {
+            return;
+        }
+        
+        if (msync(start, length, wait ? MS_SYNC : MS_ASYNC) != 0)
+        {
+            ExceptErrno();
+        }
+    }
+    
+#endif
     
 }
\ No newline at end of file
@@ -1,6 +1,10 @@
 #include "memory.h"
 #include "exception.h"
 #include "mathematics.h"
+#include "atomic.h"
+#include "utility.h"
+
+#include <stdio.h>
 
 #ifdef TOOL_WINDOWS
 #include <Windows.h>
@@ -9,12 +13,32 @@
 #ifdef TOOL_UNIX
 #include <sys/mman.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #endif
 
 
 
 //- Static helper functions
 
+//~ General static helper functions
+
+// Round a given size up to the nearest multiple of the granularity, which itself is a power of 2
+static u64 RoundToGranularity(u64 size, u64 granularity)
+{
+    return (size + granularity - 1) & ~(granularity - 1);
+}
+
+// Writes to every page in the range, forcing the system to back it with physical memory
+static void TouchPages(void* start, u64 size, u64 pageSize)
+{
+    for (u64 offset = 0; offset < size; offset += pageSize)
+    {
+        volatile u8* page = (volatile u8*)start + offset;
+        *page = *page;
+    }
+}
+
 //~ Windows static helper functions
 
 #ifdef TOOL_WINDOWS
@@ -23,25 +47,132 @@
 static DWORD GetLowDWORD(u64 whole) { return (DWORD)(whole & 0xffffffff); }
 static DWORD GetHighDWORD(u64 whole) { return (DWORD)(whole >> 0x20); }
 
-// Round a given size up to the nearest multiple of the granularity, which itself is a power of 2
-static u64 RoundToGranularity(u64 size, u64 granularity)
-{
-    return (size + granularity - 1) & ~(granularity - 1);
-}
+#endif
+
+//~ Statistics recording
 
+// Statements only compiled in when allocation statistics are enabled
+#ifdef TOOL_MEMORY_STATS
+#define TOOL_MEMORY_STATS_RECORD(...) __VA_ARGS__
+#else
+#define TOOL_MEMORY_STATS_RECORD(...)
 #endif
 
 
 
 namespace Tool
 {
+    //- Memory statistics
+    
+    //~ Memory statistics recording
+    
+#ifdef TOOL_MEMORY_STATS
+    
+    static SpinLock memoryStatsLock = 0;
+    static MemoryStats* memoryStatsFirst = nullptr;
+    static MemoryStats heapStats = { "Heap", 0, 0, 0, 0, 0, 0, 0, 0, {}, nullptr };
+    
+    static MemoryStats* MemoryStatsCreate(const c8* name, u64 reservedSize, u64 committedSize)
+    {
+        MemoryStats* stats = (MemoryStats*)ClassicAlloc(sizeof(MemoryStats));
+        *stats = {};
+        stats->name = name;
+        stats->reservedSize = reservedSize;
+        stats->committedSize = committedSize;
+        stats->commitCount = committedSize != 0;
+        
+        SpinLockAcquire(&memoryStatsLock);
+        stats->next = memoryStatsFirst;
+        memoryStatsFirst = stats;
+        SpinLockRelease(&memoryStatsLock);
+        
+        return stats;
+    }
+    
+    static void MemoryStatsDestroy(MemoryStats* stats)
+    {
+        if (stats == nullptr)
+        {
+            return;
+        }
+        
+        SpinLockAcquire(&memoryStatsLock);
+        
+        MemoryStats** link = &memoryStatsFirst;
+        while (*link != stats)
+        {
+            link = &(*link)->next;
+        }
+        *link = stats->next;
+        
+        SpinLockRelease(&memoryStatsLock);
+        
+        ClassicDealloc(stats);
+    }
+    
+    static void MemoryStatsRecordPeak(MemoryStats* stats, u64 liveSize)
+    {
+        u64 peak = AtomicLoadRelaxed(&stats->peakSize);
+        while (liveSize > peak && !AtomicCompareExchange(&stats->peakSize, &peak, liveSize))
+        {
+        }
+    }
+    
+    static void MemoryStatsRecordAlloc(MemoryStats* stats, u64 size)
+    {
+        u32 bucket = 0;
+        while ((size >> bucket) > 1 && bucket < TOOL_MEMORY_STATS_BUCKET_COUNT - 1)
+        {
+            bucket++;
+        }
+        
+        AtomicAdd(&stats->allocationCount, 1ull);
+        AtomicAdd(&stats->sizeHistogram[bucket], 1ull);
+        MemoryStatsRecordPeak(stats, AtomicAdd(&stats->liveSize, size) + size);
+    }
+    
+    static void MemoryStatsRecordDealloc(MemoryStats* stats, u64 size)
+    {
+        AtomicAdd(&stats->deallocationCount, 1ull);
+        AtomicAdd(&stats->liveSize, (u64)0 - size);
+    }
+    
+    // Changes the live size without counting an allocation, for resizing and frame pops
+    static void MemoryStatsRecordResize(MemoryStats* stats, u64 size, u64 newSize)
+    {
+        MemoryStatsRecordPeak(stats, AtomicAdd(&stats->liveSize, newSize - size) + newSize - size);
+    }
+    
+    // Adds to the committed (and reserved) size, counting one commit or decommit
+    static void MemoryStatsRecordCommit(MemoryStats* stats, i64 committedDelta, i64 reservedDelta)
+    {
+        AtomicAdd(committedDelta >= 0 ? &stats->commitCount : &stats->decommitCount, 1ull);
+        AtomicAdd(&stats->committedSize, (u64)committedDelta);
+        AtomicAdd(&stats->reservedSize, (u64)reservedDelta);
+    }
+    
+    // Follows the committed size of a region, after it might have changed
+    static void MemoryStatsRecordRegion(MemoryStats* stats, const MemoryRegion* region)
+    {
+        u64 previous = AtomicExchange(&stats->committedSize, region->committed);
+        
+        if (region->committed != previous)
+        {
+            AtomicAdd(region->committed > previous ? &stats->commitCount : &stats->decommitCount, 1ull);
+        }
+    }
+    
+#endif
+    
+    
+    
     //- Classic allocation
     
     //~ Classic allocation Windows implementation
     
 #ifdef TOOL_WINDOWS
     
-    void* ClassicAlloc(u64 size)
+    static void* HeapMapLarge(u64 size)
     {
         void* result = (void*)VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
         
@@ -53,7 +184,7 @@ namespace Tool
         return result;
     }
     
-    void ClassicDealloc(void* start)
+    static void HeapUnmapLarge(void* start, u64 size)
     {
         b32 result = VirtualFree(start, 0, MEM_RELEASE);
         
@@ -63,13 +194,26 @@ namespace Tool
         }
     }
     
+    // Mappings cannot be resized in place, so reallocation falls back to copying
+    static void* HeapRemapLarge(void* start, u64 size, u64 newSize)
+    {
+        return nullptr;
+    }
+    
+    static u32 HighestBit(u64 value)
+    {
+        unsigned long index = 0;
+        _BitScanReverse64(&index, value);
+        return (u32)index;
+    }
+    
 #endif // TOOL_WINDOWS
     
     //~ Classic allocation Unix implementation
     
 #ifdef TOOL_UNIX
     
-    void* ClassicAlloc(u64 size)
+    static void* HeapMapLarge(u64 size)
     {
         void* result = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
         
@@ -81,7 +225,7 @@ namespace Tool
         return result;
     }
     
-    void ClassicDealloc(void* start, u64 size)
+    static void HeapUnmapLarge(void* start, u64 size)
     {
         i32 result = munmap(start, size);
         
@@ -91,356 +235,987 @@ namespace Tool
         }
     }
     
-#endif // TOOL_WINDOWS
-    
-    //~ Classic allocation general functions
-    
-    void ClassicRealloc(void** target, u64 currentSize, u64 newSize)
+    // Resizes a mapping by remapping its pages, moving it if it cannot grow in place. Nullptr indicates no support.
+    static void* HeapRemapLarge(void* start, u64 size, u64 newSize)
     {
-        void* p = ClassicAlloc(newSize);
-        Copy(p, *target, currentSize);
-        ClassicDealloc(*target);
-        *target = p;
+#ifdef TOOL_LINUX
+        void* result = mremap(start, size, newSize, MREMAP_MAYMOVE);
+        
+        if (result == MAP_FAILED)
+        {
+            ExceptErrno();
+        }
+        
+        return result;
+#else
+        return nullptr;
+#endif
     }
     
-    void* ClassicAlloc(u64 count, u64 size)
+    static u32 HighestBit(u64 value)
     {
-        return ClassicAlloc(count * size);
+        return 63 - (u32)__builtin_clzll(value);
     }
     
-    void ClassicRealloc(void** target, u64 currentCount, u64 newCount, u64 size)
-    {
-        ClassicRealloc(target, currentCount * size, newCount * size);
-    }
+#endif // TOOL_UNIX
     
+    //~ Classic allocation general functions
     
+    // Small allocations are carved from spans within a single reserved region, where every span serves one size class.
+    // Each thread caches free blocks per class, and exchanges them in batches with a shared, locked list per class.
+    // Large allocations are mapped directly, and prefixed by a header recording the size of the mapping.
     
-    //- Memory region
+    struct HeapLargeHeader
+    {
+        u64 mappingSize;
+        u64 mappingOffset; // From the start of the mapping to the returned pointer, which directly follows the header
+    };
     
-    //~ Memory region Windows implementation
+    struct alignas(TOOL_CACHE_LINE_SIZE) HeapClassList
+    {
+        SpinLock lock;
+        u32 count;
+        void* freeList;
+    };
     
-#ifdef TOOL_WINDOWS
+    struct HeapCache
+    {
+        void* freeLists[TOOL_HEAP_CLASS_COUNT];
+        u32 counts[TOOL_HEAP_CLASS_COUNT];
+        
+        // Unused remainder of the span most recently assigned to each class
+        u8* spanHeads[TOOL_HEAP_CLASS_COUNT];
+        u8* spanEnds[TOOL_HEAP_CLASS_COUNT];
+        
+        ~HeapCache();
+    };
     
-    void RegionReserve(MemoryRegion* region, u64 size)
+    static MemoryRegion heapRegion = {};
+    static u8* heapBase = nullptr; // Published once the region has been reserved
+    static u64 heapSpanCount = 0;
+    static SpinLock heapSpanLock = 0;
+    static u8 heapSpanClasses[TOOL_HEAP_RESERVE_SIZE / TOOL_HEAP_SPAN_SIZE];
+    static HeapClassList heapClassLists[TOOL_HEAP_CLASS_COUNT];
+    
+    static thread_local HeapCache heapCache = {};
+    static thread_local b8 heapCacheReleased = false;
+    
+    // Classes are spaced by 16 bytes up to 128, then by four steps per doubling up to TOOL_HEAP_MAX_SMALL_SIZE.
+    static inline u32 HeapClassIndex(u64 size)
     {
-        if (region->start != nullptr)
+        if (size <= 128)
         {
-            Except("Cannot reserve a Region which is already initialized."); 
+            return (u32)((TOOL_MAX(size, 1) + 15) / 16 - 1);
         }
         
-        region->start = (void*)VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_READWRITE);
+        u64 last = size - 1;
+        u32 bit = HighestBit(last);
         
-        if (region->start == nullptr)
+        return 8 + (bit - 7) * 4 + (u32)(last >> (bit - 2)) - 4;
+    }
+    
+    static inline u64 HeapClassSize(u32 index)
+    {
+        if (index < 8)
         {
-            ExceptWindowsLast();
+            return (index + 1) * 16;
         }
         
-        region->reserved = size;
-        region->committed = 0;
+        u32 step = index - 8;
+        u64 base = 128ull << (step / 4);
+        
+        return base + (step % 4 + 1) * (base / 4);
     }
     
-    void RegionCommit(MemoryRegion* region, u64 newSize)
+    // Number of blocks moved between a thread cache and the shared list at a time
+    static inline u32 HeapClassBatch(u32 index)
     {
-        if (newSize >region->reserved)
-        {
-            Except("Cannot commit more memory to a Region than is reserved. (%ull > %ull)", newSize, region->reserved);
-        }
+        return (u32)TOOL_MAX(TOOL_HEAP_TRANSFER_SIZE / HeapClassSize(index), 2);
+    }
+    
+    static inline HeapCache* HeapCacheGet()
+    {
+        // Once the thread is exiting, its cache is gone and blocks go straight to the shared lists
+        return heapCacheReleased ? nullptr : &heapCache;
+    }
+    
+    // Pushes a linked chain of blocks onto the shared list of a class
+    static void HeapSharedPush(u32 index, void* first, void* last, u32 count)
+    {
+        HeapClassList* list = &heapClassLists[index];
+        
+        SpinLockAcquire(&list->lock);
+        *(void**)last = list->freeList;
+        list->freeList = first;
+        list->count += count;
+        SpinLockRelease(&list->lock);
+    }
+    
+    // Detaches a chain of up to 'maxCount' blocks from the shared list of a class
+    static void* HeapSharedPop(u32 index, u32 maxCount, u32* outCount)
+    {
+        HeapClassList* list = &heapClassLists[index];
         
-        VirtualAlloc(region->start, newSize, MEM_COMMIT, PAGE_READWRITE);
+        SpinLockAcquire(&list->lock);
         
-        if (region->start == nullptr)
+        void* first = list->freeList;
+        void* last = first;
+        u32 count = 0;
+        
+        if (first != nullptr)
         {
-            ExceptWindowsLast();
+            count = 1;
+            while (count < maxCount && *(void**)last != nullptr)
+            {
+                last = *(void**)last;
+                count++;
+            }
+            
+            list->freeList = *(void**)last;
+            list->count -= count;
+            *(void**)last = nullptr;
         }
         
-        region->committed = newSize;
+        SpinLockRelease(&list->lock);
+        
+        *outCount = count;
+        return first;
     }
     
-    void RegionRevert(MemoryRegion* region, u64 newSize)
+    // Assigns a new span to the given class, returning its start
+    static u8* HeapSpanAcquire(u32 index)
     {
-        if (newSize >= region->committed)
+        SpinLockAcquire(&heapSpanLock);
+        TOOL_DEFER(SpinLockRelease(&heapSpanLock));
+        
+        if (heapBase == nullptr)
         {
-            return;
+            RegionReserve(&heapRegion, TOOL_HEAP_RESERVE_SIZE);
+            AtomicStore(&heapBase, (u8*)heapRegion.start);
+            
+            TOOL_MEMORY_STATS_RECORD(AtomicAdd(&heapStats.reservedSize, heapRegion.reserved));
         }
         
-        b32 result = VirtualFree((u8*)region->start + newSize, region->committed - newSize, MEM_DECOMMIT); 
+        u64 end = (heapSpanCount + 1) * TOOL_HEAP_SPAN_SIZE;
         
-        if (!result)
+        if (end > heapRegion.reserved)
         {
-            ExceptWindowsLast();
+            Except("Cannot allocate more small blocks than fit in the reserved heap. (%llu bytes)", heapRegion.reserved);
         }
         
-        region->committed = newSize;
-    }
-    
-    void RegionDealloc(MemoryRegion* region)
-    {
-        if (region->start == nullptr)
+        if (end > heapRegion.committed)
         {
-            return;
+            u64 newCommittedSize = heapRegion.committed;
+            while (end > newCommittedSize)
+            {
+                newCommittedSize += TOOL_MIN(TOOL_MAX(newCommittedSize, TOOL_HEAP_SPAN_SIZE), TOOL_ARENA_MAX_INCREMENT_SIZE);
+            }
+            
+            TOOL_MEMORY_STATS_RECORD(u64 committed = heapRegion.committed);
+            RegionCommit(&heapRegion, TOOL_MIN(newCommittedSize, heapRegion.reserved));
+            
+            TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordCommit(&heapStats, (i64)(heapRegion.committed - committed), 0));
         }
         
-        b32 result = VirtualFree(region->start, 0, MEM_RELEASE); 
+        heapSpanClasses[heapSpanCount] = (u8)index;
+        u8* span = heapBase + heapSpanCount * TOOL_HEAP_SPAN_SIZE;
+        heapSpanCount++;
         
-        if (!result)
+        return span;
+    }
+    
+    // Links 'count' consecutive blocks into a chain, returning its last block, whose link is left to the caller
+    static void* HeapLinkBlocks(u8* first, u64 size, u32 count)
+    {
+        for (u32 i = 0; i + 1 < count; i++)
         {
-            ExceptWindowsLast();
+            *(void**)(first + i * size) = first + (i + 1) * size;
         }
         
-        region->start = nullptr;
-        region->reserved = 0;
-        region->committed = 0;
+        return first + (u64)(count - 1) * size;
     }
     
-#endif // TOOL_WINDOWS
-    
-    //~ Memory region Unix implementation
-    
-#ifdef TOOL_UNIX
-    
-    // On Unix, mmap does not actually allocate the memory. Physical pages will only be assigned when the memory is acted upon, such as by writing.
-    
-    // Reservation will mmap the entire region, and *protect* virtual pages beyond the boundary from being interacted with.
-    
-    static void UnixRegionProtect(void* memory, u64 accessible, u64 total)
+    static void* HeapAllocSlow(HeapCache* cache, u32 index)
     {
-        static u64 pageSize = (u64)getpagesize();
+        u64 size = HeapClassSize(index);
+        u32 count = 0;
         
-        u64 accessibleAligned = pageSize * ((accessible - 1) / pageSize + 1);
-        
-        void* startAccessible = memory;
-        void* startInaccessible = (void*)((char*)memory + accessibleAligned);
+        // Without a cache, take a block from the shared list, or hand a whole new span to it
+        if (cache == nullptr)
+        {
+            void* block = HeapSharedPop(index, 1, &count);
+            if (block != nullptr)
+            {
+                return block;
+            }
+            
+            u8* span = HeapSpanAcquire(index);
+            u32 blockCount = (u32)(TOOL_HEAP_SPAN_SIZE / size);
+            
+            if (blockCount > 1)
+            {
+                void* last = HeapLinkBlocks(span + size, size, blockCount - 1);
+                HeapSharedPush(index, span + size, last, blockCount - 1);
+            }
+            
+            return span;
+        }
         
-        i32 result = 0; 
-        result |= mprotect(startAccessible, accessibleAligned, PROT_READ | PROT_WRITE);
+        // Otherwise, refill the cache with a batch from the thread's own span, which takes no lock.
+        // Only once the span is exhausted are shared blocks taken, before acquiring a new span.
+        u64 available = (u64)(cache->spanEnds[index] - cache->spanHeads[index]) / size;
         
-        if (total > accessibleAligned)
+        if (available == 0)
         {
-            result |= mprotect(startInaccessible, total - accessibleAligned, PROT_NONE);
+            void* block = HeapSharedPop(index, HeapClassBatch(index), &count);
+            if (block != nullptr)
+            {
+                cache->freeLists[index] = *(void**)block;
+                cache->counts[index] = count - 1;
+                
+                return block;
+            }
+            
+            u8* span = HeapSpanAcquire(index);
+            cache->spanHeads[index] = span;
+            cache->spanEnds[index] = span + TOOL_HEAP_SPAN_SIZE;
+            available = TOOL_HEAP_SPAN_SIZE / size;
         }
         
-        if (result < 0)
+        count = (u32)TOOL_MIN(available, HeapClassBatch(index));
+        u8* block = cache->spanHeads[index];
+        cache->spanHeads[index] += count * size;
+        
+        if (count > 1)
         {
-            ExceptErrno();
+            void* last = HeapLinkBlocks(block + size, size, count - 1);
+            *(void**)last = nullptr;
+            
+            cache->freeLists[index] = block + size;
+            cache->counts[index] = count - 1;
         }
+        
+        return block;
     }
     
-    void RegionReserve(MemoryRegion* region, u64 size)
+    static inline void* HeapAllocSmall(u32 index)
     {
-        if (region->start != nullptr)
-        {
-            Except("Cannot reserve a Region which is already initialized."); 
-        }
+        HeapCache* cache = HeapCacheGet();
         
-        // Initialize the memory with no access rights
-        region->start = mmap(nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        void* block = cache != nullptr ? cache->freeLists[index] : nullptr;
         
-        if (region->start == MAP_FAILED)
+        if (block == nullptr)
         {
-            region->start = nullptr;
-            ExceptErrno();
+            return HeapAllocSlow(cache, index);
         }
         
-        region->reserved = size;
-        region->committed = 0;
+        cache->freeLists[index] = *(void**)block;
+        cache->counts[index]--;
+        
+        return block;
     }
     
-    void RegionCommit(MemoryRegion* region, u64 newSize)
+    static inline void HeapFreeSmall(void* block, u32 index)
     {
-        if (newSize > region->reserved)
+        HeapCache* cache = HeapCacheGet();
+        
+        if (cache == nullptr)
         {
-            Except("Cannot commit more memory to a Region than is reserved. (%ull > %ull)", newSize, region->reserved);
+            HeapSharedPush(index, block, block, 1);
+            return;
         }
         
-        UnixRegionProtect(region->start, newSize, region->reserved);
+        *(void**)block = cache->freeLists[index];
+        cache->freeLists[index] = block;
+        cache->counts[index]++;
         
-        region->committed = newSize;
+        // Return a batch to the shared list once the cache holds more than two batches
+        u32 batch = HeapClassBatch(index);
+        if (cache->counts[index] > 2 * batch)
+        {
+            void* first = cache->freeLists[index];
+            void* last = first;
+            
+            for (u32 i = 1; i < batch; i++)
+            {
+                last = *(void**)last;
+            }
+            
+            cache->freeLists[index] = *(void**)last;
+            cache->counts[index] -= batch;
+            
+            HeapSharedPush(index, first, last, batch);
+        }
     }
     
-    void RegionRevert(MemoryRegion* region, u64 newSize)
+    // Hands every cached block, and the remainders of all current spans, to the shared lists on thread exit
+    HeapCache::~HeapCache()
     {
-        if (newSize >= region->committed)
+        heapCacheReleased = true;
+        
+        for (u32 index = 0; index < TOOL_HEAP_CLASS_COUNT; index++)
         {
-            return;
+            void* first = freeLists[index];
+            
+            if (first != nullptr)
+            {
+                void* last = first;
+                while (*(void**)last != nullptr)
+                {
+                    last = *(void**)last;
+                }
+                
+                HeapSharedPush(index, first, last, counts[index]);
+            }
+            
+            // The remainder of the span goes as a single chain, taking the lock once
+            u64 size = HeapClassSize(index);
+            u32 remaining = spanHeads[index] != nullptr ? (u32)((u64)(spanEnds[index] - spanHeads[index]) / size) : 0;
+            
+            if (remaining > 0)
+            {
+                void* last = HeapLinkBlocks(spanHeads[index], size, remaining);
+                HeapSharedPush(index, spanHeads[index], last, remaining);
+            }
+            
+            freeLists[index] = nullptr;
+            counts[index] = 0;
+            spanHeads[index] = nullptr;
+            spanEnds[index] = nullptr;
         }
-        
-        UnixRegionProtect(region->start, newSize, region->reserved);
-        
-        region->committed = newSize;
     }
     
-    void RegionDealloc(MemoryRegion* region)
+    static inline b8 HeapIsSmall(const void* start)
     {
-        if (region->start == nullptr)
+        u8* base = AtomicLoad(&heapBase);
+        return base != nullptr && (u8*)start >= base && (u8*)start < base + TOOL_HEAP_RESERVE_SIZE;
+    }
+    
+    // Usable size of an allocated block
+    static u64 HeapBlockCapacity(void* start)
+    {
+        if (HeapIsSmall(start))
         {
-            return;
+            return HeapClassSize(heapSpanClasses[((u8*)start - heapBase) / TOOL_HEAP_SPAN_SIZE]);
         }
         
-        i32 result = munmap(region->start, region->reserved);
+        HeapLargeHeader* header = (HeapLargeHeader*)start - 1;
+        return header->mappingSize - header->mappingOffset;
+    }
+    
+    static void* HeapAllocLarge(u64 size, u64 alignment)
+    {
+        // The header sits at the end of a prefix that keeps the returned pointer aligned
+        u64 prefix = RoundToGranularity(sizeof(HeapLargeHeader), alignment);
         
-        if (result < 0)
-        {
-            ExceptErrno();
-        }
+        // Mappings are only page-aligned, so larger alignments are found within an over-sized mapping
+        u64 slack = alignment > TOOL_HEAP_LARGE_GRANULARITY ? alignment : 0;
         
-        region->start = nullptr;
-        region->reserved = 0;
-        region->committed = 0;
+        u64 mappingSize = RoundToGranularity(size + prefix + slack, TOOL_HEAP_LARGE_GRANULARITY);
+        u8* mapping = (u8*)HeapMapLarge(mappingSize);
+        u8* result = (u8*)RoundToGranularity((u64)(mapping + prefix), alignment);
+        
+        HeapLargeHeader* header = (HeapLargeHeader*)result - 1;
+        header->mappingSize = mappingSize;
+        header->mappingOffset = (u64)(result - mapping);
+        
+        TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordCommit(&heapStats, (i64)mappingSize, (i64)mappingSize));
+        TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordAlloc(&heapStats, mappingSize - header->mappingOffset));
+        
+        return result;
     }
     
-#endif
-    
-    //~ Memory region general functions
-    
-    void RegionReserve(MemoryRegion* region, u64 count, u64 size)
+    void* ClassicAlloc(u64 size)
     {
-        RegionReserve(region, count * size);
+        if (size <= TOOL_HEAP_MAX_SMALL_SIZE)
+        {
+            u32 index = HeapClassIndex(size);
+            TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordAlloc(&heapStats, HeapClassSize(index)));
+            
+            return HeapAllocSmall(index);
+        }
+        
+        return HeapAllocLarge(size, TOOL_DEFAULT_ALIGNMENT);
     }
     
-    void RegionCommit(MemoryRegion* region, u64 newCount, u64 size)
+    void* ClassicAllocAligned(u64 size, u64 alignment)
     {
-        RegionCommit(region, newCount * size);
+        if (alignment <= TOOL_DEFAULT_ALIGNMENT)
+        {
+            return ClassicAlloc(size);
+        }
+        
+        // Spans are page-aligned, so blocks of classes whose size is a multiple of the alignment are aligned
+        if (alignment <= TOOL_HEAP_LARGE_GRANULARITY && size <= TOOL_HEAP_MAX_SMALL_SIZE)
+        {
+            u32 index = HeapClassIndex(RoundToGranularity(TOOL_MAX(size, 1), alignment));
+            
+            while (index < TOOL_HEAP_CLASS_COUNT && HeapClassSize(index) % alignment != 0)
+            {
+                index++;
+            }
+            
+            if (index < TOOL_HEAP_CLASS_COUNT)
+            {
+                TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordAlloc(&heapStats, HeapClassSize(index)));
+                
+                return HeapAllocSmall(index);
+            }
+        }
+        
+        return HeapAllocLarge(size, alignment);
     }
     
-    void RegionRevert(MemoryRegion* region, u64 newCount, u64 size)
+    void ClassicDealloc(void* start)
     {
-        RegionRevert(region, newCount * size);
+        if (start == nullptr)
+        {
+            return;
+        }
+        
+        TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordDealloc(&heapStats, HeapBlockCapacity(start)));
+        
+        if (HeapIsSmall(start))
+        {
+            HeapFreeSmall(start, heapSpanClasses[((u8*)start - heapBase) / TOOL_HEAP_SPAN_SIZE]);
+            return;
+        }
+        
+        HeapLargeHeader* header = (HeapLargeHeader*)start - 1;
+        
+        TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordCommit(&heapStats, -(i64)header->mappingSize, -(i64)header->mappingSize));
+        
+        HeapUnmapLarge((u8*)start - header->mappingOffset, header->mappingSize);
     }
     
+    void ClassicRealloc(void** target, u64 currentSize, u64 newSize)
+    {
+        if (*target == nullptr)
+        {
+            *target = ClassicAlloc(newSize);
+            return;
+        }
+        
+        // The block might already have room to spare, as sizes are rounded up to their class or page
+        if (newSize <= HeapBlockCapacity(*target))
+        {
+            return;
+        }
+        
+        // Large blocks growing further are remapped, moving pages instead of copying their contents.
+        // Remapping keeps the offset within the page, and with it any alignment up to the page size.
+        HeapLargeHeader* header = (HeapLargeHeader*)*target - 1;
+        
+        if (!HeapIsSmall(*target) && header->mappingOffset < TOOL_HEAP_LARGE_GRANULARITY)
+        {
+            u64 mappingOffset = header->mappingOffset;
+            u64 previousMappingSize = header->mappingSize;
+            u64 mappingSize = RoundToGranularity(newSize + mappingOffset, TOOL_HEAP_LARGE_GRANULARITY);
+            
+            u8* remapped = (u8*)HeapRemapLarge((u8*)*target - mappingOffset, previousMappingSize, mappingSize);
+            
+            if (remapped != nullptr)
+            {
+                TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordCommit(&heapStats, (i64)(mappingSize - previousMappingSize), (i64)(mappingSize - previousMappingSize)));
+                TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordResize(&heapStats, previousMappingSize, mappingSize));
+                
+                header = (HeapLargeHeader*)(remapped + mappingOffset) - 1;
+                header->mappingSize = mappingSize;
+                *target = remapped + mappingOffset;
+                return;
+            }
+        }
+        
+        void* p = ClassicAlloc(newSize);
+        Copy(p, *target, TOOL_MIN(currentSize, newSize));
+        ClassicDealloc(*target);
+        *target = p;
+    }
     
+    void* ClassicAlloc(u64 count, u64 size)
+    {
+        return ClassicAlloc(count * size);
+    }
     
-    //- Memory loop
+    void ClassicRealloc(void** target, u64 currentCount, u64 newCount, u64 size)
+    {
+        ClassicRealloc(target, currentCount * size, newCount * size);
+    }
     
-    //~ Memory loop Windows implementation
     
-#ifdef TOOL_WINDOWS
     
-    //~ Definitions and function types for runtime loading
+    //- Memory region
     
-#ifndef MEM_PRESERVE_PLACEHOLDER
-    struct MEM_EXTENDED_PARAMETER;
-#define MEM_PRESERVE_PLACEHOLDER 0x2
-#define MEM_REPLACE_PLACEHOLDER 0x4000
-#define MEM_RESERVE_PLACEHOLDER 0x40000
-#define MemExtendedParameterAddressRequirements 0x1
-#endif
+    //~ Memory region Windows implementation
     
-    // Function type definitions mirroring those in memoryapi.h (on newer SDKs)
+    // Huge page flags are ignored on Windows, where large pages have to be committed at reservation time.
     
-    typedef PVOID (*VirtualAlloc2Function)(HANDLE Process,
-                                           PVOID BaseAddress,
-                                           SIZE_T Size,
-                                           ULONG AllocationType,
-                                           ULONG PageProtection,
-                                           MEM_EXTENDED_PARAMETER* ExtendedParameters,
-                                           ULONG ParameterCount);
+#ifdef TOOL_WINDOWS
     
-    typedef PVOID (*MapViewOfFile3Function)(HANDLE FileMapping,
-                                            HANDLE Process,
-                                            PVOID BaseAddress,
-                                            ULONG64 Offset,
-                                            SIZE_T ViewSize,
-                                            ULONG AllocationType,
-                                            ULONG PageProtection,
-                                            MEM_EXTENDED_PARAMETER* ExtendedParameters,
-                                            ULONG ParameterCount);
+    void RegionReserve(MemoryRegion* region, u64 size)
+    {
+        if (region->start != nullptr)
+        {
+            Except("Cannot reserve a Region which is already initialized."); 
+        }
+        
+        region->start = (void*)VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_READWRITE);
+        
+        if (region->start == nullptr)
+        {
+            ExceptWindowsLast();
+        }
+        
+        region->reserved = size;
+        region->committed = 0;
+    }
     
-    // Initializes/reserves uninitialized memory loop.
-    void LoopAlloc(MemoryLoop* loop, u64 minCommittedSize, u64 minMirroredSize)
+    void RegionCommit(MemoryRegion* region, u64 newSize)
     {
-        if (LoopIsInitialized(loop))
+        if (newSize > region->reserved)
         {
-		    Except("Cannot initialize a Memory Loop which is already initialized.");
+            Except("Cannot commit more memory to a Region than is reserved. (%llu > %llu)", newSize, region->reserved);
         }
         
-        SYSTEM_INFO systemInfo;
-        GetSystemInfo(&systemInfo);
+        if (newSize <= region->committed)
+        {
+            return;
+        }
         
-        u64 granularity = (u64)systemInfo.dwAllocationGranularity; // Most likely 64k
-        u64 committedSize = RoundToGranularity(minCommittedSize, granularity);
-        u64 mirroredSize = RoundToGranularity(minMirroredSize, granularity);
-        u64 totalSize = committedSize + mirroredSize;
+        u8* start = (u8*)region->start + region->committed;
+        u64 size = newSize - region->committed;
         
-        // This does not represent an actual file, but rather an anonymous memory allocation backed by the system paging file.
-        HANDLE fileMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, 0, 
-                                                PAGE_READWRITE, 
-                                                GetHighDWORD(committedSize), 
-                                                GetLowDWORD(committedSize),
-                                                nullptr);
+        void* result = VirtualAlloc(start, size, MEM_COMMIT, PAGE_READWRITE);
         
-        if (fileMapping == NULL || fileMapping == INVALID_HANDLE_VALUE)
+        if (result == nullptr)
         {
             ExceptWindowsLast();
         }
         
-        // Try to load the modern Windows runtime functions from the kernelbase system dll. Performance shouldn't be a big issue.
-        HMODULE kernel = LoadLibraryA("kernelbase.dll");
+        if (region->flags & RegionFlagsPrefault)
+        {
+            SYSTEM_INFO systemInfo;
+            GetSystemInfo(&systemInfo);
+            
+            TouchPages(start, size, (u64)systemInfo.dwPageSize);
+        }
         
-        if (kernel == NULL)
+        region->committed = newSize;
+    }
+    
+    void RegionRevert(MemoryRegion* region, u64 newSize)
+    {
+        if (newSize >= region->committed)
         {
-            ExceptWindowsLast();
+            return;
         }
         
-        VirtualAlloc2Function virtualAlloc2 = (VirtualAlloc2Function)(void*)GetProcAddress(kernel, "VirtualAlloc2");
-        MapViewOfFile3Function mapViewOfFile3 = (MapViewOfFile3Function)(void*)GetProcAddress(kernel, "MapViewOfFile3");
+        // Decommitting affects every page touched by the range, so the page holding the new boundary is kept
+        SYSTEM_INFO systemInfo;
+        GetSystemInfo(&systemInfo);
         
-        char* start = nullptr;
-        if (virtualAlloc2 && mapViewOfFile3) // If they exist, then use them
+        u64 from = RoundToGranularity(newSize, (u64)systemInfo.dwPageSize);
+        
+        if (from < region->committed)
         {
-            // First, reserve the whole range, both committed and mirrored, in the virtual address space
-            start = (char*)virtualAlloc2(0, 0,
-                                         totalSize,
-                                         MEM_RESERVE | MEM_RESERVE_PLACEHOLDER,	// Reserve the space, and designate it as a placeholder
-                                         PAGE_NOACCESS,							// The pages cannot be accessed in this state
-                                         0, 0);
+            b32 result = VirtualFree((u8*)region->start + from, region->committed - from, MEM_DECOMMIT); 
             
-            if (start == NULL)
+            if (!result)
             {
                 ExceptWindowsLast();
             }
+        }
+        
+        region->committed = newSize;
+    }
+    
+    void RegionDealloc(MemoryRegion* region)
+    {
+        if (region->start == nullptr)
+        {
+            return;
+        }
+        
+        b32 result = VirtualFree(region->start, 0, MEM_RELEASE); 
+        
+        if (!result)
+        {
+            ExceptWindowsLast();
+        }
+        
+        region->start = nullptr;
+        region->reserved = 0;
+        region->committed = 0;
+    }
+    
+#endif // TOOL_WINDOWS
+    
+    //~ Memory region Unix implementation
+    
+#ifdef TOOL_UNIX
+    
+    // On Unix, mmap does not actually allocate the memory. Physical pages will only be assigned when the memory is acted upon, such as by writing.
+    
+    // Reservation will mmap the entire region without access rights. Committing *unprotects* the pages between the old and the new boundary, and reverting protects them again.
+    
+    static u64 UnixHugePageSize()
+    {
+        static u64 hugePageSize = 0;
+        
+        if (hugePageSize == 0)
+        {
+            u64 size = 2 * 1024 * 1024; // Default on most architectures
             
-            // Then, remap the reserved range to the memory allocation in chunks.
-            u64 currentOffset = 0;
-            while (currentOffset < totalSize)
+            FILE* meminfo = fopen("/proc/meminfo", "r");
+            if (meminfo != nullptr)
             {
-                u64 currentChunkSize = min(totalSize - currentOffset, committedSize);
-                bool lastIteration = currentOffset + currentChunkSize >= totalSize;
-                
-                // First, split off a leading chunk of the original reservation, and preserve it as a placeholder.
-                // This prevents other user mode applications from theoretically consuming the addresses between this operation and the next, which is the advantage that the newer function versions provide.
-                if (!lastIteration)
+                c8 line[256];
+                while (fgets(line, sizeof(line), meminfo) != nullptr)
                 {
-                    bool freed = VirtualFree(start + currentOffset,
-                                             currentChunkSize,
-                                             MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER);
-                    
-                    if (!freed)
+                    u64 kilobytes = 0;
+                    if (sscanf(line, "Hugepagesize: %llu kB", &kilobytes) == 1)
                     {
-                        ExceptWindowsLast();
+                        size = kilobytes * 1024;
+                        break;
                     }
                 }
                 
-                // Then, map the freed address space range to the anonymous memory created earlier.
-                PVOID remapping = mapViewOfFile3(fileMapping, 0,
-                                                 start + currentOffset, 
-                                                 0,							// The offset into the file mapping is always 0
-                                                 currentChunkSize,
-                                                 MEM_REPLACE_PLACEHOLDER,	// Replace the placeholder with the new mapping
-                                                 PAGE_READWRITE,				// These pages can now be accessed as normal
-                                                 0, 0);
-                
-                if (remapping == NULL)
-                {
-                    ExceptWindowsLast();
-                }
-                
-                currentOffset += currentChunkSize;
+                fclose(meminfo);
             }
+            
+            hugePageSize = size;
         }
-        else // ... if not, we will have to use the older method
+        
+        return hugePageSize;
+    }
+    
+    // Granularity at which the protection of the region can change
+    static u64 UnixRegionGranularity(const MemoryRegion* region)
+    {
+        static u64 pageSize = (u64)getpagesize();
+        return (region->flags & RegionFlagsHugePagesExplicit) ? UnixHugePageSize() : pageSize;
+    }
+    
+    static void UnixRegionPrefault(void* start, u64 size, u64 granularity)
+    {
+#ifdef MADV_POPULATE_WRITE
+        if (madvise(start, size, MADV_POPULATE_WRITE) == 0)
         {
-            // This method is volatile, having a small chance of failure.
-            const int maxAttempts = 32;
+            return;
+        }
+        
+        // Failing to populate (such as with an exhausted huge page pool) is reported, while older kernels fall back to touching
+        if (errno != EINVAL)
+        {
+            ExceptErrno();
+        }
+#endif
+        
+        TouchPages(start, size, granularity);
+    }
+    
+    void RegionReserve(MemoryRegion* region, u64 size)
+    {
+        if (region->start != nullptr)
+        {
+            Except("Cannot reserve a Region which is already initialized."); 
+        }
+        
+        u64 granularity = UnixRegionGranularity(region);
+        size = RoundToGranularity(size, granularity);
+        
+        i32 mapFlags = MAP_PRIVATE | MAP_ANONYMOUS;
+        u64 alignment = 0;
+        
+        if (region->flags & RegionFlagsHugePagesExplicit)
+        {
+            // Huge pages are taken from the pool as they are touched, not for the whole reservation up front
+            mapFlags |= MAP_HUGETLB | MAP_NORESERVE;
+        }
+        else if (region->flags & RegionFlagsHugePages)
+        {
+            // Transparent huge pages can only back ranges aligned to the huge page size
+            alignment = UnixHugePageSize();
+        }
+        
+        // Initialize the memory with no access rights
+        u8* mapping = (u8*)mmap(nullptr, size + alignment, PROT_NONE, mapFlags, -1, 0);
+        
+        if (mapping == MAP_FAILED)
+        {
+            region->start = nullptr;
+            ExceptErrno();
+        }
+        
+        u8* start = mapping;
+        
+        if (alignment != 0)
+        {
+            // Trim the unaligned head and the remaining tail of the over-sized reservation
+            start = (u8*)RoundToGranularity((u64)mapping, alignment);
+            
+            if (start > mapping)
+            {
+                munmap(mapping, (u64)(start - mapping));
+            }
+            
+            munmap(start + size, (u64)(mapping + alignment - start));
+            
+            // Only a hint, which fails on kernels without transparent huge page support
+            madvise(start, size, MADV_HUGEPAGE);
+        }
+        
+        region->start = start;
+        region->reserved = size;
+        region->committed = 0;
+    }
+    
+    void RegionCommit(MemoryRegion* region, u64 newSize)
+    {
+        if (newSize > region->reserved)
+        {
+            Except("Cannot commit more memory to a Region than is reserved. (%llu > %llu)", newSize, region->reserved);
+        }
+        
+        if (newSize <= region->committed)
+        {
+            return;
+        }
+        
+        u64 granularity = UnixRegionGranularity(region);
+        u64 from = RoundToGranularity(region->committed, granularity);
+        u64 to = RoundToGranularity(newSize, granularity);
+        
+        if (to > from)
+        {
+            u8* start = (u8*)region->start + from;
+            
+            if (mprotect(start, to - from, PROT_READ | PROT_WRITE) < 0)
+            {
+                ExceptErrno();
+            }
+            
+            if (region->flags & RegionFlagsPrefault)
+            {
+                UnixRegionPrefault(start, to - from, granularity);
+            }
+        }
+        
+        region->committed = newSize;
+    }
+    
+    void RegionRevert(MemoryRegion* region, u64 newSize)
+    {
+        if (newSize >= region->committed)
+        {
+            return;
+        }
+        
+        u64 granularity = UnixRegionGranularity(region);
+        u64 from = RoundToGranularity(newSize, granularity);
+        u64 to = RoundToGranularity(region->committed, granularity);
+        
+        if (to > from)
+        {
+            u8* start = (u8*)region->start + from;
+            
+            // Protecting the pages alone would keep them resident, so they are handed back to the system first
+            i32 advice = (region->flags & RegionFlagsLazyFree) ? MADV_FREE : MADV_DONTNEED;
+            i32 result = madvise(start, to - from, advice);
+            
+            if (result < 0 && errno == EINVAL && advice != MADV_DONTNEED)
+            {
+                // Kernels without MADV_FREE
+                result = madvise(start, to - from, MADV_DONTNEED);
+            }
+            
+            // Explicit huge pages cannot be discarded by older kernels, but are still protected
+            if (result < 0 && errno != EINVAL)
+            {
+                ExceptErrno();
+            }
+            
+            if (mprotect(start, to - from, PROT_NONE) < 0)
+            {
+                ExceptErrno();
+            }
+        }
+        
+        region->committed = newSize;
+    }
+    
+    void RegionDealloc(MemoryRegion* region)
+    {
+        if (region->start == nullptr)
+        {
+            return;
+        }
+        
+        i32 result = munmap(region->start, region->reserved);
+        
+        if (result < 0)
+        {
+            ExceptErrno();
+        }
+        
+        region->start = nullptr;
+        region->reserved = 0;
+        region->committed = 0;
+    }
+    
+#endif
+    
+    //~ Memory region general functions
+    
+    void RegionReserve(MemoryRegion* region, u64 count, u64 size)
+    {
+        RegionReserve(region, count * size);
+    }
+    
+    void RegionCommit(MemoryRegion* region, u64 newCount, u64 size)
+    {
+        RegionCommit(region, newCount * size);
+    }
+    
+    void RegionRevert(MemoryRegion* region, u64 newCount, u64 size)
+    {
+        RegionRevert(region, newCount * size);
+    }
+    
+    
+    
+    //- Memory loop
+    
+    //~ Memory loop Windows implementation
+    
+#ifdef TOOL_WINDOWS
+    
+    //~ Definitions and function types for runtime loading
+    
+#ifndef MEM_PRESERVE_PLACEHOLDER
+    struct MEM_EXTENDED_PARAMETER;
+#define MEM_PRESERVE_PLACEHOLDER 0x2
+#define MEM_REPLACE_PLACEHOLDER 0x4000
+#define MEM_RESERVE_PLACEHOLDER 0x40000
+#define MemExtendedParameterAddressRequirements 0x1
+#endif
+    
+    // Function type definitions mirroring those in memoryapi.h (on newer SDKs)
+    
+    typedef PVOID (*VirtualAlloc2Function)(HANDLE Process,
+                                           PVOID BaseAddress,
+                                           SIZE_T Size,
+                                           ULONG AllocationType,
+                                           ULONG PageProtection,
+                                           MEM_EXTENDED_PARAMETER* ExtendedParameters,
+                                           ULONG ParameterCount);
+    
+    typedef PVOID (*MapViewOfFile3Function)(HANDLE FileMapping,
+                                            HANDLE Process,
+                                            PVOID BaseAddress,
+                                            ULONG64 Offset,
+                                            SIZE_T ViewSize,
+                                            ULONG AllocationType,
+                                            ULONG PageProtection,
+                                            MEM_EXTENDED_PARAMETER* ExtendedParameters,
+                                            ULONG ParameterCount);
+    
+    // Initializes/reserves uninitialized memory loop.
+    void LoopAlloc(MemoryLoop* loop, u64 minCommittedSize, u64 minMirroredSize)
+    {
+        if (LoopIsInitialized(loop))
+        {
+		    Except("Cannot initialize a Memory Loop which is already initialized.");
+        }
+        
+        SYSTEM_INFO systemInfo;
+        GetSystemInfo(&systemInfo);
+        
+        u64 granularity = (u64)systemInfo.dwAllocationGranularity; // Most likely 64k
+        u64 committedSize = RoundToGranularity(minCommittedSize, granularity);
+        u64 mirroredSize = RoundToGranularity(minMirroredSize, granularity);
+        u64 totalSize = committedSize + mirroredSize;
+        
+        // This does not represent an actual file, but rather an anonymous memory allocation backed by the system paging file.
+        HANDLE fileMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, 0, 
+                                                PAGE_READWRITE, 
+                                                GetHighDWORD(committedSize), 
+                                                GetLowDWORD(committedSize),
+                                                nullptr);
+        
+        if (fileMapping == NULL || fileMapping == INVALID_HANDLE_VALUE)
+        {
+            ExceptWindowsLast();
+        }
+        
+        // Try to load the modern Windows runtime functions from the kernelbase system dll. Performance shouldn't be a big issue.
+        HMODULE kernel = LoadLibraryA("kernelbase.dll");
+        
+        if (kernel == NULL)
+        {
+            ExceptWindowsLast();
+        }
+        
+        VirtualAlloc2Function virtualAlloc2 = (VirtualAlloc2Function)(void*)GetProcAddress(kernel, "VirtualAlloc2");
+        MapViewOfFile3Function mapViewOfFile3 = (MapViewOfFile3Function)(void*)GetProcAddress(kernel, "MapViewOfFile3");
+        
+        char* start = nullptr;
+        if (virtualAlloc2 && mapViewOfFile3) // If they exist, then use them
+        {
+            // First, reserve the whole range, both committed and mirrored, in the virtual address space
+            start = (char*)virtualAlloc2(0, 0,
+                                         totalSize,
+                                         MEM_RESERVE | MEM_RESERVE_PLACEHOLDER,	// Reserve the space, and designate it as a placeholder
+                                         PAGE_NOACCESS,							// The pages cannot be accessed in this state
+                                         0, 0);
+            
+            if (start == NULL)
+            {
+                ExceptWindowsLast();
+            }
+            
+            // Then, remap the reserved range to the memory allocation in chunks.
+            u64 currentOffset = 0;
+            while (currentOffset < totalSize)
+            {
+                u64 currentChunkSize = min(totalSize - currentOffset, committedSize);
+                bool lastIteration = currentOffset + currentChunkSize >= totalSize;
+                
+                // First, split off a leading chunk of the original reservation, and preserve it as a placeholder.
+                // This prevents other user mode applications from theoretically consuming the addresses between this operation and the next, which is the advantage that the newer function versions provide.
+                if (!lastIteration)
+                {
+                    bool freed = VirtualFree(start + currentOffset,
+                                             currentChunkSize,
+                                             MEM_RELEASE | MEM_PRESERVE_PLACEHOLDER);
+                    
+                    if (!freed)
+                    {
+                        ExceptWindowsLast();
+                    }
+                }
+                
+                // Then, map the freed address space range to the anonymous memory created earlier.
+                PVOID remapping = mapViewOfFile3(fileMapping, 0,
+                                                 start + currentOffset, 
+                                                 0,							// The offset into the file mapping is always 0
+                                                 currentChunkSize,
+                                                 MEM_REPLACE_PLACEHOLDER,	// Replace the placeholder with the new mapping
+                                                 PAGE_READWRITE,				// These pages can now be accessed as normal
+                                                 0, 0);
+                
+                if (remapping == NULL)
+                {
+                    ExceptWindowsLast();
+                }
+                
+                currentOffset += currentChunkSize;
+            }
+        }
+        else // ... if not, we will have to use the older method
+        {
+            // This method is volatile, having a small chance of failure.
+            const int maxAttempts = 32;
             
             bool success = false;
             
@@ -500,16 +1275,147 @@ namespace Tool
                 }
             }
             
-            if (!success)
+            if (!success)
+            {
+                Except("Could not allocate Memory Loop using legacy method, maximum number of failed attempts reached. "
+                       "Consider upgrading to a newer Windows runtime. (%i attempts)",
+                       maxAttempts);
+            }
+        }
+        
+        // Set the members
+        loop->memory = (AnonymousMemory)fileMapping;
+        loop->start = (void*)start;
+        loop->committed = committedSize;
+        loop->mirrored = mirroredSize;
+    }
+    
+    // Deallocates region, returning it to an uninitialized state.
+    void LoopDealloc(MemoryLoop* loop)
+    {
+        if (!LoopIsInitialized(loop))
+            return;
+        
+        char* start = (char*)loop->start;
+        u64 totalSize = loop->committed + loop->mirrored;
+        u64 currentOffset = 0;
+        while (currentOffset < totalSize)
+        {
+            u64 currentChunkSize = min(totalSize - currentOffset, loop->committed);
+            
+            // Unmap each mapped section of virtual address space
+            UnmapViewOfFile(start + currentChunkSize);
+            
+            currentOffset += currentChunkSize;
+        }
+        
+        // Close the file mapping, releasing the anonymous memory
+        CloseHandle((HANDLE)loop->memory);
+        
+        loop->memory = nullptr;
+        loop->start = nullptr;
+        loop->committed = 0;
+        loop->mirrored = 0;
+    }
+    
+#endif
+    
+    //~ Memory loop Unix implementation
+    
+#ifdef TOOL_UNIX
+    
+    // Round a given size up to the nearest multiple of the page size, which itself is a power of 2
+    static u64 UnixRoundToPage(u64 size)
+    {
+        static u64 pageSize = (u64)getpagesize();
+        return (size + pageSize - 1) & ~(pageSize - 1);
+    }
+    
+    // Creates a file descriptor referring to anonymous memory, without any name in the file system.
+    static i32 UnixAnonymousMemoryCreate(u64 size)
+    {
+#ifdef TOOL_LINUX
+        i32 descriptor = memfd_create("TOOL Memory Loop", MFD_CLOEXEC);
+#else
+        // Without memfd, create a uniquely named shared memory object and immediately unlink the name.
+        c8 name[64];
+        snprintf(name, sizeof(name), "/TOOL-loop-%i-%p", (i32)getpid(), (void*)&name);
+        
+        i32 descriptor = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        
+        if (descriptor >= 0)
+        {
+            shm_unlink(name);
+        }
+#endif
+        
+        if (descriptor < 0)
+        {
+            ExceptErrno();
+        }
+        
+        if (ftruncate(descriptor, (off_t)size) < 0)
+        {
+            i32 error = errno;
+            close(descriptor);
+            ExceptUnix(error);
+        }
+        
+        return descriptor;
+    }
+    
+    // Initializes/reserves uninitialized region.
+    void LoopAlloc(MemoryLoop* loop, u64 minCommittedSize, u64 minMirroredSize)
+    {
+        if (LoopIsInitialized(loop))
+        {
+            Except("Cannot initialize a Memory Loop which is already initialized.");
+        }
+        
+        u64 committedSize = UnixRoundToPage(TOOL_MAX(minCommittedSize, 1));
+        u64 mirroredSize = UnixRoundToPage(minMirroredSize);
+        u64 totalSize = committedSize + mirroredSize;
+        
+        // The anonymous memory is backed by a memfd (or unlinked shared memory object), not by any actual file.
+        i32 descriptor = UnixAnonymousMemoryCreate(committedSize);
+        
+        // First, reserve the whole range, both committed and mirrored, in the virtual address space.
+        // The reservation guarantees that no other mapping can claim addresses between the views.
+        char* start = (char*)mmap(nullptr, totalSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        
+        if (start == MAP_FAILED)
+        {
+            i32 error = errno;
+            close(descriptor);
+            ExceptUnix(error);
+        }
+        
+        // Then, replace the reservation with views of the anonymous memory in chunks, atomically thanks to MAP_FIXED.
+        u64 currentOffset = 0;
+        while (currentOffset < totalSize)
+        {
+            u64 currentChunkSize = TOOL_MIN(totalSize - currentOffset, committedSize);
+            
+            void* remapping = mmap(start + currentOffset, 
+                                   currentChunkSize,
+                                   PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_FIXED,
+                                   descriptor,
+                                   0);                      // The offset into the anonymous memory is always 0
+            
+            if (remapping == MAP_FAILED)
             {
-                Except("Could not allocate Memory Loop using legacy method, maximum number of failed attempts reached. "
-                       "Consider upgrading to a newer Windows runtime. (%i attempts)",
-                       maxAttempts);
+                i32 error = errno;
+                munmap(start, totalSize);
+                close(descriptor);
+                ExceptUnix(error);
             }
+            
+            currentOffset += currentChunkSize;
         }
         
         // Set the members
-        loop->memory = (AnonymousMemory)fileMapping;
+        loop->memory = (AnonymousMemory)(i64)descriptor;
         loop->start = (void*)start;
         loop->committed = committedSize;
         loop->mirrored = mirroredSize;
@@ -521,143 +1427,637 @@ namespace Tool
         if (!LoopIsInitialized(loop))
             return;
         
-        char* start = (char*)loop->start;
-        u64 totalSize = loop->committed + loop->mirrored;
-        u64 currentOffset = 0;
-        while (currentOffset < totalSize)
+        // A single unmapping covers every view, since they were placed in one continuous reservation.
+        i32 result = munmap(loop->start, loop->committed + loop->mirrored);
+        
+        // Close the descriptor, releasing the anonymous memory
+        result |= close((i32)(i64)loop->memory);
+        
+        loop->memory = nullptr;
+        loop->start = nullptr;
+        loop->committed = 0;
+        loop->mirrored = 0;
+        
+        if (result < 0)
         {
-            u64 currentChunkSize = min(totalSize - currentOffset, loop->committed);
+            ExceptErrno();
+        }
+    }
+    
+#endif
+    
+    //~ Memory loop general implementation
+    
+    bool LoopIsInitialized(const MemoryLoop* loop)
+    {
+        return loop->start != nullptr;
+    }
+    
+    
+    
+    //- Arena
+    
+    //~ Arena general implementation
+    
+    // Grows the committed range of the region to fit 'newSize', in increasingly large steps
+    static void ArenaGrowCommitted(MemoryRegion* region, u64 newSize)
+    {
+        u64 newCommittedSize = region->committed;
+        while (newSize > newCommittedSize)
+        {
+            newCommittedSize += TOOL_MIN(TOOL_MAX(newCommittedSize, TOOL_ARENA_COMMIT_SIZE), TOOL_ARENA_MAX_INCREMENT_SIZE);
+        }
+        
+        RegionCommit(region, TOOL_MIN(newCommittedSize, region->reserved));
+    }
+    
+    // Concurrent arenas only bump the total size, so the frame size is derived from it when needed
+    static inline void ArenaSynchronize(Arena* arena)
+    {
+        if (arena->flags & ArenaFlagsConcurrent)
+        {
+            arena->sizeCurrent = arena->size - (u64)((u8*)arena->startCurrent - (u8*)arena->region.start);
+        }
+    }
+    
+    // Slow path of concurrent allocations, taken when the claimed range extends beyond the committed range
+    static void ArenaCommitConcurrent(Arena* arena, u64 newSize)
+    {
+        SpinLockAcquire(&arena->commitLock);
+        TOOL_DEFER(SpinLockRelease(&arena->commitLock));
+        
+        if (newSize > arena->region.reserved)
+        {
+            Except("Cannot allocate more memory than is reserved in the Arena. (%llu > %llu)",
+                   newSize, arena->region.reserved);
+        }
+        
+        // Another thread might have grown the range while this one was waiting
+        if (newSize <= arena->region.committed)
+        {
+            return;
+        }
+        
+        // Commit through a copy, so that the committed size is only published once the pages are accessible
+        MemoryRegion region = arena->region;
+        ArenaGrowCommitted(&region, newSize);
+        AtomicStore(&arena->region.committed, region.committed);
+        
+        TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordRegion(arena->stats, &region));
+    }
+    
+    static inline void ArenaCheckReserved(Arena* arena, u64 newSize)
+    {
+        if (newSize > arena->region.reserved)
+        {
+            Except("Cannot allocate more memory than is reserved in the Arena. (%llu > %llu)",
+                   newSize, arena->region.reserved);
+        }
+    }
+    
+    static inline void* ArenaAllocConcurrent(Arena* arena, u64 size, u64 alignment)
+    {
+        // Padded for the head each attempt sees, like the single-threaded path, since the region start is page-aligned.
+        // Checked before the size is published, as a size past the reservation would fail every later allocation.
+        u64 offset = AtomicLoadRelaxed(&arena->size);
+        u64 padding;
+        do
+        {
+            padding = RoundToGranularity(offset, alignment) - offset;
+            ArenaCheckReserved(arena, offset + padding + size);
+        }
+        while (!AtomicCompareExchange(&arena->size, &offset, offset + padding + size));
+        
+        u64 end = offset + padding + size;
+        if (end > AtomicLoad(&arena->region.committed))
+        {
+            ArenaCommitConcurrent(arena, end);
+        }
+        
+        TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordAlloc(arena->stats, padding + size));
+        
+        return (u8*)arena->region.start + offset + padding;
+    }
+    
+    void ArenaInit(Arena* arena, u64 reservedSize, i32 flags)
+    {
+        arena->region.flags = 
+            RegionFlagsHugePages * ((flags & ArenaFlagsHugePages) != 0) |
+            RegionFlagsHugePagesExplicit * ((flags & ArenaFlagsHugePagesExplicit) != 0) |
+            RegionFlagsPrefault * ((flags & ArenaFlagsPrefault) != 0) |
+            RegionFlagsLazyFree * ((flags & ArenaFlagsLazyFree) != 0);
+        
+        RegionReserve(&arena->region, reservedSize);
+        RegionCommit(&arena->region, TOOL_MIN(TOOL_ARENA_COMMIT_SIZE, reservedSize));
+        arena->size = 0;
+        
+        arena->startCurrent = arena->region.start;
+        arena->sizeCurrent = 0;
+        
+        arena->flags = flags;
+        arena->commitLock = 0;
+        
+        TOOL_MEMORY_STATS_RECORD(arena->stats = MemoryStatsCreate("Arena", arena->region.reserved, arena->region.committed));
+    }
+    
+    void ArenaCommit(Arena* arena, u64 size)
+    {
+        if (arena->flags & ArenaFlagsConcurrent)
+        {
+            ArenaCommitConcurrent(arena, size);
+        }
+        else
+        {
+            RegionCommit(&arena->region, size);
+            TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordRegion(arena->stats, &arena->region));
+        }
+    }
+    
+    void* ArenaAllocBegin(Arena* arena, u64 reservedSize)
+    {
+        if (arena->flags & ArenaFlagsConcurrent)
+        {
+            Except("Cannot allocate in two steps from a concurrent Arena.");
+        }
+        
+        u64 newSize = arena->size + reservedSize;
+        
+        if (newSize > arena->region.committed)
+        {
+            if (newSize > arena->region.reserved)
+            {
+                Except("Cannot allocate more memory than is reserved in the Arena. (%llu + %llu > %llu)",
+                       arena->size, reservedSize, arena->region.reserved);
+            }
             
-            // Unmap each mapped section of virtual address space
-            UnmapViewOfFile(start + currentChunkSize);
+            ArenaGrowCommitted(&arena->region, newSize);
+            TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordRegion(arena->stats, &arena->region));
+        }
+        
+        void* result = (u8*)arena->startCurrent + arena->sizeCurrent;
+        
+        return result;
+    }
+    
+    void* ArenaAllocEnd(Arena* arena, u64 actualSize)
+    {
+        void* head = (u8*)arena->startCurrent + arena->sizeCurrent;
+        
+        arena->sizeCurrent += actualSize;
+        arena->size += actualSize;
+        
+        TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordAlloc(arena->stats, actualSize));
+        
+        return head;
+    }
+    
+    void* ArenaAlloc(Arena* arena, u64 size)
+    {
+        if (arena->flags & ArenaFlagsConcurrent)
+        {
+            return ArenaAllocConcurrent(arena, size, 1);
+        }
+        
+        ArenaAllocBegin(arena, size);
+        return ArenaAllocEnd(arena, size);
+    }
+    
+    void* ArenaAllocAligned(Arena* arena, u64 size, u64 alignment)
+    {
+        if (arena->flags & ArenaFlagsConcurrent)
+        {
+            return ArenaAllocConcurrent(arena, size, alignment);
+        }
+        
+        // The region start is page-aligned, so aligning the offset aligns the address
+        u64 head = (u64)((u8*)arena->startCurrent - (u8*)arena->region.start) + arena->sizeCurrent;
+        u64 padding = RoundToGranularity(head, alignment) - head;
+        
+        ArenaAllocBegin(arena, padding + size);
+        return (u8*)ArenaAllocEnd(arena, padding + size) + padding;
+    }
+    
+    void ArenaRealloc(Arena* arena, void** target, u64 currentSize, u64 newSize)
+    {
+        if (*target == nullptr)
+        {
+            *target = ArenaAlloc(arena, newSize);
+            return;
+        }
+        
+        u8* start = (u8*)*target;
+        u64 offset = (u64)(start - (u8*)arena->region.start);
+        
+        if (arena->flags & ArenaFlagsConcurrent)
+        {
+            // The top allocation can only be resized if no other thread has allocated after it in the meantime
+            u64 expected = offset + currentSize;
             
-            currentOffset += currentChunkSize;
+            // Sizes past the reservation are never published, and fail below in ArenaAlloc instead
+            if (start >= (u8*)arena->startCurrent && offset + newSize <= arena->region.reserved &&
+                AtomicCompareExchange(&arena->size, &expected, offset + newSize))
+            {
+                if (offset + newSize > AtomicLoad(&arena->region.committed))
+                {
+                    ArenaCommitConcurrent(arena, offset + newSize);
+                }
+                
+                TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordResize(arena->stats, currentSize, newSize));
+                
+                return;
+            }
+        }
+        else if (start >= (u8*)arena->startCurrent && offset + currentSize == arena->size)
+        {
+            // The top allocation is resized in place, by moving the head
+            u64 newTotalSize = offset + newSize;
+            
+            if (newTotalSize > arena->region.committed)
+            {
+                if (newTotalSize > arena->region.reserved)
+                {
+                    Except("Cannot allocate more memory than is reserved in the Arena. (%llu > %llu)",
+                           newTotalSize, arena->region.reserved);
+                }
+                
+                ArenaGrowCommitted(&arena->region, newTotalSize);
+                TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordRegion(arena->stats, &arena->region));
+            }
+            
+            arena->sizeCurrent = arena->sizeCurrent - currentSize + newSize;
+            arena->size = newTotalSize;
+            
+            TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordResize(arena->stats, currentSize, newSize));
+            
+            return;
+        }
+        
+        if (newSize <= currentSize)
+        {
+            return;
+        }
+        
+        void* p = ArenaAlloc(arena, newSize);
+        Copy(p, *target, currentSize);
+        *target = p;
+    }
+    
+    void ArenaRealloc(Arena* arena, void** target, u64 currentCount, u64 newCount, u64 size)
+    {
+        ArenaRealloc(arena, target, currentCount * size, newCount * size);
+    }
+    
+    void ArenaPush(Arena* arena)
+    {
+        ArenaSynchronize(arena);
+        
+        ArenaFrame frame = { arena->startCurrent, arena->sizeCurrent };
+        
+        arena->startCurrent = (u8*)arena->startCurrent + arena->sizeCurrent;
+        arena->sizeCurrent = 0;
+        
+        ArenaFrame* destination = (ArenaFrame*)ArenaAlloc(arena, sizeof(ArenaFrame));
+        *destination = frame;
+    }
+    
+    void ArenaPop(Arena* arena)
+    {
+        ArenaSynchronize(arena);
+        
+        ArenaFrame* frame = (ArenaFrame*)arena->startCurrent;
+        
+        TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordResize(arena->stats, arena->size, arena->size - arena->sizeCurrent));
+        
+        arena->size -= arena->sizeCurrent;
+        arena->startCurrent = frame->start;
+        arena->sizeCurrent = frame->size;
+        
+        u64 committed = arena->region.committed;
+        if (!(arena->flags & ArenaFlagsNoTrim) && committed > TOOL_ARENA_TRIM_MINIMUM && arena->size < committed / 4)
+        {
+            RegionRevert(&arena->region, TOOL_MAX(arena->size * 2, TOOL_ARENA_TRIM_MINIMUM));
+            TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordRegion(arena->stats, &arena->region));
         }
+    }
+    
+    void ArenaTrim(Arena* arena)
+    {
+        ArenaSynchronize(arena);
+        RegionRevert(&arena->region, TOOL_MAX(arena->size, TOOL_ARENA_COMMIT_SIZE));
+        TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordRegion(arena->stats, &arena->region));
+    }
+    
+    void ArenaDeInit(Arena* arena)
+    {
+        RegionDealloc(&arena->region);
         
-        // Close the file mapping, releasing the anonymous memory
-        CloseHandle((HANDLE)loop->memory);
+        TOOL_MEMORY_STATS_RECORD(MemoryStatsDestroy(arena->stats));
+        TOOL_MEMORY_STATS_RECORD(arena->stats = nullptr);
         
-        loop->memory = nullptr;
-        loop->start = nullptr;
-        loop->committed = 0;
-        loop->mirrored = 0;
+        arena->size = 0;
+        arena->startCurrent = nullptr;
+        arena->sizeCurrent = 0;
+        arena->flags = 0;
     }
     
-#endif
+    void* ArenaAlloc(Arena* arena, u64 count, u64 size)
+    {
+        return ArenaAlloc(arena, count * size);
+    }
     
-    //~ Memory loop Unix implementation
     
-#ifdef TOOL_UNIX
     
-    // Initializes/reserves uninitialized region.
-    void LoopAlloc(MemoryLoop* loop, u64 minCommittedSize, u64 minMirroredSize)
+    //- Scratch arena
+    
+    //~ Scratch arena general implementation
+    
+    struct ScratchArenas
     {
-    }
+        Arena arenas[TOOL_SCRATCH_COUNT];
+        
+        ~ScratchArenas();
+    };
     
-    // Deallocates region, returning it to an uninitialized state.
-    void LoopDealloc(MemoryLoop* loop)
+    static thread_local ScratchArenas scratchArenas = {};
+    
+    ScratchArenas::~ScratchArenas()
     {
+        for (i32 i = 0; i < TOOL_SCRATCH_COUNT; i++)
+        {
+            ArenaDeInit(&arenas[i]);
+        }
     }
     
-#endif
-    
-    //~ Memory loop general implementation
+    Arena* ArenaScratchBegin(Arena* const* conflicts, i32 conflictCount)
+    {
+        for (i32 i = 0; i < TOOL_SCRATCH_COUNT; i++)
+        {
+            Arena* scratch = &scratchArenas.arenas[i];
+            
+            b8 conflicting = false;
+            for (i32 j = 0; j < conflictCount; j++)
+            {
+                conflicting |= conflicts[j] == scratch;
+            }
+            
+            if (conflicting)
+            {
+                continue;
+            }
+            
+            if (scratch->region.start == nullptr)
+            {
+                ArenaInit(scratch, TOOL_SCRATCH_RESERVE_SIZE);
+                MemoryStatsName(scratch, "Scratch");
+            }
+            
+            ArenaPush(scratch);
+            return scratch;
+        }
+        
+        Except("Cannot begin scratch arena, every scratch arena is conflicting. (%i conflicts)", conflictCount);
+        return nullptr;
+    }
     
-    bool LoopIsInitialized(const MemoryLoop* loop)
+    void ArenaScratchEnd(Arena* scratch)
     {
-        return loop->start != nullptr;
+        ArenaPop(scratch);
     }
     
     
     
-    //- Arena
+    //- Pool
     
-    //~ Arena general implementation
+    //~ Pool general implementation
     
-    void ArenaInit(Arena* arena, u64 reservedSize)
+    void PoolInit(Pool* pool, u64 slotSize, u64 reservedCount, i32 flags)
     {
-        RegionReserve(&arena->region, reservedSize);
-        RegionCommit(&arena->region, TOOL_ARENA_COMMIT_SIZE);
-        arena->size = 0;
+        pool->slotSize = (TOOL_MAX(slotSize, sizeof(void*)) + 15) & ~15ull;
+        pool->slotCount = 0;
+        pool->freeList = nullptr;
+        pool->flags = flags;
+        pool->lock = 0;
         
-        arena->startCurrent = arena->region.start;
-        arena->sizeCurrent = 0;
+        RegionReserve(&pool->region, reservedCount, pool->slotSize);
+        
+        TOOL_MEMORY_STATS_RECORD(pool->stats = MemoryStatsCreate("Pool", pool->region.reserved, pool->region.committed));
     }
     
-    void* ArenaAllocBegin(Arena* arena, u64 reservedSize)
+    // Detaches a chain of up to 'maxCount' free slots, carving new ones from the region when the free list runs out
+    static void* PoolTake(Pool* pool, u32 maxCount, u32* outCount)
     {
-        u64 newSize = arena->size + reservedSize;
+        void* first = nullptr;
+        u32 count = 0;
         
-        if (newSize > arena->region.committed)
+        while (count < maxCount && pool->freeList != nullptr)
         {
-            if (newSize > arena->region.reserved)
+            void* slot = pool->freeList;
+            pool->freeList = *(void**)slot;
+            *(void**)slot = first;
+            first = slot;
+            count++;
+        }
+        
+        if (count < maxCount)
+        {
+            u64 available = pool->region.reserved / pool->slotSize - pool->slotCount;
+            u64 carved = TOOL_MIN(maxCount - count, available);
+            
+            if (carved == 0 && count == 0)
             {
-                Except("Cannot allocate more memory than is reserved in the Arena. (%ull + %ull > %ull)",
-                       arena->size, reservedSize, arena->region.reserved);
+                Except("Cannot allocate more slots than are reserved in the Pool. (%llu slots)", pool->slotCount);
+            }
+            
+            u64 newSize = (pool->slotCount + carved) * pool->slotSize;
+            if (newSize > pool->region.committed)
+            {
+                ArenaGrowCommitted(&pool->region, newSize);
+                TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordRegion(pool->stats, &pool->region));
             }
             
-            u64 newCommittedSize = arena->region.committed;
-            while (newSize > newCommittedSize)
+            for (u64 i = 0; i < carved; i++)
             {
-                newCommittedSize += TOOL_MIN(newCommittedSize, TOOL_ARENA_MAX_INCREMENT_SIZE);
+                void* slot = (u8*)pool->region.start + pool->slotCount * pool->slotSize;
+                *(void**)slot = first;
+                first = slot;
+                pool->slotCount++;
             }
             
-            RegionCommit(&arena->region, newCommittedSize);
+            count += (u32)carved;
         }
         
-        void* result = (u8*)arena->startCurrent + arena->sizeCurrent;
+        *outCount = count;
+        return first;
+    }
+    
+    void* PoolAlloc(Pool* pool)
+    {
+        b8 concurrent = pool->flags & PoolFlagsConcurrent;
         
-        return result;
+        if (concurrent)
+        {
+            SpinLockAcquire(&pool->lock);
+        }
+        
+        TOOL_DEFER(if (concurrent) SpinLockRelease(&pool->lock));
+        
+        TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordAlloc(pool->stats, pool->slotSize));
+        
+        void* slot = pool->freeList;
+        
+        if (slot != nullptr)
+        {
+            pool->freeList = *(void**)slot;
+            return slot;
+        }
+        
+        u32 count = 0;
+        return PoolTake(pool, 1, &count);
     }
     
-    void* ArenaAllocEnd(Arena* arena, u64 actualSize)
+    void PoolDealloc(Pool* pool, void* slot)
     {
-        void* head = (u8*)arena->startCurrent + arena->sizeCurrent;
+        if (slot == nullptr)
+        {
+            return;
+        }
         
-        arena->sizeCurrent += actualSize;
-        arena->size += actualSize;
+        b8 concurrent = pool->flags & PoolFlagsConcurrent;
         
-        return head;
+        TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordDealloc(pool->stats, pool->slotSize));
+        
+        if (concurrent)
+        {
+            SpinLockAcquire(&pool->lock);
+        }
+        
+        *(void**)slot = pool->freeList;
+        pool->freeList = slot;
+        
+        if (concurrent)
+        {
+            SpinLockRelease(&pool->lock);
+        }
     }
     
-    void* ArenaAlloc(Arena* arena, u64 size)
+    void PoolDeInit(Pool* pool)
     {
-        ArenaAllocBegin(arena, size);
-        return ArenaAllocEnd(arena, size);
+        RegionDealloc(&pool->region);
+        
+        TOOL_MEMORY_STATS_RECORD(MemoryStatsDestroy(pool->stats));
+        TOOL_MEMORY_STATS_RECORD(pool->stats = nullptr);
+        
+        pool->slotCount = 0;
+        pool->freeList = nullptr;
     }
     
-    void ArenaPush(Arena* arena)
+    //~ Pool cache general implementation
+    
+    // Pushes a linked chain of slots back onto the pool
+    static void PoolGive(Pool* pool, void* first, void* last)
     {
-        ArenaFrame frame = { arena->startCurrent, arena->sizeCurrent };
+        b8 concurrent = pool->flags & PoolFlagsConcurrent;
         
-        arena->startCurrent = (u8*)arena->startCurrent + arena->sizeCurrent;
-        arena->sizeCurrent = 0;
+        if (concurrent)
+        {
+            SpinLockAcquire(&pool->lock);
+        }
         
-        ArenaFrame* destination = (ArenaFrame*)ArenaAlloc(arena, sizeof(ArenaFrame));
-        *destination = frame;
+        *(void**)last = pool->freeList;
+        pool->freeList = first;
+        
+        if (concurrent)
+        {
+            SpinLockRelease(&pool->lock);
+        }
     }
     
-    void ArenaPop(Arena* arena)
+    void PoolCacheInit(PoolCache* cache, Pool* pool)
     {
-        ArenaFrame* frame = (ArenaFrame*)arena->startCurrent;
+        cache->pool = pool;
+        cache->freeList = nullptr;
+        cache->count = 0;
+    }
+    
+    void* PoolCacheAlloc(PoolCache* cache)
+    {
+        void* slot = cache->freeList;
         
-        arena->size -= arena->sizeCurrent;
-        arena->startCurrent = frame->start;
-        arena->sizeCurrent = frame->size;
+        if (slot == nullptr)
+        {
+            Pool* pool = cache->pool;
+            b8 concurrent = pool->flags & PoolFlagsConcurrent;
+            
+            if (concurrent)
+            {
+                SpinLockAcquire(&pool->lock);
+            }
+            
+            TOOL_DEFER(if (concurrent) SpinLockRelease(&pool->lock));
+            
+            u32 count = 0;
+            slot = PoolTake(pool, TOOL_POOL_CACHE_SIZE, &count);
+            cache->count = count;
+        }
+        
+        cache->freeList = *(void**)slot;
+        cache->count--;
+        
+        TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordAlloc(cache->pool->stats, cache->pool->slotSize));
+        
+        return slot;
     }
     
-    void ArenaDeInit(Arena* arena)
+    void PoolCacheDealloc(PoolCache* cache, void* slot)
     {
-        RegionDealloc(&arena->region);
+        if (slot == nullptr)
+        {
+            return;
+        }
         
-        arena->size = 0;
-        arena->startCurrent = nullptr;
-        arena->sizeCurrent = 0;
+        TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordDealloc(cache->pool->stats, cache->pool->slotSize));
+        
+        *(void**)slot = cache->freeList;
+        cache->freeList = slot;
+        cache->count++;
+        
+        // Return a batch to the pool once the cache holds more than two batches
+        if (cache->count > 2 * TOOL_POOL_CACHE_SIZE)
+        {
+            void* first = cache->freeList;
+            void* last = first;
+            
+            for (u32 i = 1; i < TOOL_POOL_CACHE_SIZE; i++)
+            {
+                last = *(void**)last;
+            }
+            
+            cache->freeList = *(void**)last;
+            cache->count -= TOOL_POOL_CACHE_SIZE;
+            
+            PoolGive(cache->pool, first, last);
+        }
     }
     
-    void* ArenaAlloc(Arena* arena, u64 count, u64 size)
+    void PoolCacheFlush(PoolCache* cache)
     {
-        return ArenaAlloc(arena, count * size);
+        void* first = cache->freeList;
+        
+        if (first == nullptr)
+        {
+            return;
+        }
+        
+        void* last = first;
+        while (*(void**)last != nullptr)
+        {
+            last = *(void**)last;
+        }
+        
+        PoolGive(cache->pool, first, last);
+        
+        cache->freeList = nullptr;
+        cache->count = 0;
     }
     
     
@@ -672,6 +2072,9 @@ namespace Tool
         LoopAlloc(&circular->loop, requestedSize, requestedOverflowSize);
         circular->start = 0;
         circular->size = 0;
+        
+        TOOL_MEMORY_STATS_RECORD(circular->stats = MemoryStatsCreate("Circular", 
+            circular->loop.committed + circular->loop.mirrored, circular->loop.committed));
     }
     
     // Allocate space within the circular buffer. Nullptr indicates insufficient space.
@@ -686,6 +2089,25 @@ namespace Tool
         return CircularAlloc(circular, count * size);
     }
     
+    void* CircularAllocAligned(Circular* circular, u64 size, u64 alignment)
+    {
+        if (!LoopIsInitialized(&circular->loop))
+        {
+            Except("Cannot allocate onto a non-initialized Circular Allocator.");
+        }
+        
+        // The loop start and capacity are page multiples, so aligning the head offset aligns the address
+        u64 head = (circular->start + circular->size) % circular->loop.committed;
+        u64 padding = RoundToGranularity(head, alignment) - head;
+        
+        if (CircularAllocBegin(circular, padding + size) == nullptr)
+        {
+            return nullptr;
+        }
+        
+        return (u8*)CircularAllocEnd(circular, padding + size) + padding;
+    }
+    
     // Allocates space in two steps, similarly to the same Arena feature.
     void* CircularAllocBegin(Circular* circular, u64 reservedSize)
     {
@@ -728,6 +2150,8 @@ namespace Tool
         
         circular->size += actualSize;
         
+        TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordAlloc(circular->stats, actualSize));
+        
         return allocationLocation;
     }
     
@@ -761,6 +2185,8 @@ namespace Tool
             Except("Bookmark is invalid (outside the allocated region).");
         }
         
+        TOOL_MEMORY_STATS_RECORD(MemoryStatsRecordResize(circular->stats, circular->size, circular->size - offset));
+        
         circular->size -= offset;
         circular->start = bookmark;
     }
@@ -771,6 +2197,9 @@ namespace Tool
         LoopDealloc(&circular->loop);
         circular->start = 0;
         circular->size = 0;
+        
+        TOOL_MEMORY_STATS_RECORD(MemoryStatsDestroy(circular->stats));
+        TOOL_MEMORY_STATS_RECORD(circular->stats = nullptr);
     }
     
     
@@ -779,9 +2208,9 @@ namespace Tool
     
     //~ Allocator triggers
     
-    static void* AllocationTriggerClassic(u64 size, void* data)
+    static void* AllocationTriggerClassic(u64 size, u64 alignment, void* data)
     {
-        return ClassicAlloc(size);
+        return ClassicAllocAligned(size, alignment);
     }
     
     static void DeallocationTriggerClassic(void* target, void* data)
@@ -789,18 +2218,47 @@ namespace Tool
         ClassicDealloc(target);
     }
     
-    static void* AllocationTriggerArena(u64 size, void* data)
+    static void* AllocationTriggerArena(u64 size, u64 alignment, void* data)
+    {
+        return ArenaAllocAligned((Arena*)data, size, alignment);
+    }
+    
+    static void* AllocationTriggerCircular(u64 size, u64 alignment, void* data)
+    {
+        return CircularAllocAligned((Circular*)data, size, alignment);
+    }
+    
+    static void* AllocationTriggerPool(u64 size, u64 alignment, void* data)
     {
-        return ArenaAlloc((Arena*)data, size);
+        Pool* pool = (Pool*)data;
+        
+        if (size > pool->slotSize)
+        {
+            Except("Cannot allocate more than the slot size from a Pool. (%llu > %llu)", size, pool->slotSize);
+        }
+        
+        // Slots are placed at multiples of the slot size from a page-aligned start
+        if (pool->slotSize % alignment != 0)
+        {
+            Except("Cannot allocate with a larger alignment than the Pool slot size allows. (%llu, slot size %llu)", alignment, pool->slotSize);
+        }
+        
+        return PoolAlloc(pool);
     }
     
-    static void* AllocationTriggerCircular(u64 size, void* data)
+    static void DeallocationTriggerPool(void* target, void* data)
     {
-        return CircularAlloc((Circular*)data, size);
+        PoolDealloc((Pool*)data, target);
     }
     
     //~ Exposed allocator functions
     
+    Arena* ArenaScratchBegin(MemoryAllocator conflict)
+    {
+        Arena* arena = (Arena*)conflict.data;
+        return ArenaScratchBegin(&arena, conflict.allocate == &AllocationTriggerArena);
+    }
+    
     MemoryAllocator Allocator() // Heap
     {
         return { &AllocationTriggerClassic, &DeallocationTriggerClassic, nullptr };
@@ -816,9 +2274,19 @@ namespace Tool
         return { &AllocationTriggerCircular, nullptr, (void*)circular };
     }
     
+    MemoryAllocator Allocator(Pool* pool) // Pool
+    {
+        return { &AllocationTriggerPool, &DeallocationTriggerPool, (void*)pool };
+    }
+    
     void* AllocatorAlloc(MemoryAllocator allocator, u64 size)
     {
-        return allocator.allocate(size, allocator.data);
+        return allocator.allocate(size, TOOL_DEFAULT_ALIGNMENT, allocator.data);
+    }
+    
+    void* AllocatorAllocAligned(MemoryAllocator allocator, u64 size, u64 alignment)
+    {
+        return allocator.allocate(size, alignment, allocator.data);
     }
     
     void* AllocatorAlloc(MemoryAllocator allocator, u64 count, u64 size)
@@ -833,5 +2301,126 @@ namespace Tool
             return allocator.deallocate(target, allocator.data);
         }
     }
+    
+    
+    
+    //- Memory statistics
+    
+    //~ Memory statistics general implementation
+    
+#ifdef TOOL_MEMORY_STATS
+    
+    void MemoryStatsName(Arena* arena, const c8* name)
+    {
+        arena->stats->name = name;
+    }
+    
+    void MemoryStatsName(Circular* circular, const c8* name)
+    {
+        circular->stats->name = name;
+    }
+    
+    void MemoryStatsName(Pool* pool, const c8* name)
+    {
+        pool->stats->name = name;
+    }
+    
+    // Counters keep changing while they are copied, so each is read on its own
+    static void MemoryStatsCopy(MemoryStats* destination, MemoryStats* source)
+    {
+        destination->name = source->name;
+        destination->liveSize = AtomicLoadRelaxed(&source->liveSize);
+        destination->peakSize = AtomicLoadRelaxed(&source->peakSize);
+        destination->committedSize = AtomicLoadRelaxed(&source->committedSize);
+        destination->reservedSize = AtomicLoadRelaxed(&source->reservedSize);
+        destination->allocationCount = AtomicLoadRelaxed(&source->allocationCount);
+        destination->deallocationCount = AtomicLoadRelaxed(&source->deallocationCount);
+        destination->commitCount = AtomicLoadRelaxed(&source->commitCount);
+        destination->decommitCount = AtomicLoadRelaxed(&source->decommitCount);
+        
+        for (u32 i = 0; i < TOOL_MEMORY_STATS_BUCKET_COUNT; i++)
+        {
+            destination->sizeHistogram[i] = AtomicLoadRelaxed(&source->sizeHistogram[i]);
+        }
+        
+        destination->next = nullptr;
+    }
+    
+    u64 MemoryStatsSnapshot(MemoryStats* buffer, u64 capacity)
+    {
+        u64 count = 0;
+        
+        if (capacity > 0)
+        {
+            MemoryStatsCopy(&buffer[0], &heapStats);
+        }
+        count++;
+        
+        SpinLockAcquire(&memoryStatsLock);
+        TOOL_DEFER(SpinLockRelease(&memoryStatsLock));
+        
+        for (MemoryStats* stats = memoryStatsFirst; stats != nullptr; stats = stats->next)
+        {
+            if (count < capacity)
+            {
+                MemoryStatsCopy(&buffer[count], stats);
+            }
+            count++;
+        }
+        
+        return count;
+    }
+    
+#else
+    
+    void MemoryStatsName(Arena*, const c8*) {}
+    void MemoryStatsName(Circular*, const c8*) {}
+    void MemoryStatsName(Pool*, const c8*) {}
+    
+    u64 MemoryStatsSnapshot(MemoryStats*, u64)
+    {
+        return 0;
+    }
+    
+#endif
+    
+    const c8* MemoryStatsReport(Arena* arena)
+    {
+        // Allocators might register between counting and copying, which only truncates the report
+        Arena* scratch = ArenaScratchBegin(&arena, 1);
+        TOOL_DEFER(ArenaScratchEnd(scratch));
+        
+        u64 count = MemoryStatsSnapshot(nullptr, 0);
+        MemoryStats* snapshot = (MemoryStats*)ArenaAllocAligned(scratch, count * sizeof(MemoryStats), alignof(MemoryStats));
+        count = TOOL_MIN(count, MemoryStatsSnapshot(snapshot, count));
+        
+        // Every entry fits within a line of counters and a line per histogram bucket
+        u64 capacity = 1 + count * (256 + TOOL_MEMORY_STATS_BUCKET_COUNT * 48);
+        c8* report = (c8*)ArenaAlloc(arena, capacity);
+        u64 size = 0;
+        report[0] = 0;
+        
+        for (u64 i = 0; i < count; i++)
+        {
+            MemoryStats* stats = &snapshot[i];
+            
+            size += snprintf(report + size, capacity - size,
+                             "%s: live %llu, peak %llu, committed %llu, reserved %llu, "
+                             "allocations %llu, deallocations %llu, commits %llu, decommits %llu\n",
+                             stats->name != nullptr ? stats->name : "Unnamed",
+                             stats->liveSize, stats->peakSize, stats->committedSize, stats->reservedSize,
+                             stats->allocationCount, stats->deallocationCount, stats->commitCount, stats->decommitCount);
+            
+            for (u32 bucket = 0; bucket < TOOL_MEMORY_STATS_BUCKET_COUNT; bucket++)
+            {
+                if (stats->sizeHistogram[bucket] != 0)
+                {
+                    size += snprintf(report + size, capacity - size, "    [%llu, %llu): %llu\n",
+                                     1ull << bucket, 2ull << bucket, stats->sizeHistogram[bucket]);
+                }
+            }
+        }
+        
+        return report;
+    }
 }
-
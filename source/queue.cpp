@@ -0,0 +1,436 @@
+#include "queue.h"
+#include "threading.h"
+#include "memory.h"
+#include "atomic.h"
+#include "mathematics.h"
+
+
+
+namespace Tool
+{
+    //- Queue signal
+    
+    //~ Queue signal static helpers
+    
+    typedef b8 (*QueueAttempt)(void* queue, void* element);
+    
+    static u64 QueueCapacity(u64 capacity)
+    {
+        u64 result = 2;
+        while (result < capacity)
+        {
+            result <<= 1;
+        }
+        
+        return result;
+    }
+    
+    // Called after every successful operation, waking threads blocked on the opposite one
+    static void QueueSignalNotify(QueueSignal* signal, b8 all)
+    {
+        // Pairs with the registration in QueueBlock, so either the sleeper sees the change or this sees the sleeper
+        AtomicFence();
+        
+        if (AtomicLoadRelaxed(&signal->sleepers) != 0)
+        {
+            AtomicAdd(&signal->event, 1u);
+            
+            if (all)
+            {
+                FutexWakeAll(&signal->event);
+            }
+            else
+            {
+                FutexWake(&signal->event);
+            }
+        }
+    }
+    
+    static void QueueBlock(QueueSignal* signal, QueueAttempt attempt, void* queue, void* element)
+    {
+        for (i32 i = 0; i < TOOL_QUEUE_SPIN_COUNT; i++)
+        {
+            if (attempt(queue, element))
+            {
+                return;
+            }
+            
+            SpinPause();
+        }
+        
+        while (true)
+        {
+            u32 event = AtomicLoad(&signal->event);
+            AtomicAdd(&signal->sleepers, 1u);
+            
+            b8 done = attempt(queue, element);
+            if (!done)
+            {
+                FutexWait(&signal->event, event);
+            }
+            
+            AtomicAdd(&signal->sleepers, (u32)-1);
+            
+            if (done)
+            {
+                return;
+            }
+        }
+    }
+    
+    
+    
+    //- MPMC queue
+    
+    //~ MPMC queue static helpers
+    
+    static inline u64* MPMCQueueSlot(MPMCQueue* queue, u64 position)
+    {
+        return (u64*)(queue->slots + (position & queue->mask) * queue->stride);
+    }
+    
+    static b8 MPMCQueueAttemptPush(void* queue, void* element)
+    {
+        return MPMCQueueTryPush((MPMCQueue*)queue, element);
+    }
+    
+    static b8 MPMCQueueAttemptPop(void* queue, void* element)
+    {
+        return MPMCQueueTryPop((MPMCQueue*)queue, element);
+    }
+    
+    //~ MPMC queue general implementation
+    
+    void MPMCQueueCreate(MPMCQueue* queue, u64 capacity, u64 elementSize)
+    {
+        capacity = QueueCapacity(capacity);
+        
+        queue->mask = capacity - 1;
+        queue->elementSize = elementSize;
+        queue->stride = (sizeof(u64) + elementSize + sizeof(u64) - 1) & ~(sizeof(u64) - 1);
+        queue->slots = (u8*)ClassicAllocAligned(capacity * queue->stride, TOOL_CACHE_LINE_SIZE);
+        
+        // A slot is ready to be pushed when its sequence equals the position, and to be popped when it is one past
+        for (u64 i = 0; i < capacity; i++)
+        {
+            *MPMCQueueSlot(queue, i) = i;
+        }
+        
+        queue->head = 0;
+        queue->tail = 0;
+        queue->notEmpty = {};
+        queue->notFull = {};
+    }
+    
+    void MPMCQueueDestroy(MPMCQueue* queue)
+    {
+        ClassicDealloc(queue->slots);
+        queue->slots = nullptr;
+    }
+    
+    b8 MPMCQueueTryPush(MPMCQueue* queue, const void* element)
+    {
+        u64 position = AtomicLoadRelaxed(&queue->head);
+        u64* slot;
+        
+        while (true)
+        {
+            slot = MPMCQueueSlot(queue, position);
+            i64 difference = (i64)(AtomicLoad(slot) - position);
+            
+            if (difference == 0)
+            {
+                if (AtomicCompareExchange(&queue->head, &position, position + 1))
+                {
+                    break;
+                }
+            }
+            else if (difference < 0)
+            {
+                // The slot still holds the element of the previous lap
+                return false;
+            }
+            else
+            {
+                position = AtomicLoadRelaxed(&queue->head);
+            }
+        }
+        
+        Copy(slot + 1, element, queue->elementSize);
+        AtomicStore(slot, position + 1);
+        
+        QueueSignalNotify(&queue->notEmpty, false);
+        return true;
+    }
+    
+    b8 MPMCQueueTryPop(MPMCQueue* queue, void* element)
+    {
+        u64 position = AtomicLoadRelaxed(&queue->tail);
+        u64* slot;
+        
+        while (true)
+        {
+            slot = MPMCQueueSlot(queue, position);
+            i64 difference = (i64)(AtomicLoad(slot) - (position + 1));
+            
+            if (difference == 0)
+            {
+                if (AtomicCompareExchange(&queue->tail, &position, position + 1))
+                {
+                    break;
+                }
+            }
+            else if (difference < 0)
+            {
+                return false;
+            }
+            else
+            {
+                position = AtomicLoadRelaxed(&queue->tail);
+            }
+        }
+        
+        Copy(element, slot + 1, queue->elementSize);
+        AtomicStore(slot, position + queue->mask + 1);
+        
+        QueueSignalNotify(&queue->notFull, false);
+        return true;
+    }
+    
+    void MPMCQueuePush(MPMCQueue* queue, const void* element)
+    {
+        QueueBlock(&queue->notFull, MPMCQueueAttemptPush, queue, (void*)element);
+    }
+    
+    void MPMCQueuePop(MPMCQueue* queue, void* element)
+    {
+        QueueBlock(&queue->notEmpty, MPMCQueueAttemptPop, queue, element);
+    }
+    
+    u64 MPMCQueuePushBatch(MPMCQueue* queue, const void* elements, u64 count)
+    {
+        u64 position = AtomicLoadRelaxed(&queue->head);
+        u64 ready;
+        
+        // Claims the run of ready slots at the head in one exchange. Slots past the head cannot stop being ready,
+        // so the run stays valid as long as the head has not moved.
+        while (true)
+        {
+            ready = 0;
+            while (ready < count && AtomicLoad(MPMCQueueSlot(queue, position + ready)) == position + ready)
+            {
+                ready++;
+            }
+            
+            if (ready == 0)
+            {
+                if ((i64)(AtomicLoad(MPMCQueueSlot(queue, position)) - position) < 0)
+                {
+                    return 0;
+                }
+                
+                position = AtomicLoadRelaxed(&queue->head);
+                continue;
+            }
+            
+            if (AtomicCompareExchange(&queue->head, &position, position + ready))
+            {
+                break;
+            }
+        }
+        
+        for (u64 i = 0; i < ready; i++)
+        {
+            u64* slot = MPMCQueueSlot(queue, position + i);
+            Copy(slot + 1, (const u8*)elements + i * queue->elementSize, queue->elementSize);
+            AtomicStore(slot, position + i + 1);
+        }
+        
+        QueueSignalNotify(&queue->notEmpty, ready > 1);
+        return ready;
+    }
+    
+    u64 MPMCQueuePopBatch(MPMCQueue* queue, void* elements, u64 count)
+    {
+        u64 position = AtomicLoadRelaxed(&queue->tail);
+        u64 ready;
+        
+        while (true)
+        {
+            ready = 0;
+            while (ready < count && AtomicLoad(MPMCQueueSlot(queue, position + ready)) == position + ready + 1)
+            {
+                ready++;
+            }
+            
+            if (ready == 0)
+            {
+                if ((i64)(AtomicLoad(MPMCQueueSlot(queue, position)) - (position + 1)) < 0)
+                {
+                    return 0;
+                }
+                
+                position = AtomicLoadRelaxed(&queue->tail);
+                continue;
+            }
+            
+            if (AtomicCompareExchange(&queue->tail, &position, position + ready))
+            {
+                break;
+            }
+        }
+        
+        for (u64 i = 0; i < ready; i++)
+        {
+            u64* slot = MPMCQueueSlot(queue, position + i);
+            Copy((u8*)elements + i * queue->elementSize, slot + 1, queue->elementSize);
+            AtomicStore(slot, position + i + queue->mask + 1);
+        }
+        
+        QueueSignalNotify(&queue->notFull, ready > 1);
+        return ready;
+    }
+    
+    u64 MPMCQueueCount(const MPMCQueue* queue)
+    {
+        u64 tail = AtomicLoad(&queue->tail);
+        u64 head = AtomicLoad(&queue->head);
+        
+        return head > tail ? head - tail : 0;
+    }
+    
+    
+    
+    //- SPSC queue
+    
+    //~ SPSC queue static helpers
+    
+    static b8 SPSCQueueAttemptPush(void* queue, void* element)
+    {
+        return SPSCQueueTryPush((SPSCQueue*)queue, element);
+    }
+    
+    static b8 SPSCQueueAttemptPop(void* queue, void* element)
+    {
+        return SPSCQueueTryPop((SPSCQueue*)queue, element);
+    }
+    
+    // Copies a run of elements in or out of the ring, in two parts when it wraps around
+    static void SPSCQueueCopy(SPSCQueue* queue, u64 position, u8* outside, u64 count, b8 in)
+    {
+        u64 start = position & queue->mask;
+        u64 first = TOOL_MIN(count, queue->mask + 1 - start);
+        
+        u8* ring = queue->elements + start * queue->elementSize;
+        u64 firstSize = first * queue->elementSize;
+        u64 secondSize = (count - first) * queue->elementSize;
+        
+        if (in)
+        {
+            Copy(ring, outside, firstSize);
+            Copy(queue->elements, outside + firstSize, secondSize);
+        }
+        else
+        {
+            Copy(outside, ring, firstSize);
+            Copy(outside + firstSize, queue->elements, secondSize);
+        }
+    }
+    
+    //~ SPSC queue general implementation
+    
+    void SPSCQueueCreate(SPSCQueue* queue, u64 capacity, u64 elementSize)
+    {
+        capacity = QueueCapacity(capacity);
+        
+        queue->mask = capacity - 1;
+        queue->elementSize = elementSize;
+        queue->elements = (u8*)ClassicAllocAligned(capacity * elementSize, TOOL_CACHE_LINE_SIZE);
+        
+        queue->head = 0;
+        queue->cachedTail = 0;
+        queue->tail = 0;
+        queue->cachedHead = 0;
+        queue->notEmpty = {};
+        queue->notFull = {};
+    }
+    
+    void SPSCQueueDestroy(SPSCQueue* queue)
+    {
+        ClassicDealloc(queue->elements);
+        queue->elements = nullptr;
+    }
+    
+    b8 SPSCQueueTryPush(SPSCQueue* queue, const void* element)
+    {
+        return SPSCQueuePushBatch(queue, element, 1) == 1;
+    }
+    
+    b8 SPSCQueueTryPop(SPSCQueue* queue, void* element)
+    {
+        return SPSCQueuePopBatch(queue, element, 1) == 1;
+    }
+    
+    void SPSCQueuePush(SPSCQueue* queue, const void* element)
+    {
+        QueueBlock(&queue->notFull, SPSCQueueAttemptPush, queue, (void*)element);
+    }
+    
+    void SPSCQueuePop(SPSCQueue* queue, void* element)
+    {
+        QueueBlock(&queue->notEmpty, SPSCQueueAttemptPop, queue, element);
+    }
+    
+    u64 SPSCQueuePushBatch(SPSCQueue* queue, const void* elements, u64 count)
+    {
+        u64 head = queue->head;
+        u64 capacity = queue->mask + 1;
+        
+        if (capacity - (head - queue->cachedTail) < count)
+        {
+            queue->cachedTail = AtomicLoad(&queue->tail);
+        }
+        
+        count = TOOL_MIN(count, capacity - (head - queue->cachedTail));
+        if (count == 0)
+        {
+            return 0;
+        }
+        
+        SPSCQueueCopy(queue, head, (u8*)elements, count, true);
+        AtomicStore(&queue->head, head + count);
+        
+        QueueSignalNotify(&queue->notEmpty, false);
+        return count;
+    }
+    
+    u64 SPSCQueuePopBatch(SPSCQueue* queue, void* elements, u64 count)
+    {
+        u64 tail = queue->tail;
+        
+        if (queue->cachedHead - tail < count)
+        {
+            queue->cachedHead = AtomicLoad(&queue->head);
+        }
+        
+        count = TOOL_MIN(count, queue->cachedHead - tail);
+        if (count == 0)
+        {
+            return 0;
+        }
+        
+        SPSCQueueCopy(queue, tail, (u8*)elements, count, false);
+        AtomicStore(&queue->tail, tail + count);
+        
+        QueueSignalNotify(&queue->notFull, false);
+        return count;
+    }
+    
+    u64 SPSCQueueCount(const SPSCQueue* queue)
+    {
+        u64 tail = AtomicLoad(&queue->tail);
+        u64 head = AtomicLoad(&queue->head);
+        
+        return head - tail;
+    }
+}
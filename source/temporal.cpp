@@ -164,7 +164,33 @@ namespace Tool
     
 #if TOOL_UNIX
     
+    // Only the monotonic clock for now, counted in nanoseconds so that clocks and nanoseconds match
+    Timepoint TimepointNow()
+    {
+        timespec time;
+        clock_gettime(CLOCK_MONOTONIC, &time);
+        return (Timepoint)time.tv_sec * 1000000000 + time.tv_nsec;
+    }
+    
+    i64 NanosecondsFromTo(Timepoint from, Timepoint to)
+    {
+        return to - from;
+    }
+    
+    i64 NanosecondsSince(Timepoint then)
+    {
+        return TimepointNow() - then;
+    }
+    
+    i64 ClocksFromTo(Timepoint from, Timepoint to)
+    {
+        return to - from;
+    }
     
+    i64 ClocksSince(Timepoint then)
+    {
+        return TimepointNow() - then;
+    }
     
 #endif // TOOL_UNIX
     
@@ -1,6 +1,7 @@
 
 #include "text.h"
 #include "mathematics.h"
+#include "utility.h"
 
 
 
@@ -296,44 +297,6 @@ static inline u64 UTF8ToUTF16(const c8* utf8, u64 utf8_len, c16* utf16, u64 utf1
 
 namespace Tool
 {
-    //~ Working variables
-    
-    static u8* intBuffer = nullptr;
-    u64 intBufferSize = 0;
-    
-    static inline void SizeBuffer(u64 size)
-    {
-        if (intBufferSize >= size + 2)
-        {
-            return;
-        }
-        
-        u64 newSize = intBufferSize;
-        
-        if (newSize == 0)
-        {
-            newSize = 256;
-        }
-        
-        while (newSize < size + 2)
-        {
-            newSize *= 2;
-        }
-        
-        if (intBuffer == nullptr)
-        {
-            intBuffer = (u8*)ClassicAlloc(newSize);
-        }
-        else
-        {
-            ClassicRealloc((void**)&intBuffer, intBufferSize, newSize);
-        }
-        
-        intBufferSize = newSize;
-    }
-    
-    
-    
     //- Function definitions
     
     //~ C-string
@@ -426,14 +389,19 @@ namespace Tool
     
     s8 S8FromS16(s16 str, MemoryAllocator a)
     {
-        SizeBuffer(str.size / 2 + 1);
+        // A UTF-16 character never takes more than 3 bytes in UTF-8
+        Arena* scratch = ArenaScratchBegin(a);
+        TOOL_DEFER(ArenaScratchEnd(scratch));
+        
+        u64 capacity = str.size * 3 + 1;
+        c8* buffer = (c8*)ArenaAlloc(scratch, capacity, sizeof(c8));
         
         // Do the conversion
-        u64 size = UTF16ToUTF8(str.str, str.size, (c8*)intBuffer, intBufferSize);
+        u64 size = UTF16ToUTF8(str.str, str.size, buffer, capacity);
         
         // Form data structure and transfer text memory
         s8 newString = { (c8*)AllocatorAlloc(a, size + 1, sizeof(c8)), size };
-        Copy(newString.str, intBuffer, size, sizeof(c8));
+        Copy(newString.str, buffer, size, sizeof(c8));
         newString.str[size] = '\0';
         
         return newString;
@@ -454,14 +422,18 @@ namespace Tool
     {
         u64 cstrCount = CStr16Count(cstr, capacity);
         
-        SizeBuffer((cstrCount + 1) * sizeof(s8));
+        Arena* scratch = ArenaScratchBegin(a);
+        TOOL_DEFER(ArenaScratchEnd(scratch));
+        
+        u64 bufferCapacity = cstrCount * 3 + 1;
+        c8* buffer = (c8*)ArenaAlloc(scratch, bufferCapacity, sizeof(c8));
         
         // Do the conversion
-        u64 size = UTF16ToUTF8(cstr, cstrCount, (c8*)intBuffer, intBufferSize);
+        u64 size = UTF16ToUTF8(cstr, cstrCount, buffer, bufferCapacity);
         
         // Form data structure and transfer text memory
         s8 newString = { (c8*)AllocatorAlloc(a, size + 1, sizeof(c8)), size };
-        Copy(newString.str, intBuffer, size, sizeof(c8));
+        Copy(newString.str, buffer, size, sizeof(c8));
         newString.str[size] = '\0';
         
         return newString;
@@ -471,14 +443,19 @@ namespace Tool
     
     s16 S16FromS8(s8 str, MemoryAllocator a)
     {
-        SizeBuffer((str.size + 1) * 2);
+        // A UTF-8 string never holds more characters than bytes
+        Arena* scratch = ArenaScratchBegin(a);
+        TOOL_DEFER(ArenaScratchEnd(scratch));
+        
+        u64 capacity = str.size + 1;
+        c16* buffer = (c16*)ArenaAlloc(scratch, capacity, sizeof(c16));
         
         // Do the conversion
-        u64 size = UTF8ToUTF16(str.str, str.size, (c16*)intBuffer, intBufferSize);
+        u64 size = UTF8ToUTF16(str.str, str.size, buffer, capacity);
         
         // Form data structure and transfer text memory
         s16 newString = { (c16*)AllocatorAlloc(a, size + 1, sizeof(c16)), size };
-        Copy(newString.str, intBuffer, size, sizeof(c16));
+        Copy(newString.str, buffer, size, sizeof(c16));
         newString.str[size] = u'\0';
         
         return newString;
@@ -488,14 +465,18 @@ namespace Tool
     {
         u64 cstrSize = CStr8Size(cstr, capacity);
         
-        SizeBuffer((cstrSize + 1) * 2);
+        Arena* scratch = ArenaScratchBegin(a);
+        TOOL_DEFER(ArenaScratchEnd(scratch));
+        
+        u64 bufferCapacity = cstrSize + 1;
+        c16* buffer = (c16*)ArenaAlloc(scratch, bufferCapacity, sizeof(c16));
         
         // Do the conversion
-        u64 count = UTF8ToUTF16(cstr, cstrSize, (c16*)intBuffer, intBufferSize);
+        u64 count = UTF8ToUTF16(cstr, cstrSize, buffer, bufferCapacity);
         
         // Form data structure and transfer text memory
         s16 newString = { (c16*)AllocatorAlloc(a, count + 1, sizeof(c16)), count };
-        Copy(newString.str, intBuffer, count, sizeof(c16));
+        Copy(newString.str, buffer, count, sizeof(c16));
         newString.str[count] = u'\0';
         
         return newString;
@@ -1,5 +1,10 @@
 #include "threading.h"
 #include "exception.h"
+#include "memory.h"
+#include "atomic.h"
+#include "utility.h"
+#include "mathematics.h"
+#include "queue.h"
 
 
 
@@ -8,9 +13,36 @@
 //~ Unix
 #if defined(TOOL_UNIX)
 
-#include <sys/types.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef TOOL_LINUX
+#include <linux/futex.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
 #define TOOL_THREAD_T pthread_t
 
+struct HiddenThreadParams
+{
+    Tool::ThreadFunction function;
+    void* data;
+};
+
+// Parameters are allocated per thread, and released by the thread once it has started
+static void* ThreadIndirection(void* parameter)
+{
+    HiddenThreadParams params = *(HiddenThreadParams*)parameter;
+    Tool::ClassicDealloc(parameter);
+    
+    params.function(params.data);
+    
+    return nullptr;
+}
+
 //~ Windows
 #elif defined(TOOL_WINDOWS)
 
@@ -128,6 +160,251 @@ namespace Tool
         }
     }
     
+    i32 ThreadHardwareCount()
+    {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return (i32)info.dwNumberOfProcessors;
+    }
+    
+    Thread ThreadCurrent()
+    {
+        HANDLE handle = GetCurrentThread();
+        return *((Thread*)&handle);
+    }
+    
+    void ThreadSetAffinity(Thread thread, i32 logicalIndex)
+    {
+        HANDLE handle = *((HANDLE*)&thread);
+        
+        // Logical indices run across processor groups
+        GROUP_AFFINITY affinity = {};
+        while (affinity.Group < GetActiveProcessorGroupCount() && logicalIndex >= (i32)GetActiveProcessorCount(affinity.Group))
+        {
+            logicalIndex -= (i32)GetActiveProcessorCount(affinity.Group);
+            affinity.Group++;
+        }
+        
+        if (affinity.Group == GetActiveProcessorGroupCount())
+        {
+            Except("Logical processor index is out of range.");
+        }
+        
+        affinity.Mask = (KAFFINITY)1 << logicalIndex;
+        if (!SetThreadGroupAffinity(handle, &affinity, nullptr))
+        {
+            ExceptWindowsLast();
+        }
+    }
+    
+    i32 ThreadGetCurrentCore()
+    {
+        PROCESSOR_NUMBER number;
+        GetCurrentProcessorNumberEx(&number);
+        
+        i32 index = number.Number;
+        for (WORD i = 0; i < number.Group; i++)
+        {
+            index += (i32)GetActiveProcessorCount(i);
+        }
+        
+        return index;
+    }
+    
+#endif
+    
+    //~ Thread Unix implementation
+    
+#if defined(TOOL_UNIX)
+    
+    Thread ThreadCreate(ThreadFunction function, void* data)
+    {
+        HiddenThreadParams* params = (HiddenThreadParams*)ClassicAlloc(sizeof(HiddenThreadParams));
+        params->function = function;
+        params->data = data;
+        
+        pthread_t thread;
+        i32 result = pthread_create(&thread, nullptr, ThreadIndirection, params);
+        if (result != 0)
+        {
+            ClassicDealloc(params);
+            ExceptUnix(result);
+        }
+        
+        return (Thread)thread;
+    }
+    
+    void ThreadDetach(Thread thread)
+    {
+        i32 result = pthread_detach((pthread_t)thread);
+        if (result != 0)
+        {
+            ExceptUnix(result);
+        }
+    }
+    
+    void ThreadJoin(Thread thread)
+    {
+        i32 result = pthread_join((pthread_t)thread, nullptr);
+        if (result != 0)
+        {
+            ExceptUnix(result);
+        }
+    }
+    
+    b8 ThreadTryJoin(Thread thread)
+    {
+#ifdef TOOL_LINUX
+        i32 result = pthread_tryjoin_np((pthread_t)thread, nullptr);
+        switch (result)
+        {
+            case 0:
+            return true;
+            
+            case EBUSY:
+            return false;
+            
+            default:
+            ExceptUnix(result);
+            return false;
+        }
+#else
+        Except("ThreadTryJoin is not supported on this platform.");
+        return false;
+#endif
+    }
+    
+    i32 ThreadHardwareCount()
+    {
+        long count = sysconf(_SC_NPROCESSORS_ONLN);
+        return count > 0 ? (i32)count : 1;
+    }
+    
+    Thread ThreadCurrent()
+    {
+        return (Thread)pthread_self();
+    }
+    
+    void ThreadSetAffinity(Thread thread, i32 logicalIndex)
+    {
+#ifdef TOOL_LINUX
+        if (logicalIndex < 0 || logicalIndex >= CPU_SETSIZE)
+        {
+            Except("Logical processor index is out of range.");
+        }
+        
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(logicalIndex, &set);
+        
+        i32 result = pthread_setaffinity_np((pthread_t)thread, sizeof(set), &set);
+        if (result != 0)
+        {
+            ExceptUnix(result);
+        }
+#else
+        Except("ThreadSetAffinity is not supported on this platform.");
+#endif
+    }
+    
+    i32 ThreadGetCurrentCore()
+    {
+#ifdef TOOL_LINUX
+        i32 core = sched_getcpu();
+        if (core < 0)
+        {
+            ExceptErrno();
+        }
+        
+        return core;
+#else
+        Except("ThreadGetCurrentCore is not supported on this platform.");
+        return -1;
+#endif
+    }
+    
+#endif
+    
+    //- Futex
+    
+    //~ Futex Windows implementation
+    
+#if defined(TOOL_WINDOWS)
+    
+    b8 FutexWait(u32* address, u32 expected, i32 timeout)
+    {
+        if (WaitOnAddress(address, &expected, sizeof(u32), timeout < 0 ? INFINITE : (DWORD)timeout))
+        {
+            return true;
+        }
+        
+        if (GetLastError() != ERROR_TIMEOUT)
+        {
+            ExceptWindowsLast();
+        }
+        
+        return false;
+    }
+    
+    void FutexWake(u32* address)
+    {
+        WakeByAddressSingle(address);
+    }
+    
+    void FutexWakeAll(u32* address)
+    {
+        WakeByAddressAll(address);
+    }
+    
+#endif
+    
+    //~ Futex Linux implementation
+    
+#if defined(TOOL_LINUX)
+    
+    b8 FutexWait(u32* address, u32 expected, i32 timeout)
+    {
+        timespec duration = { timeout / 1000, (timeout % 1000) * 1000000l };
+        
+        long result = syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, expected, timeout < 0 ? nullptr : &duration, nullptr, 0);
+        if (result == 0)
+        {
+            return true;
+        }
+        
+        switch (errno)
+        {
+            case EAGAIN: // The value did not match
+            case EINTR:
+            return true;
+            
+            case ETIMEDOUT:
+            return false;
+            
+            default:
+            ExceptErrno();
+            return false;
+        }
+    }
+    
+    void FutexWake(u32* address)
+    {
+        syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+    }
+    
+    void FutexWakeAll(u32* address)
+    {
+        syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, I32_MAX, nullptr, nullptr, 0);
+    }
+    
+    // Milliseconds of a monotonic clock, for waits across several futex calls
+    static i64 LinuxMilliseconds()
+    {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (i64)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+    }
+    
 #endif
     
     //- Semaphore
@@ -191,6 +468,81 @@ namespace Tool
         }
     }
     
+#endif
+    
+    //~ Semaphore Linux implementation
+    
+#if defined(TOOL_LINUX)
+    
+    // Waiters are counted, so that posting only wakes through the kernel when a thread might be asleep
+    struct LinuxSemaphore
+    {
+        u32 value;
+        u32 waiters;
+    };
+    
+    Semaphore SemaphoreCreate(u32 value)
+    {
+        LinuxSemaphore* semaphore = (LinuxSemaphore*)ClassicAlloc(sizeof(LinuxSemaphore));
+        semaphore->value = value;
+        semaphore->waiters = 0;
+        
+        return (Semaphore)semaphore;
+    }
+    
+    void SemaphoreDestroy(Semaphore semaphore)
+    {
+        ClassicDealloc((void*)semaphore);
+    }
+    
+    void SemaphorePost(Semaphore semaphore)
+    {
+        LinuxSemaphore* s = (LinuxSemaphore*)semaphore;
+        
+        AtomicAdd(&s->value, 1u);
+        
+        if (AtomicLoad(&s->waiters) != 0)
+        {
+            FutexWake(&s->value);
+        }
+    }
+    
+    b8 SemaphoreTryWait(Semaphore semaphore) // Value of true indicates successful decrement
+    {
+        LinuxSemaphore* s = (LinuxSemaphore*)semaphore;
+        
+        u32 value = AtomicLoadRelaxed(&s->value);
+        while (value != 0)
+        {
+            if (AtomicCompareExchange(&s->value, &value, value - 1))
+            {
+                return true;
+            }
+        }
+        
+        return false;
+    }
+    
+    void SemaphoreWait(Semaphore semaphore)
+    {
+        if (SemaphoreTryWait(semaphore))
+        {
+            return;
+        }
+        
+        LinuxSemaphore* s = (LinuxSemaphore*)semaphore;
+        
+        // Registering before the final check keeps posts from missing this thread
+        AtomicAdd(&s->waiters, 1u);
+        
+        while (!SemaphoreTryWait(semaphore))
+        {
+            FutexWait(&s->value, 0);
+        }
+        
+        AtomicAdd(&s->waiters, (u32)-1);
+    }
+    
 #endif
     
     //- Mutex
@@ -250,5 +602,1114 @@ namespace Tool
     
 #endif
     
-}
-
+    //~ Mutex Linux implementation
+    
+#if defined(TOOL_LINUX)
+    
+    // The mutex is a single word: unlocked, locked, or locked with potential sleepers.
+    // Only unlocking a mutex with potential sleepers enters the kernel.
+    enum LinuxMutexState : u32
+    {
+        LinuxMutexUnlocked,
+        LinuxMutexLocked,
+        LinuxMutexContended
+    };
+    
+    Mutex MutexCreate()
+    {
+        u32* state = (u32*)ClassicAlloc(sizeof(u32));
+        *state = LinuxMutexUnlocked;
+        
+        return (Mutex)state;
+    }
+    
+    void MutexDestroy(Mutex mutex)
+    {
+        ClassicDealloc((void*)mutex);
+    }
+    
+    // Spins for the lock, then sleeps on it until the deadline (negative for none)
+    static b8 LinuxMutexLockSlow(u32* state, i64 deadline)
+    {
+        for (i32 i = 0; i < TOOL_MUTEX_SPIN_COUNT; i++)
+        {
+            u32 expected = LinuxMutexUnlocked;
+            if (AtomicLoadRelaxed(state) == LinuxMutexUnlocked && AtomicCompareExchange(state, &expected, (u32)LinuxMutexLocked))
+            {
+                return true;
+            }
+            
+            SpinPause();
+        }
+        
+        // From here on, the lock is taken as contended, as other sleepers might remain
+        while (AtomicExchange(state, (u32)LinuxMutexContended) != LinuxMutexUnlocked)
+        {
+            i32 timeout = -1;
+            
+            if (deadline >= 0)
+            {
+                i64 remaining = deadline - LinuxMilliseconds();
+                if (remaining <= 0)
+                {
+                    return false;
+                }
+                
+                timeout = (i32)remaining;
+            }
+            
+            FutexWait(state, LinuxMutexContended, timeout);
+        }
+        
+        return true;
+    }
+    
+    void MutexLock(Mutex mutex)
+    {
+        u32* state = (u32*)mutex;
+        
+        u32 expected = LinuxMutexUnlocked;
+        if (!AtomicCompareExchange(state, &expected, (u32)LinuxMutexLocked))
+        {
+            LinuxMutexLockSlow(state, -1);
+        }
+    }
+    
+    b8 MutexTryLock(Mutex mutex, i32 timeout)
+    {
+        u32* state = (u32*)mutex;
+        
+        u32 expected = LinuxMutexUnlocked;
+        if (AtomicCompareExchange(state, &expected, (u32)LinuxMutexLocked))
+        {
+            return true;
+        }
+        
+        if (timeout == 0)
+        {
+            return false;
+        }
+        
+        return LinuxMutexLockSlow(state, timeout < 0 ? -1 : LinuxMilliseconds() + timeout);
+    }
+    
+    void MutexUnlock(Mutex mutex)
+    {
+        u32* state = (u32*)mutex;
+        
+        if (AtomicExchange(state, (u32)LinuxMutexUnlocked) == LinuxMutexContended)
+        {
+            FutexWake(state);
+        }
+    }
+    
+#endif
+    
+    
+    //- Locks
+    
+    //~ Lock statistics
+    
+    // Statements only compiled in when lock statistics are enabled
+#ifdef TOOL_THREADING_STATS
+#define TOOL_THREADING_STATS_RECORD(...) __VA_ARGS__
+#else
+#define TOOL_THREADING_STATS_RECORD(...)
+#endif
+    
+    //~ Spin mutex general implementation
+    
+    enum SpinMutexState : u32
+    {
+        SpinMutexUnlocked,
+        SpinMutexLocked,
+        SpinMutexContended // Locked, with potential sleepers
+    };
+    
+    b8 SpinMutexTryLock(SpinMutex* mutex)
+    {
+        u32 expected = SpinMutexUnlocked;
+        if (AtomicCompareExchange(&mutex->state, &expected, (u32)SpinMutexLocked))
+        {
+            TOOL_THREADING_STATS_RECORD(AtomicAdd(&mutex->stats.acquisitions, 1ull));
+            return true;
+        }
+        
+        return false;
+    }
+    
+    void SpinMutexLock(SpinMutex* mutex)
+    {
+        if (SpinMutexTryLock(mutex))
+        {
+            return;
+        }
+        
+        TOOL_THREADING_STATS_RECORD(AtomicAdd(&mutex->stats.contentions, 1ull));
+        
+        // Spins up to twice the recent average, and moves the average towards this attempt
+        i32 spinCount = AtomicLoadRelaxed(&mutex->spinCount);
+        i32 maxSpinCount = TOOL_MIN(spinCount * 2 + 16, TOOL_SPIN_MUTEX_MAX_SPIN_COUNT);
+        
+        for (i32 i = 0; i < maxSpinCount; i++)
+        {
+            if (AtomicLoadRelaxed(&mutex->state) == SpinMutexUnlocked && SpinMutexTryLock(mutex))
+            {
+                AtomicStoreRelaxed(&mutex->spinCount, spinCount + (i - spinCount) / 8);
+                return;
+            }
+            
+            SpinPause();
+        }
+        
+        AtomicStoreRelaxed(&mutex->spinCount, spinCount + (maxSpinCount - spinCount) / 8);
+        
+        // From here on, the mutex is taken as contended, as other sleepers might remain
+        while (AtomicExchange(&mutex->state, (u32)SpinMutexContended) != SpinMutexUnlocked)
+        {
+            TOOL_THREADING_STATS_RECORD(AtomicAdd(&mutex->stats.sleeps, 1ull));
+            FutexWait(&mutex->state, SpinMutexContended);
+        }
+        
+        TOOL_THREADING_STATS_RECORD(AtomicAdd(&mutex->stats.acquisitions, 1ull));
+    }
+    
+    void SpinMutexUnlock(SpinMutex* mutex)
+    {
+        if (AtomicExchange(&mutex->state, (u32)SpinMutexUnlocked) == SpinMutexContended)
+        {
+            FutexWake(&mutex->state);
+        }
+    }
+    
+    //~ Ticket lock general implementation
+    
+    void TicketLockAcquire(TicketLock* lock)
+    {
+        u32 ticket = AtomicAdd(&lock->next, 1u);
+        u32 serving = AtomicLoad(&lock->serving);
+        
+        TOOL_THREADING_STATS_RECORD(AtomicAdd(&lock->stats.acquisitions, 1ull));
+        
+        if (serving == ticket)
+        {
+            return;
+        }
+        
+        TOOL_THREADING_STATS_RECORD(AtomicAdd(&lock->stats.contentions, 1ull));
+        
+        // Backs off in proportion to the number of threads ahead
+        for (i32 i = 0; i < TOOL_LOCK_SPIN_COUNT && serving != ticket; i++)
+        {
+            for (u32 j = 0; j < ticket - serving; j++)
+            {
+                SpinPause();
+            }
+            
+            serving = AtomicLoad(&lock->serving);
+        }
+        
+        // Registering as a sleeper before the final check keeps releases from missing this thread
+        while (serving != ticket)
+        {
+            AtomicAdd(&lock->sleepers, 1u);
+            
+            serving = AtomicLoad(&lock->serving);
+            if (serving != ticket)
+            {
+                TOOL_THREADING_STATS_RECORD(AtomicAdd(&lock->stats.sleeps, 1ull));
+                FutexWait(&lock->serving, serving);
+                serving = AtomicLoad(&lock->serving);
+            }
+            
+            AtomicAdd(&lock->sleepers, (u32)-1);
+        }
+    }
+    
+    void TicketLockRelease(TicketLock* lock)
+    {
+        AtomicAdd(&lock->serving, 1u);
+        
+        // The next ticket holder might be any of the sleepers
+        if (AtomicLoad(&lock->sleepers) != 0)
+        {
+            FutexWakeAll(&lock->serving);
+        }
+    }
+    
+    //~ Reader-writer lock general implementation
+    
+#define TOOL_RWLOCK_WRITER 0x80000000u  // Held by a writer
+#define TOOL_RWLOCK_WAITING 0x40000000u // Writers are waiting, so new readers wait as well
+#define TOOL_RWLOCK_READERS 0x3FFFFFFFu
+    
+    // Spins while the state blocks the caller, then sleeps, until the state no longer does
+    static void RWLockWait(RWLock* lock, u32 blocking, i32* spins)
+    {
+        if (*spins < TOOL_LOCK_SPIN_COUNT)
+        {
+            (*spins)++;
+            SpinPause();
+            return;
+        }
+        
+        // Registering as a sleeper before the final check keeps releases from missing this thread
+        AtomicAdd(&lock->sleepers, 1u);
+        
+        u32 state = AtomicLoad(&lock->state);
+        if (state & blocking)
+        {
+            TOOL_THREADING_STATS_RECORD(AtomicAdd(&lock->stats.sleeps, 1ull));
+            FutexWait(&lock->state, state);
+        }
+        
+        AtomicAdd(&lock->sleepers, (u32)-1);
+    }
+    
+    static void RWLockWake(RWLock* lock)
+    {
+        if (AtomicLoad(&lock->sleepers) != 0)
+        {
+            FutexWakeAll(&lock->state);
+        }
+    }
+    
+    b8 RWLockTryReadLock(RWLock* lock)
+    {
+        u32 state = AtomicLoadRelaxed(&lock->state);
+        
+        while (!(state & (TOOL_RWLOCK_WRITER | TOOL_RWLOCK_WAITING)))
+        {
+            if (AtomicCompareExchange(&lock->state, &state, state + 1))
+            {
+                TOOL_THREADING_STATS_RECORD(AtomicAdd(&lock->stats.acquisitions, 1ull));
+                return true;
+            }
+        }
+        
+        return false;
+    }
+    
+    void RWLockReadLock(RWLock* lock)
+    {
+        if (RWLockTryReadLock(lock))
+        {
+            return;
+        }
+        
+        TOOL_THREADING_STATS_RECORD(AtomicAdd(&lock->stats.contentions, 1ull));
+        
+        i32 spins = 0;
+        while (!RWLockTryReadLock(lock))
+        {
+            RWLockWait(lock, TOOL_RWLOCK_WRITER | TOOL_RWLOCK_WAITING, &spins);
+        }
+    }
+    
+    void RWLockReadUnlock(RWLock* lock)
+    {
+        u32 state = AtomicAdd(&lock->state, (u32)-1) - 1;
+        
+        // The last reader out lets waiting writers in
+        if ((state & TOOL_RWLOCK_READERS) == 0)
+        {
+            RWLockWake(lock);
+        }
+    }
+    
+    b8 RWLockTryWriteLock(RWLock* lock)
+    {
+        // Taking the lock clears the waiting flag, which remaining writers set again as they retry
+        u32 state = AtomicLoadRelaxed(&lock->state);
+        
+        while (!(state & (TOOL_RWLOCK_WRITER | TOOL_RWLOCK_READERS)))
+        {
+            if (AtomicCompareExchange(&lock->state, &state, TOOL_RWLOCK_WRITER))
+            {
+                TOOL_THREADING_STATS_RECORD(AtomicAdd(&lock->stats.acquisitions, 1ull));
+                return true;
+            }
+        }
+        
+        return false;
+    }
+    
+    void RWLockWriteLock(RWLock* lock)
+    {
+        if (RWLockTryWriteLock(lock))
+        {
+            return;
+        }
+        
+        TOOL_THREADING_STATS_RECORD(AtomicAdd(&lock->stats.contentions, 1ull));
+        
+        i32 spins = 0;
+        while (!RWLockTryWriteLock(lock))
+        {
+            u32 state = AtomicLoadRelaxed(&lock->state);
+            if (!(state & TOOL_RWLOCK_WAITING))
+            {
+                AtomicCompareExchange(&lock->state, &state, state | TOOL_RWLOCK_WAITING);
+            }
+            
+            RWLockWait(lock, TOOL_RWLOCK_WRITER | TOOL_RWLOCK_READERS, &spins);
+        }
+    }
+    
+    void RWLockWriteUnlock(RWLock* lock)
+    {
+        // An exchange rather than a store, so the release is ordered before the check for sleepers like in the other paths
+        AtomicExchange(&lock->state, 0u);
+        RWLockWake(lock);
+    }
+    
+    //- Barrier
+    
+    //~ Barrier general implementation
+    
+    void BarrierInit(Barrier* barrier, u32 count)
+    {
+        barrier->count = count;
+        barrier->arrived = 0;
+        barrier->generation = 0;
+        barrier->sleepers = 0;
+    }
+    
+    b8 BarrierWait(Barrier* barrier, BarrierFunction serial, void* data)
+    {
+        // Read before arriving, as the last thread bumps it once everyone has
+        u32 generation = AtomicLoad(&barrier->generation);
+        
+        if (AtomicAdd(&barrier->arrived, 1u) + 1 == barrier->count)
+        {
+            if (serial != nullptr)
+            {
+                serial(data);
+            }
+            
+            // Reset before releasing, as released threads might arrive for the next round right away
+            AtomicStoreRelaxed(&barrier->arrived, 0u);
+            AtomicAdd(&barrier->generation, 1u);
+            
+            if (AtomicLoad(&barrier->sleepers) != 0)
+            {
+                FutexWakeAll(&barrier->generation);
+            }
+            
+            return true;
+        }
+        
+        for (i32 i = 0; i < TOOL_BARRIER_SPIN_COUNT; i++)
+        {
+            if (AtomicLoad(&barrier->generation) != generation)
+            {
+                return false;
+            }
+            
+            SpinPause();
+        }
+        
+        // Registering as a sleeper before the final check keeps the last thread from missing this one
+        AtomicAdd(&barrier->sleepers, 1u);
+        
+        while (AtomicLoad(&barrier->generation) == generation)
+        {
+            FutexWait(&barrier->generation, generation);
+        }
+        
+        AtomicAdd(&barrier->sleepers, (u32)-1);
+        
+        return false;
+    }
+    
+    //- Thread array
+    
+    //~ Thread array general implementation
+    
+    static void ThreadArrayMain(void* data)
+    {
+        ThreadArray* array = (ThreadArray*)data;
+        i32 index = (i32)AtomicAdd(&array->started, 1u) + 1;
+        u32 generation = 0;
+        
+        while (true)
+        {
+            // Spin for the next dispatch first, as dispatches tend to follow each other closely
+            u32 current = AtomicLoad(&array->generation);
+            for (i32 i = 0; i < TOOL_THREAD_ARRAY_SPIN_COUNT && current == generation; i++)
+            {
+                SpinPause();
+                current = AtomicLoad(&array->generation);
+            }
+            
+            if (current == generation)
+            {
+                // Registering as a sleeper before the final check keeps dispatches from missing this thread
+                AtomicAdd(&array->sleepers, 1u);
+                
+                if (AtomicLoad(&array->generation) == generation)
+                {
+                    FutexWait(&array->generation, generation);
+                }
+                
+                AtomicAdd(&array->sleepers, (u32)-1);
+                continue;
+            }
+            
+            generation = current;
+            
+            if (AtomicLoad(&array->stopping))
+            {
+                break;
+            }
+            
+            array->function(array->data, index);
+            
+            if (AtomicAdd(&array->remaining, (u32)-1) == 1 && AtomicLoad(&array->waiting) != 0)
+            {
+                FutexWake(&array->remaining);
+            }
+        }
+    }
+    
+    // Publishes a new generation, waking sleeping threads if there are any
+    static void ThreadArrayDispatch(ThreadArray* array)
+    {
+        AtomicAdd(&array->generation, 1u);
+        
+        if (AtomicLoad(&array->sleepers) != 0)
+        {
+            FutexWakeAll(&array->generation);
+        }
+    }
+    
+    void ThreadArrayCreate(ThreadArray* array, i32 threadCount)
+    {
+        if (threadCount <= 0)
+        {
+            threadCount = ThreadHardwareCount();
+        }
+        
+        array->count = threadCount;
+        array->function = nullptr;
+        array->data = nullptr;
+        array->generation = 0;
+        array->sleepers = 0;
+        array->stopping = 0;
+        array->started = 0;
+        array->remaining = 0;
+        array->waiting = 0;
+        
+        array->threads = (Thread*)ClassicAlloc(threadCount, sizeof(Thread));
+        for (i32 i = 1; i < threadCount; i++)
+        {
+            array->threads[i] = ThreadCreate(ThreadArrayMain, array);
+        }
+    }
+    
+    void ThreadArrayDestroy(ThreadArray* array)
+    {
+        AtomicStore(&array->stopping, 1u);
+        ThreadArrayDispatch(array);
+        
+        for (i32 i = 1; i < array->count; i++)
+        {
+            ThreadJoin(array->threads[i]);
+        }
+        
+        ClassicDealloc(array->threads);
+        array->threads = nullptr;
+        array->count = 0;
+    }
+    
+    void ThreadArrayRun(ThreadArray* array, ThreadArrayFunction function, void* data)
+    {
+        array->function = function;
+        array->data = data;
+        AtomicStore(&array->remaining, (u32)array->count - 1);
+        
+        ThreadArrayDispatch(array);
+        
+        function(data, 0);
+        
+        u32 remaining = AtomicLoad(&array->remaining);
+        for (i32 i = 0; i < TOOL_THREAD_ARRAY_SPIN_COUNT && remaining != 0; i++)
+        {
+            SpinPause();
+            remaining = AtomicLoad(&array->remaining);
+        }
+        
+        // Registering as waiting before reading the count keeps the last thread from missing this one
+        while (remaining != 0)
+        {
+            AtomicStore(&array->waiting, 1u);
+            AtomicFence();
+            
+            remaining = AtomicLoad(&array->remaining);
+            if (remaining != 0)
+            {
+                FutexWait(&array->remaining, remaining);
+                remaining = AtomicLoad(&array->remaining);
+            }
+        }
+        
+        AtomicStore(&array->waiting, 0u);
+    }
+    
+    //- Parallel for
+    
+    //~ Parallel for general implementation
+    
+    struct ParallelForState
+    {
+        ParallelForFunction function;
+        void* data;
+        
+        i64 begin;
+        i64 end;
+        i64 grain;
+        i32 threadCount;
+        ParallelSchedule schedule;
+        
+        alignas(TOOL_CACHE_LINE_SIZE) i64 next; // Start of the unclaimed range, for dynamic and guided schedules
+    };
+    
+    static void ParallelForThread(void* data, i32 index)
+    {
+        ParallelForState* state = (ParallelForState*)data;
+        
+        switch (state->schedule)
+        {
+            case ParallelScheduleStatic:
+            {
+                i64 count = state->end - state->begin;
+                i64 block = (count + state->threadCount - 1) / state->threadCount;
+                block = (block + state->grain - 1) / state->grain * state->grain;
+                
+                i64 begin = state->begin + block * index;
+                i64 end = TOOL_MIN(begin + block, state->end);
+                
+                if (begin < end)
+                {
+                    state->function(state->data, begin, end, index);
+                }
+            } break;
+            
+            case ParallelScheduleDynamic:
+            {
+                while (true)
+                {
+                    i64 begin = AtomicAdd(&state->next, state->grain);
+                    if (begin >= state->end)
+                    {
+                        break;
+                    }
+                    
+                    state->function(state->data, begin, TOOL_MIN(begin + state->grain, state->end), index);
+                }
+            } break;
+            
+            case ParallelScheduleGuided:
+            {
+                i64 begin = AtomicLoadRelaxed(&state->next);
+                while (begin < state->end)
+                {
+                    i64 chunk = TOOL_MAX((state->end - begin) / (2 * state->threadCount), state->grain);
+                    i64 end = TOOL_MIN(begin + chunk, state->end);
+                    
+                    if (AtomicCompareExchange(&state->next, &begin, end))
+                    {
+                        state->function(state->data, begin, end, index);
+                        begin = AtomicLoadRelaxed(&state->next);
+                    }
+                }
+            } break;
+        }
+    }
+    
+    void ParallelFor(ThreadArray* array, i64 begin, i64 end, ParallelForFunction function, void* data,
+                     ParallelSchedule schedule, i64 grain)
+    {
+        i64 count = end - begin;
+        if (count <= 0)
+        {
+            return;
+        }
+        
+        if (grain <= 0)
+        {
+            // Several chunks per thread balance uneven iterations, without claiming too often
+            i64 chunks = schedule == ParallelScheduleStatic ? array->count : (i64)array->count * 8;
+            grain = TOOL_MAX((count + chunks - 1) / chunks, 1);
+        }
+        
+        if (count <= grain || array->count <= 1)
+        {
+            function(data, begin, end, 0);
+            return;
+        }
+        
+        ParallelForState state = {};
+        state.function = function;
+        state.data = data;
+        state.begin = begin;
+        state.end = end;
+        state.grain = grain;
+        state.threadCount = array->count;
+        state.schedule = schedule;
+        state.next = begin;
+        
+        ThreadArrayRun(array, ParallelForThread, &state);
+    }
+    
+    //- Thread pool
+    
+    //~ Thread pool general implementation
+    
+    // The worker running on the calling thread, if any
+    static thread_local ThreadPoolWorker* threadPoolWorker = nullptr;
+    
+    // Picks steal victims for threads outside of pools
+    static thread_local u32 threadPoolRandom = 0;
+    
+    // Slots are read while other threads might write them, so their fields are accessed atomically
+    static inline void ThreadPoolJobStore(ThreadPoolJob* slot, ThreadPoolFunction function, void* data)
+    {
+        AtomicStoreRelaxed(&slot->function, function);
+        AtomicStoreRelaxed(&slot->data, data);
+    }
+    
+    static inline ThreadPoolJob ThreadPoolJobLoad(ThreadPoolJob* slot)
+    {
+        return { AtomicLoadRelaxed(&slot->function), AtomicLoadRelaxed(&slot->data) };
+    }
+    
+    // Owner only. Value of false indicates a full deque.
+    static b8 ThreadPoolPush(ThreadPoolWorker* worker, ThreadPoolFunction function, void* data)
+    {
+        i64 bottom = AtomicLoadRelaxed(&worker->bottom);
+        i64 top = AtomicLoad(&worker->top);
+        
+        if (bottom - top >= TOOL_THREAD_POOL_DEQUE_SIZE)
+        {
+            return false;
+        }
+        
+        ThreadPoolJobStore(&worker->jobs[bottom & (TOOL_THREAD_POOL_DEQUE_SIZE - 1)], function, data);
+        AtomicStore(&worker->bottom, bottom + 1);
+        
+        return true;
+    }
+    
+    // Owner only. Takes the most recently pushed job.
+    static b8 ThreadPoolTake(ThreadPoolWorker* worker, ThreadPoolJob* job)
+    {
+        i64 bottom = AtomicLoadRelaxed(&worker->bottom) - 1;
+        AtomicStoreRelaxed(&worker->bottom, bottom);
+        AtomicFence();
+        i64 top = AtomicLoadRelaxed(&worker->top);
+        
+        if (top > bottom)
+        {
+            AtomicStoreRelaxed(&worker->bottom, bottom + 1);
+            return false;
+        }
+        
+        *job = ThreadPoolJobLoad(&worker->jobs[bottom & (TOOL_THREAD_POOL_DEQUE_SIZE - 1)]);
+        
+        // The last job might be stolen at the same time, in which case the top decides
+        b8 taken = true;
+        if (top == bottom)
+        {
+            taken = AtomicCompareExchange(&worker->top, &top, top + 1);
+            AtomicStoreRelaxed(&worker->bottom, bottom + 1);
+        }
+        
+        return taken;
+    }
+    
+    // Any thread. Takes the least recently pushed job.
+    static b8 ThreadPoolSteal(ThreadPoolWorker* victim, ThreadPoolJob* job)
+    {
+        i64 top = AtomicLoad(&victim->top);
+        AtomicFence();
+        i64 bottom = AtomicLoad(&victim->bottom);
+        
+        if (top >= bottom)
+        {
+            return false;
+        }
+        
+        *job = ThreadPoolJobLoad(&victim->jobs[top & (TOOL_THREAD_POOL_DEQUE_SIZE - 1)]);
+        return AtomicCompareExchange(&victim->top, &top, top + 1);
+    }
+    
+    static b8 ThreadPoolInject(ThreadPool* pool, ThreadPoolFunction function, void* data)
+    {
+        ThreadPoolJob job = { function, data };
+        return MPMCQueueTryPush(&pool->injected, &job);
+    }
+    
+    static b8 ThreadPoolTakeInjected(ThreadPool* pool, ThreadPoolJob* job)
+    {
+        return MPMCQueueTryPop(&pool->injected, job);
+    }
+    
+    static b8 ThreadPoolHasWork(ThreadPool* pool)
+    {
+        if (MPMCQueueCount(&pool->injected) != 0)
+        {
+            return true;
+        }
+        
+        for (i32 i = 0; i < pool->count; i++)
+        {
+            if (AtomicLoad(&pool->workers[i].top) < AtomicLoad(&pool->workers[i].bottom))
+            {
+                return true;
+            }
+        }
+        
+        return false;
+    }
+    
+    static void ThreadPoolWakeOne(ThreadPool* pool)
+    {
+        AtomicFence();
+        
+        if (AtomicLoadRelaxed(&pool->sleepers) != 0)
+        {
+            AtomicAdd(&pool->epoch, 1u);
+            FutexWake(&pool->epoch);
+        }
+    }
+    
+    // Looks for a job in the worker's own deque (if any), the shared queue, then the other deques from a random victim on
+    static b8 ThreadPoolFind(ThreadPool* pool, ThreadPoolWorker* self, ThreadPoolJob* job)
+    {
+        if (self != nullptr && ThreadPoolTake(self, job))
+        {
+            return true;
+        }
+        
+        if (ThreadPoolTakeInjected(pool, job))
+        {
+            return true;
+        }
+        
+        u32* random = self != nullptr ? &self->random : &threadPoolRandom;
+        if (*random == 0)
+        {
+            *random = (u32)(u64)random | 1;
+        }
+        
+        *random ^= *random << 13;
+        *random ^= *random >> 17;
+        *random ^= *random << 5;
+        
+        i32 start = (i32)(*random % (u32)pool->count);
+        for (i32 i = 0; i < pool->count; i++)
+        {
+            ThreadPoolWorker* victim = &pool->workers[(start + i) % pool->count];
+            
+            if (victim != self && ThreadPoolSteal(victim, job))
+            {
+                // More jobs might be waiting for sleeping workers
+                ThreadPoolWakeOne(pool);
+                return true;
+            }
+        }
+        
+        return false;
+    }
+    
+    static void ThreadPoolRun(ThreadPool* pool, ThreadPoolJob job)
+    {
+        job.function(job.data);
+        
+        if (AtomicAdd(&pool->pending, (u32)-1) == 1 && AtomicLoad(&pool->pendingWaiters) != 0)
+        {
+            FutexWakeAll(&pool->pending);
+        }
+    }
+    
+    static void ThreadPoolWorkerMain(void* data)
+    {
+        ThreadPoolWorker* worker = (ThreadPoolWorker*)data;
+        ThreadPool* pool = worker->pool;
+        threadPoolWorker = worker;
+        
+        while (true)
+        {
+            ThreadPoolJob job;
+            b8 found = false;
+            
+            for (i32 i = 0; i < TOOL_THREAD_POOL_SPIN_COUNT && !found; i++)
+            {
+                found = ThreadPoolFind(pool, worker, &job);
+                SpinPause();
+            }
+            
+            if (found)
+            {
+                ThreadPoolRun(pool, job);
+                continue;
+            }
+            
+            // Registering as a sleeper before checking for work keeps submissions from missing this worker
+            u32 epoch = AtomicLoad(&pool->epoch);
+            AtomicAdd(&pool->sleepers, 1u);
+            
+            b8 working = ThreadPoolHasWork(pool);
+            if (!working && AtomicLoad(&pool->stopping))
+            {
+                AtomicAdd(&pool->sleepers, (u32)-1);
+                break;
+            }
+            
+            if (!working)
+            {
+                FutexWait(&pool->epoch, epoch);
+            }
+            
+            AtomicAdd(&pool->sleepers, (u32)-1);
+        }
+        
+        threadPoolWorker = nullptr;
+    }
+    
+    void ThreadPoolCreate(ThreadPool* pool, i32 threadCount)
+    {
+        if (threadCount <= 0)
+        {
+            threadCount = ThreadHardwareCount();
+        }
+        
+        pool->count = threadCount;
+        pool->workers = (ThreadPoolWorker*)ClassicAllocAligned(threadCount * sizeof(ThreadPoolWorker), alignof(ThreadPoolWorker));
+        
+        MPMCQueueCreate(&pool->injected, TOOL_THREAD_POOL_INJECTION_SIZE, sizeof(ThreadPoolJob));
+        
+        pool->pending = 0;
+        pool->pendingWaiters = 0;
+        pool->epoch = 0;
+        pool->sleepers = 0;
+        pool->stopping = 0;
+        
+        // Every worker is set up before any starts, as workers steal from each other
+        for (i32 i = 0; i < threadCount; i++)
+        {
+            ThreadPoolWorker* worker = &pool->workers[i];
+            worker->top = 0;
+            worker->bottom = 0;
+            worker->jobs = (ThreadPoolJob*)ClassicAlloc(TOOL_THREAD_POOL_DEQUE_SIZE, sizeof(ThreadPoolJob));
+            worker->pool = pool;
+            worker->random = 0x9E3779B9u * (u32)(i + 1);
+        }
+        
+        for (i32 i = 0; i < threadCount; i++)
+        {
+            pool->workers[i].thread = ThreadCreate(ThreadPoolWorkerMain, &pool->workers[i]);
+        }
+    }
+    
+    void ThreadPoolDestroy(ThreadPool* pool)
+    {
+        ThreadPoolWait(pool);
+        
+        AtomicStore(&pool->stopping, 1u);
+        AtomicAdd(&pool->epoch, 1u);
+        FutexWakeAll(&pool->epoch);
+        
+        for (i32 i = 0; i < pool->count; i++)
+        {
+            ThreadJoin(pool->workers[i].thread);
+            ClassicDealloc(pool->workers[i].jobs);
+        }
+        
+        ClassicDealloc(pool->workers);
+        MPMCQueueDestroy(&pool->injected);
+        
+        pool->workers = nullptr;
+        pool->count = 0;
+    }
+    
+    void ThreadPoolSubmit(ThreadPool* pool, ThreadPoolFunction function, void* data)
+    {
+        AtomicAdd(&pool->pending, 1u);
+        
+        ThreadPoolWorker* worker = threadPoolWorker;
+        b8 queued = worker != nullptr && worker->pool == pool && ThreadPoolPush(worker, function, data);
+        
+        if (!queued && !ThreadPoolInject(pool, function, data))
+        {
+            ThreadPoolRun(pool, { function, data });
+            return;
+        }
+        
+        ThreadPoolWakeOne(pool);
+    }
+    
+    void ThreadPoolWait(ThreadPool* pool)
+    {
+        // The job calling would count as pending, and so would every other job waiting the same way
+        if (threadPoolWorker != nullptr && threadPoolWorker->pool == pool)
+        {
+            Except("Cannot wait for a ThreadPool from within one of its jobs.");
+        }
+        
+        while (true)
+        {
+            ThreadPoolJob job;
+            if (ThreadPoolFind(pool, nullptr, &job))
+            {
+                ThreadPoolRun(pool, job);
+                continue;
+            }
+            
+            // Registering as a waiter before reading the count keeps the last job from missing this thread
+            AtomicAdd(&pool->pendingWaiters, 1u);
+            u32 pending = AtomicLoad(&pool->pending);
+            
+            if (pending != 0 && !ThreadPoolHasWork(pool))
+            {
+                FutexWait(&pool->pending, pending);
+            }
+            
+            AtomicAdd(&pool->pendingWaiters, (u32)-1);
+            
+            if (pending == 0)
+            {
+                return;
+            }
+        }
+    }
+    
+    //- Job graph
+    
+    //~ Job graph general implementation
+    
+    void JobGraphInit(JobGraph* graph, Arena* arena)
+    {
+        graph->arena = arena;
+        graph->pool = nullptr;
+        graph->first = nullptr;
+        graph->last = nullptr;
+        graph->jobCount = 0;
+        graph->remaining = 0;
+    }
+    
+    JobGraphJob* JobGraphAdd(JobGraph* graph, ThreadPoolFunction function, void* data)
+    {
+        JobGraphJob* job = ArenaAlloc<JobGraphJob>(graph->arena);
+        job->function = function;
+        job->data = data;
+        job->graph = graph;
+        job->next = nullptr;
+        job->dependents = nullptr;
+        job->dependencyCount = 0;
+        job->remaining = 0;
+        
+        if (graph->last != nullptr)
+        {
+            graph->last->next = job;
+        }
+        else
+        {
+            graph->first = job;
+        }
+        
+        graph->last = job;
+        graph->jobCount++;
+        
+        return job;
+    }
+    
+    void JobGraphDepend(JobGraphJob* job, JobGraphJob* dependency)
+    {
+        JobGraphLink* link = ArenaAlloc<JobGraphLink>(job->graph->arena);
+        link->job = job;
+        link->next = dependency->dependents;
+        dependency->dependents = link;
+        
+        job->dependencyCount++;
+    }
+    
+    // Runs a job, then queues every dependent whose last dependency it was
+    static void JobGraphExecute(void* data)
+    {
+        JobGraphJob* job = (JobGraphJob*)data;
+        JobGraph* graph = job->graph;
+        u32* remaining = &graph->remaining;
+        
+        job->function(job->data);
+        
+        for (JobGraphLink* link = job->dependents; link != nullptr; link = link->next)
+        {
+            if (AtomicAdd(&link->job->remaining, (u32)-1) == 1)
+            {
+                ThreadPoolSubmit(graph->pool, JobGraphExecute, link->job);
+            }
+        }
+        
+        // The running thread may return and free the graph once the count reaches zero, so the last job
+        // wakes through the address taken beforehand, without reading the graph. Waking a freed address is harmless.
+        if (AtomicAdd(remaining, (u32)-1) == 1)
+        {
+            FutexWake(remaining);
+        }
+    }
+    
+    void JobGraphRun(JobGraph* graph, ThreadPool* pool)
+    {
+        if (graph->jobCount == 0)
+        {
+            return;
+        }
+        
+        graph->pool = pool;
+        
+        b8 rooted = false;
+        for (JobGraphJob* job = graph->first; job != nullptr; job = job->next)
+        {
+            job->remaining = job->dependencyCount;
+            rooted |= job->dependencyCount == 0;
+        }
+        
+        if (!rooted)
+        {
+            Except("Cannot run a JobGraph where every job has dependencies, which form a cycle.");
+        }
+        
+        AtomicStore(&graph->remaining, graph->jobCount);
+        
+        // Counters are all reset before any job starts, as jobs count down their dependents
+        for (JobGraphJob* job = graph->first; job != nullptr; job = job->next)
+        {
+            if (job->dependencyCount == 0)
+            {
+                ThreadPoolSubmit(pool, JobGraphExecute, job);
+            }
+        }
+        
+        ThreadPoolWorker* worker = threadPoolWorker;
+        ThreadPoolWorker* self = worker != nullptr && worker->pool == pool ? worker : nullptr;
+        
+        while (AtomicLoad(&graph->remaining) != 0)
+        {
+            ThreadPoolJob job;
+            if (ThreadPoolFind(pool, self, &job))
+            {
+                ThreadPoolRun(pool, job);
+                continue;
+            }
+            
+            // The last job always wakes, and the futex rechecks the count, so this thread cannot miss it
+            u32 remaining = AtomicLoad(&graph->remaining);
+            if (remaining != 0 && !ThreadPoolHasWork(pool))
+            {
+                FutexWait(&graph->remaining, remaining);
+            }
+        }
+    }
+}
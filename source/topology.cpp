@@ -0,0 +1,504 @@
+#include "topology.h"
+#include "exception.h"
+#include "memory.h"
+#include "atomic.h"
+#include "utility.h"
+#include "mathematics.h"
+
+#include <stdio.h>
+
+#ifdef TOOL_WINDOWS
+#include <Windows.h>
+#endif
+
+#ifdef TOOL_UNIX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define TOOL_TOPOLOGY_CPUID 1
+#elif defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define TOOL_TOPOLOGY_CPUID 1
+#endif
+
+
+
+namespace Tool
+{
+    //- CPU topology
+    
+    //~ CPU topology static helpers
+    
+    // Adds a cache kind, unless one of the same level and type is known already
+    static void TopologyAddCache(CPUTopology* topology, i32 level, CPUCacheType type, u64 size, u32 lineSize, i32 sharingCount)
+    {
+        for (i32 i = 0; i < topology->cacheCount; i++)
+        {
+            if (topology->caches[i].level == level && topology->caches[i].type == type)
+            {
+                return;
+            }
+        }
+        
+        if (topology->cacheCount == TOOL_TOPOLOGY_MAX_CACHES)
+        {
+            return;
+        }
+        
+        // Insertion keeps the caches sorted by level, then type
+        i32 i = topology->cacheCount;
+        while (i > 0 && (topology->caches[i - 1].level > level ||
+                         (topology->caches[i - 1].level == level && topology->caches[i - 1].type > type)))
+        {
+            topology->caches[i] = topology->caches[i - 1];
+            i--;
+        }
+        
+        topology->caches[i] = { level, type, size, lineSize, sharingCount };
+        topology->cacheCount++;
+        
+        if (type != CPUCacheTypeInstruction && (topology->cacheLineSize == 0 || level == 1))
+        {
+            topology->cacheLineSize = lineSize;
+        }
+    }
+    
+#ifdef TOOL_TOPOLOGY_CPUID
+    
+    static void TopologyCPUID(u32 leaf, u32 subleaf, u32 registers[4])
+    {
+#if defined(_MSC_VER) && !defined(__clang__)
+        __cpuidex((int*)registers, (int)leaf, (int)subleaf);
+#else
+        __cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+    }
+    
+    // Reads the deterministic cache parameters (leaf 4), for when the system does not describe the caches
+    static void TopologyCachesFromCPUID(CPUTopology* topology)
+    {
+        u32 registers[4];
+        TopologyCPUID(0, 0, registers);
+        
+        if (registers[0] < 4)
+        {
+            return;
+        }
+        
+        for (u32 subleaf = 0; subleaf < 16; subleaf++)
+        {
+            TopologyCPUID(4, subleaf, registers);
+            
+            u32 kind = registers[0] & 0x1F;
+            if (kind == 0)
+            {
+                break;
+            }
+            
+            CPUCacheType type = kind == 1 ? CPUCacheTypeData : kind == 2 ? CPUCacheTypeInstruction : CPUCacheTypeUnified;
+            i32 level = (registers[0] >> 5) & 0x7;
+            i32 sharingCount = (i32)((registers[0] >> 14) & 0xFFF) + 1;
+            
+            u32 lineSize = (registers[1] & 0xFFF) + 1;
+            u32 partitions = ((registers[1] >> 12) & 0x3FF) + 1;
+            u32 ways = ((registers[1] >> 22) & 0x3FF) + 1;
+            u32 sets = registers[2] + 1;
+            
+            TopologyAddCache(topology, level, type, (u64)ways * partitions * lineSize * sets, lineSize, sharingCount);
+        }
+    }
+    
+#endif
+    
+    //~ CPU topology Linux implementation
+    
+#ifdef TOOL_LINUX
+    
+    // Reads a small text file into the buffer, null-terminated. Value of false indicates a missing file.
+    static b8 LinuxReadText(const c8* path, c8* buffer, u64 capacity)
+    {
+        i32 fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return false;
+        }
+        
+        ssize_t size = read(fd, buffer, capacity - 1);
+        close(fd);
+        
+        buffer[size > 0 ? size : 0] = 0;
+        return size > 0;
+    }
+    
+    static i64 LinuxParseNumber(const c8** text)
+    {
+        i64 value = 0;
+        while (**text >= '0' && **text <= '9')
+        {
+            value = value * 10 + (**text - '0');
+            (*text)++;
+        }
+        
+        return value;
+    }
+    
+    static i64 LinuxReadNumber(const c8* path, i64 fallback)
+    {
+        c8 buffer[64];
+        if (!LinuxReadText(path, buffer, sizeof(buffer)))
+        {
+            return fallback;
+        }
+        
+        const c8* text = buffer;
+        return LinuxParseNumber(&text);
+    }
+    
+    // Parses lists such as "0-3,8,10-11" into a mask of TOOL_TOPOLOGY_MAX_LOGICAL entries, returning the number of entries
+    static i32 LinuxParseList(const c8* text, b8* mask)
+    {
+        i32 count = 0;
+        
+        while (*text >= '0' && *text <= '9')
+        {
+            i64 first = LinuxParseNumber(&text);
+            i64 last = first;
+            
+            if (*text == '-')
+            {
+                text++;
+                last = LinuxParseNumber(&text);
+            }
+            
+            for (i64 i = first; i <= last && i < TOOL_TOPOLOGY_MAX_LOGICAL; i++)
+            {
+                count += !mask[i];
+                mask[i] = true;
+            }
+            
+            if (*text == ',')
+            {
+                text++;
+            }
+        }
+        
+        return count;
+    }
+    
+    static void LinuxCachesFromSys(CPUTopology* topology, i32 cpu)
+    {
+        c8 path[128];
+        c8 buffer[4096];
+        
+        for (i32 index = 0; index < 16; index++)
+        {
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%i/cache/index%i/level", cpu, index);
+            i64 level = LinuxReadNumber(path, -1);
+            if (level < 0)
+            {
+                break;
+            }
+            
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%i/cache/index%i/type", cpu, index);
+            LinuxReadText(path, buffer, sizeof(buffer));
+            CPUCacheType type = buffer[0] == 'D' ? CPUCacheTypeData : buffer[0] == 'I' ? CPUCacheTypeInstruction : CPUCacheTypeUnified;
+            
+            // Sizes are given with a unit suffix, such as "48K"
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%i/cache/index%i/size", cpu, index);
+            LinuxReadText(path, buffer, sizeof(buffer));
+            const c8* text = buffer;
+            u64 size = (u64)LinuxParseNumber(&text);
+            size <<= *text == 'K' ? 10 : *text == 'M' ? 20 : *text == 'G' ? 30 : 0;
+            
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%i/cache/index%i/coherency_line_size", cpu, index);
+            u32 lineSize = (u32)LinuxReadNumber(path, 64);
+            
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%i/cache/index%i/shared_cpu_list", cpu, index);
+            b8 sharing[TOOL_TOPOLOGY_MAX_LOGICAL] = {};
+            i32 sharingCount = LinuxReadText(path, buffer, sizeof(buffer)) ? LinuxParseList(buffer, sharing) : 1;
+            
+            TopologyAddCache(topology, (i32)level, type, size, lineSize, sharingCount);
+        }
+    }
+    
+    void CPUTopologyQuery(CPUTopology* topology, Arena* arena)
+    {
+        *topology = {};
+        
+        c8 path[128];
+        c8 buffer[4096];
+        
+        b8 online[TOOL_TOPOLOGY_MAX_LOGICAL] = {};
+        if (LinuxReadText("/sys/devices/system/cpu/online", buffer, sizeof(buffer)))
+        {
+            topology->logicalCount = LinuxParseList(buffer, online);
+        }
+        else
+        {
+            topology->logicalCount = (i32)TOOL_MIN(sysconf(_SC_NPROCESSORS_ONLN), TOOL_TOPOLOGY_MAX_LOGICAL);
+            for (i32 i = 0; i < topology->logicalCount; i++)
+            {
+                online[i] = true;
+            }
+        }
+        
+        topology->logical = (CPULogical*)ArenaAllocAligned(arena, topology->logicalCount * sizeof(CPULogical), alignof(CPULogical));
+        
+        // Nodes list their processors, rather than the other way around
+        i16 nodes[TOOL_TOPOLOGY_MAX_LOGICAL] = {};
+        b8 nodeOnline[TOOL_TOPOLOGY_MAX_LOGICAL] = {};
+        
+        if (LinuxReadText("/sys/devices/system/node/online", buffer, sizeof(buffer)))
+        {
+            topology->nodeCount = LinuxParseList(buffer, nodeOnline);
+            
+            for (i32 node = 0; node < TOOL_TOPOLOGY_MAX_LOGICAL; node++)
+            {
+                if (!nodeOnline[node])
+                {
+                    continue;
+                }
+                
+                snprintf(path, sizeof(path), "/sys/devices/system/node/node%i/cpulist", node);
+                
+                b8 members[TOOL_TOPOLOGY_MAX_LOGICAL] = {};
+                if (LinuxReadText(path, buffer, sizeof(buffer)) && LinuxParseList(buffer, members) > 0)
+                {
+                    for (i32 cpu = 0; cpu < TOOL_TOPOLOGY_MAX_LOGICAL; cpu++)
+                    {
+                        nodes[cpu] = members[cpu] ? (i16)node : nodes[cpu];
+                    }
+                }
+            }
+        }
+        
+        topology->nodeCount = TOOL_MAX(topology->nodeCount, 1);
+        
+        // Physical cores are identified by their package and core ids, which are only unique together
+        i64 corePackages[TOOL_TOPOLOGY_MAX_LOGICAL];
+        i64 coreIds[TOOL_TOPOLOGY_MAX_LOGICAL];
+        i32 coreSiblings[TOOL_TOPOLOGY_MAX_LOGICAL];
+        
+        i64 packages[TOOL_TOPOLOGY_MAX_LOGICAL];
+        
+        i32 count = 0;
+        for (i32 cpu = 0; cpu < TOOL_TOPOLOGY_MAX_LOGICAL && count < topology->logicalCount; cpu++)
+        {
+            if (!online[cpu])
+            {
+                continue;
+            }
+            
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%i/topology/physical_package_id", cpu);
+            i64 packageId = LinuxReadNumber(path, 0);
+            
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%i/topology/core_id", cpu);
+            i64 coreId = LinuxReadNumber(path, cpu);
+            
+            i32 package = 0;
+            while (package < topology->packageCount && packages[package] != packageId)
+            {
+                package++;
+            }
+            
+            if (package == topology->packageCount)
+            {
+                packages[topology->packageCount++] = packageId;
+            }
+            
+            i32 core = 0;
+            while (core < topology->physicalCount && (corePackages[core] != packageId || coreIds[core] != coreId))
+            {
+                core++;
+            }
+            
+            if (core == topology->physicalCount)
+            {
+                corePackages[core] = packageId;
+                coreIds[core] = coreId;
+                coreSiblings[core] = 0;
+                topology->physicalCount++;
+            }
+            
+            CPULogical* logical = &topology->logical[count++];
+            logical->index = cpu;
+            logical->core = core;
+            logical->package = package;
+            logical->node = nodes[cpu];
+            logical->smt = coreSiblings[core]++;
+        }
+        
+        if (topology->logicalCount > 0)
+        {
+            LinuxCachesFromSys(topology, topology->logical[0].index);
+        }
+    
+#ifdef TOOL_TOPOLOGY_CPUID
+        if (topology->cacheCount == 0)
+        {
+            TopologyCachesFromCPUID(topology);
+        }
+#endif
+        
+        if (topology->cacheLineSize == 0)
+        {
+            topology->cacheLineSize = TOOL_CACHE_LINE_SIZE;
+        }
+    }
+    
+#endif
+    
+    //~ CPU topology Windows implementation
+    
+#ifdef TOOL_WINDOWS
+    
+    // Processor indices within all groups, as used by ThreadSetAffinity
+    static i32 WindowsProcessorIndex(WORD group, i32 bit)
+    {
+        i32 index = bit;
+        for (WORD i = 0; i < group; i++)
+        {
+            index += (i32)GetActiveProcessorCount(i);
+        }
+        
+        return index;
+    }
+    
+    void CPUTopologyQuery(CPUTopology* topology, Arena* arena)
+    {
+        *topology = {};
+        
+        DWORD size = 0;
+        GetLogicalProcessorInformationEx(RelationAll, nullptr, &size);
+        
+        Arena* scratch = ArenaScratchBegin(&arena, 1);
+        TOOL_DEFER(ArenaScratchEnd(scratch));
+        
+        u8* buffer = (u8*)ArenaAllocAligned(scratch, size, 16);
+        if (!GetLogicalProcessorInformationEx(RelationAll, (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)buffer, &size))
+        {
+            ExceptWindowsLast();
+        }
+        
+        topology->logicalCount = (i32)TOOL_MIN(GetActiveProcessorCount(ALL_PROCESSOR_GROUPS), TOOL_TOPOLOGY_MAX_LOGICAL);
+        topology->logical = (CPULogical*)ArenaAllocAligned(arena, topology->logicalCount * sizeof(CPULogical), alignof(CPULogical));
+        
+        for (i32 i = 0; i < topology->logicalCount; i++)
+        {
+            topology->logical[i] = { i, 0, 0, 0, 0 };
+        }
+        
+        for (DWORD offset = 0; offset < size;)
+        {
+            SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX* info = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION_EX*)(buffer + offset);
+            offset += info->Size;
+            
+            switch (info->Relationship)
+            {
+                case RelationProcessorCore:
+                case RelationProcessorPackage:
+                {
+                    b8 isCore = info->Relationship == RelationProcessorCore;
+                    i32 id = isCore ? topology->physicalCount++ : topology->packageCount++;
+                    i32 smt = 0;
+                    
+                    for (WORD g = 0; g < info->Processor.GroupCount; g++)
+                    {
+                        GROUP_AFFINITY* affinity = &info->Processor.GroupMask[g];
+                        for (i32 bit = 0; bit < 64; bit++)
+                        {
+                            i32 index = WindowsProcessorIndex(affinity->Group, bit);
+                            if ((affinity->Mask & (1ull << bit)) && index < topology->logicalCount)
+                            {
+                                if (isCore)
+                                {
+                                    topology->logical[index].core = id;
+                                    topology->logical[index].smt = smt++;
+                                }
+                                else
+                                {
+                                    topology->logical[index].package = id;
+                                }
+                            }
+                        }
+                    }
+                } break;
+                
+                case RelationNumaNode:
+                {
+                    topology->nodeCount++;
+                    
+                    GROUP_AFFINITY* affinity = &info->NumaNode.GroupMask;
+                    for (i32 bit = 0; bit < 64; bit++)
+                    {
+                        i32 index = WindowsProcessorIndex(affinity->Group, bit);
+                        if ((affinity->Mask & (1ull << bit)) && index < topology->logicalCount)
+                        {
+                            topology->logical[index].node = (i32)info->NumaNode.NodeNumber;
+                        }
+                    }
+                } break;
+                
+                case RelationCache:
+                {
+                    CACHE_RELATIONSHIP* cache = &info->Cache;
+                    CPUCacheType type = cache->Type == CacheData ? CPUCacheTypeData :
+                                        cache->Type == CacheInstruction ? CPUCacheTypeInstruction : CPUCacheTypeUnified;
+                    
+                    // Only the instance covering the first logical processor describes the cache kind
+                    if (cache->GroupMask.Group == 0 && (cache->GroupMask.Mask & 1))
+                    {
+                        i32 sharingCount = 0;
+                        for (i32 bit = 0; bit < 64; bit++)
+                        {
+                            sharingCount += (cache->GroupMask.Mask >> bit) & 1;
+                        }
+                        
+                        TopologyAddCache(topology, cache->Level, type, cache->CacheSize, cache->LineSize, sharingCount);
+                    }
+                } break;
+                
+                default: break;
+            }
+        }
+        
+        topology->nodeCount = TOOL_MAX(topology->nodeCount, 1);
+    
+#ifdef TOOL_TOPOLOGY_CPUID
+        if (topology->cacheCount == 0)
+        {
+            TopologyCachesFromCPUID(topology);
+        }
+#endif
+        
+        if (topology->cacheLineSize == 0)
+        {
+            topology->cacheLineSize = TOOL_CACHE_LINE_SIZE;
+        }
+    }
+    
+#endif
+    
+    //~ CPU topology general implementation
+    
+    const CPUCache* CPUTopologyCache(const CPUTopology* topology, i32 level, CPUCacheType type)
+    {
+        const CPUCache* result = nullptr;
+        
+        for (i32 i = 0; i < topology->cacheCount; i++)
+        {
+            const CPUCache* cache = &topology->caches[i];
+            
+            if (cache->level == level && (cache->type == type || cache->type == CPUCacheTypeUnified) &&
+                (result == nullptr || cache->size > result->size))
+            {
+                result = cache;
+            }
+        }
+        
+        return result;
+    }
+}
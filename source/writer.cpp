@@ -0,0 +1,287 @@
+#include "writer.h"
+#include "atomic.h"
+#include "utility.h"
+
+
+
+namespace Tool
+{
+    //- File writer
+    
+    //~ File writer static helpers
+    
+    static void FileWriterCheck(FileWriter* writer)
+    {
+        if (AtomicLoad(&writer->failed))
+        {
+            throw writer->failure;
+        }
+    }
+    
+    static void FileWriterFail(FileWriter* writer, const Exception* exception)
+    {
+        writer->failure = *exception;
+        AtomicStore(&writer->failed, 1u);
+    }
+    
+    // Called with the write lock held
+    static void FileWriterWritePending(FileWriter* writer)
+    {
+        SpinMutexLock(&writer->appendLock);
+        u64 start = writer->buffer.start;
+        u64 size = writer->buffer.size;
+        SpinMutexUnlock(&writer->appendLock);
+        
+        if (size == 0)
+        {
+            return;
+        }
+        
+        // Appends only touch the buffer past the pending bytes, so these are written without the append lock
+        FileWrite(writer->file, (u8*)writer->buffer.loop.start + start, size);
+        
+        SpinMutexLock(&writer->appendLock);
+        CircularPopToBookmark(&writer->buffer, (start + size) % writer->buffer.loop.committed);
+        SpinMutexUnlock(&writer->appendLock);
+        
+        AtomicStore(&writer->written, writer->written + size);
+    }
+    
+    // Writes and syncs until the positions are covered. Threads queued on the write lock meanwhile mostly find
+    // their positions covered once they get it, so that a single write or sync serves them all.
+    static void FileWriterDrain(FileWriter* writer, u64 writePosition, u64 syncPosition)
+    {
+        MutexLock(writer->writeLock);
+        TOOL_DEFER(MutexUnlock(writer->writeLock));
+        
+        FileWriterCheck(writer);
+        
+        try
+        {
+            if (writer->written < writePosition || writer->synced < syncPosition)
+            {
+                FileWriterWritePending(writer);
+            }
+            
+            if (writer->synced < syncPosition)
+            {
+                u64 written = writer->written;
+                FileSync(writer->file);
+                
+                AtomicStore(&writer->synced, written);
+                AtomicStore(&writer->lastSync, TimepointNow());
+            }
+        }
+        catch (Exception& exception)
+        {
+            FileWriterFail(writer, &exception);
+            throw;
+        }
+    }
+    
+    static u64 FileWriterPosition(FileWriter* writer, u64 position)
+    {
+        u64 appended = AtomicLoad(&writer->appended);
+        return position < appended ? position : appended;
+    }
+    
+    static void FileWriterThreadMain(void* data)
+    {
+        FileWriter* writer = (FileWriter*)data;
+        
+        while (true)
+        {
+            u32 event = AtomicLoad(&writer->event);
+            if (AtomicLoad(&writer->stop))
+            {
+                return;
+            }
+            
+            u64 appended = AtomicLoad(&writer->appended);
+            if (appended - AtomicLoad(&writer->written) < writer->threshold)
+            {
+                FutexWait(&writer->event, event, writer->flushInterval);
+                appended = AtomicLoad(&writer->appended);
+            }
+            
+            u64 syncPosition = 0;
+            if (writer->syncInterval >= 0 &&
+                NanosecondsSince(AtomicLoad(&writer->lastSync)) >= (i64)writer->syncInterval * 1000000)
+            {
+                syncPosition = appended;
+            }
+            
+            try
+            {
+                FileWriterDrain(writer, appended, syncPosition);
+            }
+            catch (Exception&)
+            {
+                // Kept in the writer, and raised by the next call of its users
+                return;
+            }
+        }
+    }
+    
+    //~ File writer general implementation
+    
+    void FileWriterCreate(FileWriter* writer, File file, u64 capacity, i32 flags, i32 flushInterval, i32 syncInterval)
+    {
+        *writer = {};
+        writer->file = file;
+        writer->flags = flags;
+        writer->flushInterval = flushInterval;
+        writer->syncInterval = syncInterval;
+        
+        CircularInit(&writer->buffer, capacity, capacity);
+        writer->threshold = writer->buffer.loop.committed / 4;
+        
+        writer->writeLock = MutexCreate();
+        writer->lastSync = TimepointNow();
+        
+        if (!(flags & FileWriterFlagsNoThread))
+        {
+            writer->thread = ThreadCreate(FileWriterThreadMain, writer);
+        }
+    }
+    
+    void FileWriterDestroy(FileWriter* writer)
+    {
+        if (!(writer->flags & FileWriterFlagsNoThread))
+        {
+            AtomicStore(&writer->stop, 1u);
+            AtomicAdd(&writer->event, 1u);
+            FutexWake(&writer->event);
+            
+            ThreadJoin(writer->thread);
+        }
+        
+        TOOL_DEFER(MutexDestroy(writer->writeLock); CircularDeInit(&writer->buffer));
+        
+        // Failures were already raised by the calls that found them
+        if (!AtomicLoad(&writer->failed))
+        {
+            u64 appended = writer->appended;
+            FileWriterDrain(writer, appended, writer->syncInterval >= 0 ? appended : 0);
+        }
+    }
+    
+    u64 FileWriterAppend(FileWriter* writer, const void* data, u64 size)
+    {
+        if (size < writer->buffer.loop.committed)
+        {
+            void* destination = FileWriterAppendBegin(writer, size);
+            Copy(destination, data, size);
+            return FileWriterAppendEnd(writer, size);
+        }
+        
+        MutexLock(writer->writeLock);
+        TOOL_DEFER(MutexUnlock(writer->writeLock));
+        
+        FileWriterCheck(writer);
+        
+        u64 appended;
+        try
+        {
+            // Records that don't fit are written directly, once the records before them are
+            while (true)
+            {
+                FileWriterWritePending(writer);
+                
+                SpinMutexLock(&writer->appendLock);
+                if (writer->buffer.size == 0)
+                {
+                    break;
+                }
+                
+                SpinMutexUnlock(&writer->appendLock);
+            }
+            
+            // Later appends wait on the append lock, so they stay after the record
+            TOOL_DEFER(SpinMutexUnlock(&writer->appendLock));
+            
+            FileWrite(writer->file, data, size);
+            
+            appended = writer->appended + size;
+            AtomicStore(&writer->appended, appended);
+            AtomicStore(&writer->written, writer->written + size);
+        }
+        catch (Exception& exception)
+        {
+            FileWriterFail(writer, &exception);
+            throw;
+        }
+        
+        return appended;
+    }
+    
+    void* FileWriterAppendBegin(FileWriter* writer, u64 reservedSize)
+    {
+        FileWriterCheck(writer);
+        
+        u64 capacity = writer->buffer.loop.committed;
+        if (reservedSize >= capacity)
+        {
+            Except("Cannot reserve %llu bytes on a file writer buffering less than %llu bytes.", reservedSize, capacity);
+        }
+        
+        SpinMutexLock(&writer->appendLock);
+        
+        // Full buffers are written by the appending thread, as waiting on the flush thread would take as long.
+        // Buffers are never filled completely, which would leave the pending bytes indistinguishable from none.
+        while (writer->buffer.size + reservedSize >= capacity)
+        {
+            u64 appended = writer->appended;
+            SpinMutexUnlock(&writer->appendLock);
+            
+            FileWriterDrain(writer, appended, 0);
+            
+            SpinMutexLock(&writer->appendLock);
+        }
+        
+        return CircularAllocBegin(&writer->buffer, reservedSize);
+    }
+    
+    u64 FileWriterAppendEnd(FileWriter* writer, u64 actualSize)
+    {
+        u64 pending = writer->buffer.size;
+        CircularAllocEnd(&writer->buffer, actualSize);
+        
+        u64 appended = writer->appended + actualSize;
+        AtomicStore(&writer->appended, appended);
+        
+        SpinMutexUnlock(&writer->appendLock);
+        
+        // Only the append crossing the threshold wakes the thread, keeping system calls off the others
+        if (!(writer->flags & FileWriterFlagsNoThread) && pending < writer->threshold &&
+            pending + actualSize >= writer->threshold)
+        {
+            AtomicAdd(&writer->event, 1u);
+            FutexWake(&writer->event);
+        }
+        
+        return appended;
+    }
+    
+    void FileWriterFlush(FileWriter* writer, u64 position)
+    {
+        position = FileWriterPosition(writer, position);
+        if (AtomicLoad(&writer->written) < position)
+        {
+            FileWriterDrain(writer, position, 0);
+        }
+        
+        FileWriterCheck(writer);
+    }
+    
+    void FileWriterSync(FileWriter* writer, u64 position)
+    {
+        position = FileWriterPosition(writer, position);
+        if (AtomicLoad(&writer->synced) < position)
+        {
+            FileWriterDrain(writer, position, position);
+        }
+        
+        FileWriterCheck(writer);
+    }
+}